@@ -0,0 +1,99 @@
+#!/usr/bin/env python
+"""
+Microbenchmarks that switch greenlets from C++, through the C API,
+so that no Python code runs in the timed loops and the interpreter
+adds as little noise as possible. The loops themselves are in
+``greenlet/tests/_bench_extension_cpp.cpp``.
+
+Results are per operation: one switch, one link of a chain, one
+greenlet created, and so on. Unless ``--affinity`` is given, the
+benchmark processes are pinned to a single CPU (the last one we're
+allowed to use, which is the least likely to be handling interrupts)
+to keep them from migrating.
+"""
+
+import os
+import sys
+
+import pyperf
+from greenlet.tests import _bench_extension_cpp as bench
+
+CHAIN_LENGTH = 10000
+# C frames of at least 128 bytes each.
+DEEP_SWITCH_DEPTHS = (16, 128, 1024)
+
+
+def bm_ping_pong(loops):
+    return bench.ping_pong(loops)
+
+
+def bm_deep_switch(loops, depth):
+    return bench.deep_switch(loops, depth)
+
+
+def bm_chain(loops):
+    return bench.chain(loops, CHAIN_LENGTH)
+
+
+def bm_create_destroy(loops):
+    return bench.create_destroy(loops)
+
+
+def bm_spawn(loops):
+    return bench.spawn(loops)
+
+
+def bm_spawn_native(loops):
+    return bench.spawn_native(loops)
+
+
+def bm_throw(loops):
+    return bench.throw(loops)
+
+
+def _pin_to_one_cpu():
+    if any(arg.startswith('--affinity') for arg in sys.argv):
+        return
+    if not hasattr(os, 'sched_getaffinity'):
+        return
+    cpu = max(os.sched_getaffinity(0))
+    sys.argv.append('--affinity=%d' % cpu)
+
+
+if __name__ == '__main__':
+    _pin_to_one_cpu()
+    runner = pyperf.Runner()
+    runner.bench_time_func(
+        'C API: switch between two greenlets',
+        bm_ping_pong,
+        # Each loop switches in and back out.
+        inner_loops=2
+    )
+    for depth in DEEP_SWITCH_DEPTHS:
+        runner.bench_time_func(
+            'C API: switch between two greenlets, %d C frames deep' % depth,
+            bm_deep_switch,
+            depth,
+            inner_loops=2
+        )
+    runner.bench_time_func(
+        'C API: chain(%d), per greenlet' % CHAIN_LENGTH,
+        bm_chain,
+        inner_loops=CHAIN_LENGTH
+    )
+    runner.bench_time_func(
+        'C API: create and destroy a greenlet',
+        bm_create_destroy,
+    )
+    runner.bench_time_func(
+        'C API: create, run and destroy a greenlet',
+        bm_spawn,
+    )
+    runner.bench_time_func(
+        'C API: create, run and destroy a native greenlet',
+        bm_spawn_native,
+    )
+    runner.bench_time_func(
+        'C API: throw into a greenlet',
+        bm_throw,
+    )
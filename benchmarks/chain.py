@@ -30,6 +30,37 @@ def bm_chain(loops):
     end = pyperf.perf_counter()
     return end - begin
 
+def _recurse(depth, func, *args):
+    if depth:
+        return _recurse(depth - 1, func, *args)
+    return func(*args)
+
+SPAWN_DEPTHS = (0, 25, 50, 100, 200)
+VARYING_CHAIN_GREENLET_COUNT = 10000
+
+def _chain_spawned_from_varying_depths(loops, fixed_base):
+    greenlet._greenlet.enable_fixed_spawn_base(fixed_base)
+    try:
+        begin = pyperf.perf_counter()
+        for _ in range(loops):
+            start_node = greenlet.getcurrent()
+            for i in range(VARYING_CHAIN_GREENLET_COUNT):
+                g = greenlet.greenlet(link)
+                _recurse(SPAWN_DEPTHS[i % len(SPAWN_DEPTHS)], g.switch, start_node)
+                start_node = g
+            x = start_node.switch(0)
+            assert x == VARYING_CHAIN_GREENLET_COUNT
+        end = pyperf.perf_counter()
+    finally:
+        greenlet._greenlet.enable_fixed_spawn_base(False)
+    return end - begin
+
+def bm_chain_varying_depth(loops):
+    return _chain_spawned_from_varying_depths(loops, False)
+
+def bm_chain_varying_depth_fixed_base(loops):
+    return _chain_spawned_from_varying_depths(loops, True)
+
 GETCURRENT_INNER_LOOPS = 10
 def bm_getcurrent(loops):
     getcurrent = greenlet.getcurrent
@@ -110,3 +141,11 @@ if __name__ == '__main__':
         'chain(%s)' % CHAIN_GREENLET_COUNT,
         bm_chain,
     )
+    runner.bench_time_func(
+        'chain(%s) spawned from varying depths' % VARYING_CHAIN_GREENLET_COUNT,
+        bm_chain_varying_depth,
+    )
+    runner.bench_time_func(
+        'chain(%s) spawned from varying depths, fixed spawn base' % VARYING_CHAIN_GREENLET_COUNT,
+        bm_chain_varying_depth_fixed_base,
+    )
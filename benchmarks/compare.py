@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+"""
+Compare the pyperf results of two builds of greenlet, and flag the
+benchmarks that got significantly slower.
+
+    python benchmarks/compare.py before.json after.json
+
+A benchmark is flagged when its mean time grew by more than
+``--threshold`` percent (5 by default) *and* a two-sample t-test says
+the difference isn't just noise. The exit status is 1 if anything
+was flagged, so this can gate a CI job.
+"""
+
+from __future__ import print_function
+
+import argparse
+import math
+import sys
+
+import pyperf
+
+
+def _t_score(before, after):
+    # Welch's t-test: the samples may have different variances.
+    n1, n2 = len(before), len(after)
+    if n1 < 2 or n2 < 2:
+        return 0.0
+    mean1 = sum(before) / n1
+    mean2 = sum(after) / n2
+    var1 = sum((x - mean1) ** 2 for x in before) / (n1 - 1)
+    var2 = sum((x - mean2) ** 2 for x in after) / (n2 - 1)
+    error = math.sqrt(var1 / n1 + var2 / n2)
+    if not error:
+        return float('inf') if mean1 != mean2 else 0.0
+    return (mean2 - mean1) / error
+
+
+def _format_time(seconds):
+    for unit, scale in (('s', 1), ('ms', 1e3), ('us', 1e6)):
+        if seconds * scale >= 1:
+            return '%.2f %s' % (seconds * scale, unit)
+    return '%.1f ns' % (seconds * 1e9)
+
+
+def _load(filename):
+    suite = pyperf.BenchmarkSuite.load(filename)
+    return dict((bench.get_name(), bench) for bench in suite.get_benchmarks())
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('before', help='pyperf JSON results of the baseline build')
+    parser.add_argument('after', help='pyperf JSON results of the build to check')
+    parser.add_argument('--threshold', type=float, default=5.0,
+                        help='percent slowdown to tolerate (default: %(default)s)')
+    parser.add_argument('--t-score', type=float, default=2.0,
+                        help='how many standard errors a change must be to count '
+                        '(default: %(default)s, about 95%% confidence)')
+    args = parser.parse_args(argv)
+
+    before = _load(args.before)
+    after = _load(args.after)
+    regressions = 0
+    width = max([len(name) for name in before] + [9])
+    print('%-*s %12s %12s %9s' % (width, 'Benchmark', 'Before', 'After', 'Change'))
+    for name in sorted(set(before) & set(after)):
+        old_values = before[name].get_values()
+        new_values = after[name].get_values()
+        old_mean = sum(old_values) / len(old_values)
+        new_mean = sum(new_values) / len(new_values)
+        change = (new_mean - old_mean) / old_mean * 100
+        significant = abs(_t_score(old_values, new_values)) >= args.t_score
+        if significant and change > args.threshold:
+            verdict = 'SLOWER'
+            regressions += 1
+        elif significant and change < -args.threshold:
+            verdict = 'faster'
+        else:
+            verdict = ''
+        print(('%-*s %12s %12s %+8.1f%% %s' % (
+            width, name, _format_time(old_mean), _format_time(new_mean), change, verdict)).rstrip())
+
+    for name in sorted(set(before) ^ set(after)):
+        print('%-*s only in %s' % (width, name, args.before if name in before else args.after))
+
+    if regressions:
+        print('\n%d benchmark(s) got slower by more than %s%%.' % (regressions, args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+"""
+Compare greenlet.Executor to splitting the same greenlets between threads
+up front.
+
+Each of ``--tasks`` greenlets blocks for a while (in ``time.sleep``,
+which releases the GIL, standing in for I/O or a C extension that
+does), and the first quarter of them take ``--skew`` times as long as
+the rest. Splitting them into one contiguous share per thread gives
+all the slow ones to the first thread or two; the executor lets the
+threads that run out of work take over what the busy ones haven't
+started yet.
+
+With the GIL, only time spent with the GIL released can overlap, so
+this is about keeping threads busy, not about running Python code on
+more than one core.
+
+    python benchmarks/executor_fanout.py --threads 4
+"""
+from __future__ import print_function
+
+import argparse
+import sys
+import threading
+import time
+
+import greenlet
+
+
+def _durations(args):
+    slow = args.tasks // 4
+    return ([args.work * args.skew] * slow
+            + [args.work] * (args.tasks - slow))
+
+
+def _static(args):
+    durations = _durations(args)
+    share = (len(durations) + args.threads - 1) // args.threads
+    def thread_main(mine):
+        for seconds in mine:
+            greenlet.greenlet(time.sleep).switch(seconds)
+    threads = [threading.Thread(target=thread_main,
+                                args=(durations[i * share:(i + 1) * share],))
+               for i in range(args.threads)]
+    start = time.time()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    return time.time() - start, 0
+
+
+def _executor(args):
+    executor = greenlet.Executor()
+    threads = [threading.Thread(target=executor.run)
+               for _ in range(args.threads)]
+    for thread in threads:
+        thread.start()
+    # Let them all get to waiting for work, so each gets its own queue
+    # to start with.
+    time.sleep(0.1)
+    start = time.time()
+    for seconds in _durations(args):
+        executor.submit(greenlet.greenlet(lambda seconds=seconds: time.sleep(seconds)))
+    executor.shutdown()
+    for thread in threads:
+        thread.join()
+    return time.time() - start, executor.steals
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--threads', type=int, default=4,
+                        help='worker threads (default: %(default)s)')
+    parser.add_argument('--tasks', type=int, default=400,
+                        help='greenlets to run (default: %(default)s)')
+    parser.add_argument('--work', type=float, default=0.001,
+                        help='seconds each fast greenlet blocks (default: %(default)s)')
+    parser.add_argument('--skew', type=int, default=10,
+                        help='how many times longer the slow ones block (default: %(default)s)')
+    args = parser.parse_args(argv)
+
+    ideal = sum(_durations(args)) / args.threads
+    print('%d greenlets, %d threads, %.3fs if perfectly balanced'
+          % (args.tasks, args.threads, ideal))
+    for name, func in (('split up front', _static), ('Executor', _executor)):
+        elapsed, steals = func(args)
+        print('%-16s %7.3fs  %4d steals' % (name, elapsed, steals))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
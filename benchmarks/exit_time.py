@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+"""
+Time how long the interpreter takes to exit with many suspended
+greenlets still around, under each ``greenlet.set_exit_policy()``.
+
+Each run is a child process that parks ``--greenlets`` greenlets (each
+suspended inside a ``try/finally``, a few frames down) in a module
+global, prints the time, and returns. The exit time is from then until
+the process is gone, as seen by this process. The best of
+``--repeat`` runs is reported.
+
+The code the greenlets run has globals of its own. Suspended frames
+keep their globals alive, so had it been defined in ``__main__``, the
+list of greenlets would still be referenced from those frames when
+the interpreter clears ``__main__``, and the greenlets would never be
+deallocated at all, under either policy.
+
+    python benchmarks/exit_time.py --greenlets 200000
+"""
+from __future__ import print_function
+
+import argparse
+import os
+import subprocess
+import sys
+import time
+
+CHILD = r"""
+import sys
+import time
+import greenlet
+
+PARK = '''
+import greenlet
+
+cleaned_up = [0]
+
+def park(depth):
+    if depth:
+        return park(depth - 1)
+    try:
+        greenlet.getcurrent().parent.switch()
+    finally:
+        cleaned_up[0] += 1
+'''
+
+park_globals = {{}}
+exec(PARK, park_globals)
+greenlet.set_exit_policy({policy!r})
+parked = []
+for _ in range({count}):
+    glet = greenlet.greenlet(park_globals['park'])
+    glet.switch(5)
+    parked.append(glet)
+del glet
+print(repr(time.time()))
+sys.stdout.flush()
+"""
+
+
+def _exit_seconds(policy, count):
+    env = dict(os.environ)
+    # Run against the same greenlet we're using.
+    import greenlet
+    env['PYTHONPATH'] = os.pathsep.join(
+        [os.path.dirname(os.path.dirname(os.path.abspath(greenlet.__file__)))]
+        + [p for p in env.get('PYTHONPATH', '').split(os.pathsep) if p])
+    process = subprocess.Popen(
+        [sys.executable, '-c', CHILD.format(policy=policy, count=count)],
+        stdout=subprocess.PIPE, env=env)
+    output = process.communicate()[0]
+    end = time.time()
+    if process.returncode:
+        raise SystemExit('The child process failed with status %s' % process.returncode)
+    return end - float(output.decode('ascii').split()[-1])
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--greenlets', type=int, default=100000,
+                        help='suspended greenlets at exit (default: %(default)s)')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='runs of each policy (default: %(default)s)')
+    args = parser.parse_args(argv)
+
+    for policy in ('kill', 'abandon'):
+        best = min(_exit_seconds(policy, args.greenlets) for _ in range(args.repeat))
+        print('%-8s %8d greenlets  exit took %7.3f s' % (policy, args.greenlets, best))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,106 @@
+#!/usr/bin/env python
+"""
+Compare how a forked worker gets rid of the suspended greenlets it
+inherited from the master: killing them, or ``after_fork_child()``.
+
+The master parks ``--greenlets`` greenlets, each with a saved stack
+``--depth`` Python frames deep, then forks ``--workers`` workers for
+each way. Each worker tears the greenlets down, then reports how long
+that took and how much memory it had to copy from the master
+(``Private_Dirty`` in ``/proc/self/smaps_rollup``, so Linux only). The
+medians are printed.
+
+    python benchmarks/fork_worker.py --greenlets 20000
+"""
+from __future__ import print_function
+
+import argparse
+import os
+import sys
+import time
+
+import greenlet
+
+
+def _park(depth):
+    if depth:
+        return _park(depth - 1)
+    try:
+        greenlet.getcurrent().parent.switch()
+    finally:
+        pass
+
+
+def _private_dirty():
+    with open('/proc/self/smaps_rollup') as f:
+        for line in f:
+            if line.startswith('Private_Dirty:'):
+                return int(line.split()[1]) * 1024
+    raise SystemExit('No Private_Dirty in smaps_rollup')
+
+
+def _kill():
+    greenlet.kill_all(greenlet.enumerate())
+
+
+def _discard():
+    greenlet.after_fork_child()
+
+
+def _worker(teardown, write_fd):
+    start = time.time()
+    teardown()
+    elapsed = time.time() - start
+    os.write(write_fd, ('%r %d' % (elapsed, _private_dirty())).encode('ascii'))
+
+
+def _run_workers(teardown, count):
+    results = []
+    for _ in range(count):
+        read_fd, write_fd = os.pipe()
+        pid = os.fork()
+        if not pid:
+            try:
+                _worker(teardown, write_fd)
+            finally:
+                os._exit(0)
+        os.close(write_fd)
+        with os.fdopen(read_fd) as f:
+            seconds, dirty = f.read().split()
+        os.waitpid(pid, 0)
+        results.append((float(seconds), int(dirty)))
+    return results
+
+
+def _median(values):
+    values = sorted(values)
+    return values[len(values) // 2]
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--greenlets', type=int, default=20000,
+                        help='suspended greenlets in the master (default: %(default)s)')
+    parser.add_argument('--depth', type=int, default=20,
+                        help='Python frames in each one (default: %(default)s)')
+    parser.add_argument('--workers', type=int, default=5,
+                        help='workers forked for each way (default: %(default)s)')
+    args = parser.parse_args(argv)
+
+    parked = []
+    for _ in range(args.greenlets):
+        glet = greenlet.greenlet(_park)
+        glet.switch(args.depth)
+        parked.append(glet)
+
+    for name, teardown in (('kill_all', _kill), ('after_fork_child', _discard)):
+        results = _run_workers(teardown, args.workers)
+        print('%-17s %7d greenlets  %8.1f ms  %8.1f MB copied' % (
+            name, args.greenlets,
+            _median(seconds for seconds, _ in results) * 1000,
+            _median(dirty for _, dirty in results) / 1048576.0))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
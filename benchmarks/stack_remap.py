@@ -0,0 +1,106 @@
+#!/usr/bin/env python
+"""
+Find the stack size at which moving pages with mremap beats copying
+them when greenlet saves a stack.
+
+Two greenlets with stacks of the same depth switch back and forth, so
+each switch saves one whole stack and restores the other.
+
+This needs greenlet compiled with ``G_USE_MREMAP_STACK_SAVE``, e.g.::
+
+    CPPFLAGS=-DG_USE_MREMAP_STACK_SAVE=1 pip install -e .
+"""
+
+import sys
+
+import pyperf
+import greenlet
+
+_greenlet = greenlet._greenlet
+
+SWITCH_INNER_LOOPS = 1000
+STACK_SIZES = [64 * 1024 * 2 ** i for i in range(7)] # 64KB to 4MB
+
+# Effectively never.
+NEVER = 1 << 62
+
+
+def _recurse(depth, func):
+    if depth:
+        return _recurse(depth - 1, func)
+    return func()
+
+
+def _saved_bytes(depth):
+    def run():
+        _recurse(depth, greenlet.getcurrent().parent.switch)
+    glet = greenlet.greenlet(run)
+    glet.switch()
+    saved = glet._stack_saved
+    glet.switch()
+    return saved
+
+
+def _depth_for(nbytes):
+    lo, hi = 0, 1
+    while _saved_bytes(hi) < nbytes:
+        lo, hi = hi, hi * 2
+    while lo < hi:
+        mid = (lo + hi) // 2
+        if _saved_bytes(mid) < nbytes:
+            lo = mid + 1
+        else:
+            hi = mid
+    return lo
+
+
+class Worker(greenlet.greenlet):
+    other = None
+
+    def __init__(self, depth):
+        greenlet.greenlet.__init__(self)
+        self.depth = depth
+
+    def _loop(self):
+        self.parent.switch()
+        for _ in range(SWITCH_INNER_LOOPS):
+            self.other.switch()
+
+    def run(self):
+        _recurse(self.depth, self._loop)
+
+
+def bm_switch(loops, depth, remap_threshold):
+    old_threshold = _greenlet.get_stack_remap_threshold()
+    _greenlet.set_stack_remap_threshold(remap_threshold)
+    try:
+        begin = pyperf.perf_counter()
+        for _ in range(loops):
+            gl1 = Worker(depth)
+            gl2 = Worker(depth)
+            gl1.other = gl2
+            gl2.other = gl1
+            gl1.switch()
+            gl2.switch()
+            gl1.switch()
+        end = pyperf.perf_counter()
+    finally:
+        _greenlet.set_stack_remap_threshold(old_threshold)
+    return end - begin
+
+
+if __name__ == '__main__':
+    if not _greenlet.GREENLET_USE_MREMAP_STACK_SAVE:
+        sys.exit("greenlet was not compiled with G_USE_MREMAP_STACK_SAVE")
+    sys.setrecursionlimit(max(sys.getrecursionlimit(), 100000))
+    runner = pyperf.Runner()
+    for nbytes in STACK_SIZES:
+        depth = _depth_for(nbytes)
+        for strategy, threshold in (('memcpy', NEVER), ('mremap', 0)):
+            runner.bench_time_func(
+                'switch with %dKB stacks, %s' % (nbytes // 1024, strategy),
+                bm_switch,
+                depth,
+                threshold,
+                inner_loops=SWITCH_INNER_LOOPS
+            )
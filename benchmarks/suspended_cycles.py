@@ -0,0 +1,113 @@
+#!/usr/bin/env python
+"""
+Check that memory stays flat when greenlets are abandoned while
+suspended, in cycles that run through their own frames.
+
+That's how long-lived servers used to grow: a request's greenlet
+parks waiting for something that never comes, a local (here, a
+handler object holding a callback to the greenlet) refers back to the
+greenlet, and nothing else refers to either. Each simulated request
+does exactly that. Every ``--report-every`` seconds this prints the
+process's resident memory and the number of greenlet objects still
+alive; both should level off once the garbage collector has warmed
+up.
+
+Only the locals of a suspended frame count: an object referenced
+only as an argument of the call that's suspended (say, ``handler``
+in ``hub.switch(handler)``) still keeps the greenlet alive.
+
+Runs for ``--duration`` seconds (use hours for a soak test), then
+exits with status 1 if resident memory over the last quarter of the
+run is more than ``--tolerance`` percent above the second quarter.
+
+    python benchmarks/suspended_cycles.py --duration 3600
+"""
+from __future__ import print_function
+
+import argparse
+import gc
+import os
+import sys
+import time
+
+import greenlet
+
+
+class Handler(object):
+
+    def __init__(self, glet, payload):
+        self.callback = glet.switch
+        self.payload = payload
+
+
+def _request(size):
+    me = greenlet.getcurrent()
+    handler = Handler(me, bytearray(size)) # pylint:disable=unused-variable
+    # Park; nothing ever resumes us. (Had we passed the handler to
+    # switch(), it would be on the interpreter's value stack for the
+    # call, which the collector can't see, and this would leak.)
+    me.parent.switch()
+
+
+def _rss():
+    try:
+        with open('/proc/self/statm') as f:
+            return int(f.read().split()[1]) * os.sysconf('SC_PAGE_SIZE')
+    except (IOError, OSError, ValueError):
+        import resource
+        maxrss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        # Bytes on macOS, kilobytes elsewhere.
+        return maxrss if sys.platform == 'darwin' else maxrss * 1024
+
+
+def _live_greenlets():
+    return sum(1 for o in gc.get_objects() if isinstance(o, greenlet.greenlet))
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--duration', type=float, default=60,
+                        help='seconds to run (default: %(default)s)')
+    parser.add_argument('--report-every', type=float, default=5,
+                        help='seconds between reports (default: %(default)s)')
+    parser.add_argument('--payload', type=int, default=4096,
+                        help='bytes each request holds on to (default: %(default)s)')
+    parser.add_argument('--tolerance', type=float, default=10.0,
+                        help='percent growth to allow (default: %(default)s)')
+    args = parser.parse_args(argv)
+
+    if not getattr(greenlet._greenlet, 'GREENLET_USE_SUSPENDED_GC', False):
+        print('This greenlet does not collect suspended greenlets; '
+              'expect memory to grow.', file=sys.stderr)
+
+    start = time.time()
+    next_report = start
+    requests = 0
+    samples = []
+    while True:
+        now = time.time()
+        if now >= next_report:
+            rss = _rss()
+            samples.append((now - start, rss))
+            print('%8.0fs %10d requests %8.1f MB RSS %8d greenlets' % (
+                now - start, requests, rss / 1048576.0, _live_greenlets()))
+            sys.stdout.flush()
+            next_report += args.report_every
+        if now - start >= args.duration:
+            break
+        for _ in range(1000):
+            greenlet.greenlet(_request).switch(args.payload)
+        requests += 1000
+
+    quarter = len(samples) // 4
+    if quarter < 1:
+        return 0
+    second = max(rss for _, rss in samples[quarter:2 * quarter])
+    last = max(rss for _, rss in samples[-quarter:])
+    growth = (last - second) * 100.0 / second
+    print('RSS grew %.1f%% from the second quarter to the last.' % growth)
+    return 1 if growth > args.tolerance else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
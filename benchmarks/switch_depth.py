@@ -0,0 +1,142 @@
+#!/usr/bin/env python
+"""
+Switch between greenlets whose stacks are deep enough that every
+switch saves and restores a given number of bytes, with the different
+ways greenlet has of doing that: plain memcpy, the non-temporal stack
+copy, and (where userfaultfd is usable) lazy restores.
+
+Each greenlet also does a little work on its own data between
+switches; that's the data that copying the other greenlet's stack
+can push out of the cache.
+"""
+
+import sys
+
+import pyperf
+import greenlet
+
+_greenlet = greenlet._greenlet
+
+SWITCH_INNER_LOOPS = 1000
+STACK_SIZES = (
+    ('4KB', 4 * 1024),
+    ('32KB', 32 * 1024),
+    ('256KB', 256 * 1024),
+)
+
+# With two greenlets, a saved stack is restored by the very next
+# switch; with many, it has gone cold by the time it is.
+RING_SIZES = (2, 64)
+
+# Effectively never.
+NEVER = 1 << 62
+
+# Stacks at least this big are restored lazily, when that's possible.
+LAZY_THRESHOLD = 16 * 1024
+
+
+def _recurse(depth, func):
+    if depth:
+        return _recurse(depth - 1, func)
+    return func()
+
+
+def _saved_bytes(depth):
+    # How much of its stack a greenlet that recursed to *depth* has
+    # to save when switching back to its parent.
+    def run():
+        _recurse(depth, greenlet.getcurrent().parent.switch)
+    glet = greenlet.greenlet(run)
+    glet.switch()
+    saved = glet._stack_saved
+    glet.switch()
+    return saved
+
+
+def _depth_for(nbytes):
+    lo, hi = 0, 1
+    while _saved_bytes(hi) < nbytes:
+        lo, hi = hi, hi * 2
+    while lo < hi:
+        mid = (lo + hi) // 2
+        if _saved_bytes(mid) < nbytes:
+            lo = mid + 1
+        else:
+            hi = mid
+    return lo
+
+
+class Worker(greenlet.greenlet):
+    other = None
+
+    def __init__(self, depth):
+        greenlet.greenlet.__init__(self)
+        self.depth = depth
+        # Data of this greenlet's own that it keeps using.
+        self.data = list(range(1024))
+
+    def _loop(self):
+        # Let the parent start the next one from the same place.
+        self.parent.switch()
+        data = self.data
+        for _ in range(SWITCH_INNER_LOOPS):
+            sum(data)
+            self.other.switch()
+
+    def run(self):
+        _recurse(self.depth, self._loop)
+
+
+def _bm_switch_depth(loops, depth, ring_size, copy_threshold, lazy_threshold):
+    old_copy_threshold = _greenlet.get_stack_copy_threshold()
+    _greenlet.set_stack_copy_threshold(copy_threshold)
+    _greenlet.set_lazy_stack_restore_threshold(lazy_threshold)
+    try:
+        begin = pyperf.perf_counter()
+        for _ in range(loops):
+            ring = [Worker(depth) for _ in range(ring_size)]
+            for i, glet in enumerate(ring):
+                glet.other = ring[(i + 1) % ring_size]
+                glet.switch()
+            ring[0].switch()
+        end = pyperf.perf_counter()
+    finally:
+        _greenlet.set_stack_copy_threshold(old_copy_threshold)
+        _greenlet.set_lazy_stack_restore_threshold(0)
+    return end - begin
+
+
+def _strategies():
+    result = [
+        ('memcpy', NEVER, 0),
+        (_greenlet.STACK_COPY_KERNEL + ' non-temporal', 0, 0),
+    ]
+    try:
+        _greenlet.set_lazy_stack_restore_threshold(LAZY_THRESHOLD)
+    except OSError:
+        pass
+    else:
+        _greenlet.set_lazy_stack_restore_threshold(0)
+        result.append(('lazy restore', NEVER, LAZY_THRESHOLD))
+    return result
+
+
+if __name__ == '__main__':
+    # Reaching the deeper stacks takes thousands of Python frames.
+    sys.setrecursionlimit(max(sys.getrecursionlimit(), 100000))
+    runner = pyperf.Runner()
+    for name, nbytes in STACK_SIZES:
+        depth = _depth_for(nbytes)
+        for ring_size in RING_SIZES:
+            for strategy, copy_threshold, lazy_threshold in _strategies():
+                runner.bench_time_func(
+                    'switch between %d greenlets with %s stacks, %s' % (
+                        ring_size, name, strategy
+                    ),
+                    _bm_switch_depth,
+                    depth,
+                    ring_size,
+                    copy_threshold,
+                    lazy_threshold,
+                    inner_loops=SWITCH_INNER_LOOPS * ring_size
+                )
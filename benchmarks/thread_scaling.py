@@ -0,0 +1,79 @@
+#!/usr/bin/env python
+"""
+Measure how switching throughput scales with the number of threads.
+
+Each thread has its own pair of greenlets that switch back and forth
+``--switches`` times; the threads share nothing but the interpreter.
+For 1, 2, 4, ... up to ``--max-threads`` threads, this prints the total
+switches per second and how that compares to one thread times the
+number of threads (100% is perfectly linear).
+
+With the GIL only one thread runs Python code at a time, so expect
+the total to stay about where it is for one thread. A build without
+the GIL is what this is meant to measure: there, nothing greenlet
+shares between threads should make that total fall short of linear.
+
+    python benchmarks/thread_scaling.py --max-threads 8
+"""
+from __future__ import print_function
+
+import argparse
+import sys
+import threading
+import time
+
+import greenlet
+
+
+def _switch_pair(count):
+    def run():
+        switch = greenlet.getcurrent().parent.switch
+        while True:
+            switch()
+    switch = greenlet.greenlet(run).switch
+    for _ in range(count):
+        switch()
+
+
+def _switches_per_second(nthreads, count):
+    go = threading.Event()
+    def thread_main():
+        go.wait()
+        _switch_pair(count)
+    threads = [threading.Thread(target=thread_main) for _ in range(nthreads)]
+    for thread in threads:
+        thread.start()
+    start = time.time()
+    go.set()
+    for thread in threads:
+        thread.join()
+    elapsed = time.time() - start
+    # Each call to switch() is two switches: there and back.
+    return 2.0 * count * nthreads / elapsed
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--max-threads', type=int, default=8,
+                        help='the most threads to try (default: %(default)s)')
+    parser.add_argument('--switches', type=int, default=200000,
+                        help='round trips in each thread (default: %(default)s)')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='runs of each thread count (default: %(default)s)')
+    args = parser.parse_args(argv)
+
+    single = None
+    nthreads = 1
+    while nthreads <= args.max_threads:
+        best = max(_switches_per_second(nthreads, args.switches)
+                   for _ in range(args.repeat))
+        if single is None:
+            single = best
+        print('%3d threads  %12.0f switches/s  %5.0f%% of linear' % (
+            nthreads, best, 100.0 * best / (single * nthreads)))
+        nthreads *= 2
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,323 @@
+#!/usr/bin/env python
+"""
+Benchmarks of the things real greenlet programs spend their time
+doing, beyond the basics in ``chain.py``: switching from deep in
+Python code, waking up many idle greenlets, freeing greenlets from
+the wrong thread, tracing, context variables, killing greenlets, and
+threads that come and go.
+
+To compare two builds, save the results of each and run
+``compare.py`` on them::
+
+    python benchmarks/workloads.py -o before.json
+    # ... rebuild ...
+    python benchmarks/workloads.py -o after.json
+    python benchmarks/compare.py before.json after.json
+"""
+
+import sys
+import threading
+
+import pyperf
+import greenlet
+
+SWITCH_INNER_LOOPS = 10000
+
+
+def _recurse(depth, func):
+    if depth:
+        return _recurse(depth - 1, func)
+    return func()
+
+
+class PingPong(greenlet.greenlet):
+    """
+    Switches back to its parent, *count* times, from *depth* Python
+    frames down.
+    """
+
+    def __init__(self, count, depth=0):
+        greenlet.greenlet.__init__(self)
+        self.count = count
+        self.depth = depth
+
+    def _loop(self):
+        switch = self.parent.switch
+        for _ in range(self.count):
+            switch()
+
+    def run(self):
+        _recurse(self.depth, self._loop)
+
+
+def _time_ping_pong(loops, depth=0):
+    total = 0
+    for _ in range(loops):
+        glet = PingPong(SWITCH_INNER_LOOPS, depth)
+        switch = glet.switch
+        begin = pyperf.perf_counter()
+        for _ in range(SWITCH_INNER_LOOPS):
+            switch()
+        total += pyperf.perf_counter() - begin
+        switch()
+    return total
+
+
+PYTHON_DEPTHS = (10, 100, 500)
+
+def bm_switch_deep_python(loops, depth):
+    # Both sides of each switch are *depth* frames down.
+    return _recurse(depth, lambda: _time_ping_pong(loops, depth))
+
+
+IDLE_GREENLET_COUNT = 100000
+_idle = []
+
+def _idle_loop():
+    switch = greenlet.getcurrent().parent.switch
+    while True:
+        switch()
+
+def bm_idle_round_robin(loops):
+    # Create them once; each round of the benchmark wakes up every
+    # one of them, one after the other, as an event loop would.
+    if not _idle:
+        for _ in range(IDLE_GREENLET_COUNT):
+            glet = greenlet.greenlet(_idle_loop)
+            glet.switch()
+            _idle.append(glet)
+    switches = [glet.switch for glet in _idle]
+    begin = pyperf.perf_counter()
+    for _ in range(loops):
+        for switch in switches:
+            switch()
+    return pyperf.perf_counter() - begin
+
+
+CROSS_THREAD_BATCH = 1000
+
+def _suspended(_):
+    greenlet.getcurrent().parent.switch()
+
+def bm_cross_thread_dealloc(loops):
+    # Greenlets started in one thread and released in another have to
+    # be queued (in the thread state's ``deleteme`` list) and killed
+    # by their own thread, the next time it uses greenlet.
+    batches = []
+    ready = threading.Event()
+    released = threading.Event()
+    elapsed = []
+
+    def worker():
+        for _ in range(loops):
+            batch = []
+            for _ in range(CROSS_THREAD_BATCH):
+                glet = greenlet.greenlet(_suspended)
+                glet.switch(None)
+                batch.append(glet)
+            batches.append(batch)
+            del batch, glet
+            ready.set()
+            released.wait()
+            released.clear()
+            begin = pyperf.perf_counter()
+            # This is what kills them.
+            greenlet.getcurrent()
+            elapsed.append(pyperf.perf_counter() - begin)
+
+    thread = threading.Thread(target=worker)
+    thread.start()
+    total = 0
+    for _ in range(loops):
+        ready.wait()
+        ready.clear()
+        batch = batches.pop()
+        begin = pyperf.perf_counter()
+        del batch[:]
+        total += pyperf.perf_counter() - begin
+        released.set()
+    thread.join()
+    return total + sum(elapsed)
+
+
+def _tracer(_event, _args):
+    pass
+
+def bm_switch_traced(loops, tracer):
+    old = greenlet.settrace(tracer)
+    try:
+        return _time_ping_pong(loops)
+    finally:
+        greenlet.settrace(old)
+
+
+CONTEXTVAR_GREENLETS = 2
+
+def bm_contextvars_across_switches(loops):
+    import contextvars
+    var = contextvars.ContextVar('var')
+
+    class Reader(greenlet.greenlet):
+        other = None
+        def run(self):
+            var.set(self)
+            get = var.get
+            switch = self.other.switch
+            for _ in range(SWITCH_INNER_LOOPS):
+                assert get() is self
+                switch()
+
+    total = 0
+    for _ in range(loops):
+        first = Reader()
+        second = Reader()
+        first.other = second
+        second.other = first
+        for glet in first, second:
+            glet.gr_context = contextvars.Context()
+        begin = pyperf.perf_counter()
+        first.switch()
+        total += pyperf.perf_counter() - begin
+    return total
+
+
+KILL_INNER_LOOPS = 1000
+
+def _start_suspended():
+    glets = [greenlet.greenlet(_suspended) for _ in range(KILL_INNER_LOOPS)]
+    for glet in glets:
+        glet.switch(None)
+    return glets
+
+def bm_throw_into_suspended(loops):
+    total = 0
+    for _ in range(loops):
+        glets = _start_suspended()
+        begin = pyperf.perf_counter()
+        for glet in glets:
+            try:
+                glet.throw(ValueError)
+            except ValueError:
+                pass
+        total += pyperf.perf_counter() - begin
+    return total
+
+def bm_kill_suspended(loops):
+    total = 0
+    for _ in range(loops):
+        glets = _start_suspended()
+        begin = pyperf.perf_counter()
+        # Dropping the last reference raises GreenletExit in each one.
+        del glets[:]
+        total += pyperf.perf_counter() - begin
+    return total
+
+def bm_kill_by_throw(loops):
+    total = 0
+    for _ in range(loops):
+        glets = _start_suspended()
+        begin = pyperf.perf_counter()
+        for glet in glets:
+            if glet:
+                glet.throw()
+        total += pyperf.perf_counter() - begin
+    return total
+
+def bm_kill_all(loops):
+    total = 0
+    for _ in range(loops):
+        glets = _start_suspended()
+        begin = pyperf.perf_counter()
+        greenlet.kill_all(glets)
+        total += pyperf.perf_counter() - begin
+    return total
+
+
+def _thread_main(switch):
+    greenlet.getcurrent()
+    if switch:
+        greenlet.greenlet(lambda: None).switch()
+
+def bm_thread_churn(loops, switch):
+    # Each thread gets its own main greenlet, which has to be cleaned
+    # up after the thread exits.
+    begin = pyperf.perf_counter()
+    for _ in range(loops):
+        thread = threading.Thread(target=_thread_main, args=(switch,))
+        thread.start()
+        thread.join()
+    # Let the last one be cleaned up.
+    greenlet.getcurrent()
+    return pyperf.perf_counter() - begin
+
+
+if __name__ == '__main__':
+    sys.setrecursionlimit(max(sys.getrecursionlimit(), 10000))
+    runner = pyperf.Runner()
+    for depth in PYTHON_DEPTHS:
+        runner.bench_time_func(
+            'switch between two greenlets %d Python frames deep' % depth,
+            bm_switch_deep_python,
+            depth,
+            # Each loop switches in and back out.
+            inner_loops=SWITCH_INNER_LOOPS * 2
+        )
+    runner.bench_time_func(
+        'resume %d idle greenlets round-robin' % IDLE_GREENLET_COUNT,
+        bm_idle_round_robin,
+        inner_loops=IDLE_GREENLET_COUNT * 2
+    )
+    runner.bench_time_func(
+        'release greenlets from another thread',
+        bm_cross_thread_dealloc,
+        inner_loops=CROSS_THREAD_BATCH
+    )
+    runner.bench_time_func(
+        'switch between two greenlets, not traced',
+        bm_switch_traced,
+        None,
+        inner_loops=SWITCH_INNER_LOOPS * 2
+    )
+    runner.bench_time_func(
+        'switch between two greenlets, traced',
+        bm_switch_traced,
+        _tracer,
+        inner_loops=SWITCH_INNER_LOOPS * 2
+    )
+    if greenlet.GREENLET_USE_CONTEXT_VARS:
+        runner.bench_time_func(
+            'switch between two greenlets reading context variables',
+            bm_contextvars_across_switches,
+            inner_loops=SWITCH_INNER_LOOPS * CONTEXTVAR_GREENLETS
+        )
+    runner.bench_time_func(
+        'throw into a suspended greenlet',
+        bm_throw_into_suspended,
+        inner_loops=KILL_INNER_LOOPS
+    )
+    runner.bench_time_func(
+        'kill a suspended greenlet',
+        bm_kill_suspended,
+        inner_loops=KILL_INNER_LOOPS
+    )
+    runner.bench_time_func(
+        'kill a suspended greenlet with throw()',
+        bm_kill_by_throw,
+        inner_loops=KILL_INNER_LOOPS
+    )
+    if hasattr(greenlet, 'kill_all'):
+        runner.bench_time_func(
+            'kill a suspended greenlet with kill_all()',
+            bm_kill_all,
+            inner_loops=KILL_INNER_LOOPS
+        )
+    runner.bench_time_func(
+        'start and join a thread that uses getcurrent()',
+        bm_thread_churn,
+        False
+    )
+    runner.bench_time_func(
+        'start and join a thread that runs a greenlet',
+        bm_thread_churn,
+        True
+    )
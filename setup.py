@@ -22,6 +22,10 @@ cpp_link_args = []
 # Extra compiler arguments passed to the main extension
 main_compile_args = []
 
+# Extra compiler arguments passed to C++ extensions that need C++20
+# (coroutines).
+cpp20_compile_args = []
+
 # workaround segfaults on openbsd and RHEL 3 / CentOS 3 . see
 # https://bitbucket.org/ambroff/greenlet/issue/11/segfault-on-openbsd-i386
 # https://github.com/python-greenlet/greenlet/issues/4
@@ -75,6 +79,12 @@ elif sys.platform == 'win32':
     # functions up. Revisit those.
     cpp_compile_args.append("/GT")
 
+if sys.platform == 'win32':
+    cpp20_compile_args.extend(cpp_compile_args + ['/std:c++latest'])
+else:
+    # c++2a is what compilers called C++20 before it was final.
+    cpp20_compile_args.append('-std=c++2a')
+
 def readfile(filename):
     with open(filename, 'r') as f: # pylint:disable=unspecified-encoding
         return f.read()
@@ -98,7 +108,7 @@ if hasattr(sys, "pypy_version_info"):
     headers = []
 else:
 
-    headers = [GREENLET_HEADER]
+    headers = [GREENLET_HEADER, GREENLET_HEADER_DIR + 'greenlet_coroutine.hpp']
 
     if sys.platform == 'win32' and '64 bit' in sys.version:
         # this works when building with msvc, not with 64 bit gcc
@@ -113,6 +123,17 @@ else:
     elif hasattr(os, 'uname') and os.uname()[4] in ['ppc64el', 'ppc64le']:
         main_compile_args.append('-fno-tree-dominator-opts')
 
+    if os.environ.get('GREENLET_USDT_PROBES') in ('1', 'yes'):
+        # Static tracing probes for SystemTap/bpftrace; see
+        # greenlet_probes.hpp. This needs <sys/sdt.h>.
+        main_compile_args.append('-DG_USE_USDT_PROBES=1')
+
+    if os.environ.get('GREENLET_PERF') in ('1', 'yes'):
+        # Keep frame pointers everywhere (slp_switch() already saves
+        # and restores its own), so that ``perf record -g`` can
+        # unwind through greenlet without DWARF.
+        main_compile_args.extend(['-fno-omit-frame-pointer', '-mno-omit-leaf-frame-pointer'])
+
     ext_modules = [
         Extension(
             name='greenlet._greenlet',
@@ -150,8 +171,33 @@ else:
             extra_compile_args=global_compile_args + cpp_compile_args,
             extra_link_args=cpp_link_args,
         ),
+        # Microbenchmarks of the C API; see benchmarks/c_api.py.
+        Extension(
+            name='greenlet.tests._bench_extension_cpp',
+            sources=[GREENLET_TEST_DIR + '_bench_extension_cpp.cpp'],
+            language="c++",
+            include_dirs=[GREENLET_HEADER_DIR],
+            extra_compile_args=global_compile_args + cpp_compile_args,
+            extra_link_args=cpp_link_args,
+        ),
     ]
 
+    if sys.version_info[0] >= 3:
+        # Tests of greenlet_coroutine.hpp. Not every compiler can
+        # build this, and nothing else needs it. Its module
+        # initialization is written for Python 3 only.
+        ext_modules.append(
+            Extension(
+                name='greenlet.tests._test_extension_cpp20',
+                sources=[GREENLET_TEST_DIR + '_test_extension_cpp20.cpp'],
+                language="c++",
+                include_dirs=[GREENLET_HEADER_DIR],
+                extra_compile_args=global_compile_args + cpp20_compile_args,
+                extra_link_args=cpp_link_args,
+                depends=[GREENLET_HEADER, GREENLET_SRC_DIR + 'greenlet_coroutine.hpp'],
+                optional=True,
+            ))
+
 
 def get_greenlet_version():
     with open('src/greenlet/__init__.py') as f: # pylint:disable=unspecified-encoding
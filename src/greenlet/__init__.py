@@ -9,6 +9,7 @@ from __future__ import print_function
 __all__ = [
     '__version__',
     '_C_API',
+    '_C_API_VERSION',
 
     'GreenletExit',
     'error',
@@ -18,6 +19,12 @@ __all__ = [
 
     'gettrace',
     'settrace',
+    'get_switch_log',
+    'enable_switch_log',
+    'start_timeline',
+    'stop_timeline',
+
+    'advise_idle',
 ]
 
 # pylint:disable=no-name-in-module
@@ -27,6 +34,7 @@ __all__ = [
 ###
 __version__ = '1.2.0.dev0'
 from ._greenlet import _C_API # pylint:disable=no-name-in-module
+from ._greenlet import _C_API_VERSION # pylint:disable=no-name-in-module
 
 ###
 # Exceptions
@@ -38,7 +46,16 @@ from ._greenlet import error
 # greenlets
 ###
 from ._greenlet import getcurrent
+from ._greenlet import enumerate # pylint:disable=redefined-builtin
+from ._greenlet import kill_all
+from ._greenlet import set_exit_policy
+from ._greenlet import after_fork_child
 from ._greenlet import greenlet
+try:
+    from ._greenlet import Executor
+except ImportError:
+    # Only built with C++11 threads.
+    pass
 
 ###
 # tracing
@@ -51,6 +68,15 @@ except ImportError:
     # XXX: The option to disable it was removed in 1.0,
     # so this branch should be dead code.
     pass
+from ._greenlet import get_switch_log
+from ._greenlet import enable_switch_log
+from ._greenlet import start_timeline
+from ._greenlet import stop_timeline
+
+###
+# Memory
+###
+from ._greenlet import advise_idle
 
 ###
 # Constants
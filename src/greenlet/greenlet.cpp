@@ -6,9 +6,14 @@
  * Fix missing braces with:
  *   clang-tidy src/greenlet/greenlet.c -fix -checks="readability-braces-around-statements"
 */
+#include <cstring>
 #include <string>
+#include <vector>
 #include <algorithm>
 #include <exception>
+#ifndef _WIN32
+#    include <pthread.h>
+#endif
 
 
 #include <Python.h>
@@ -20,6 +25,13 @@
 #include "greenlet_thread_state.hpp"
 #include "greenlet_thread_support.hpp"
 #include "greenlet_greenlet.hpp"
+#include "greenlet_probes.hpp"
+#include "greenlet_perf_map.hpp"
+#include "greenlet_timeline.hpp"
+#include "greenlet_watchdog.hpp"
+#if G_USE_STANDARD_THREADING == 1
+#    include "greenlet_executor.hpp"
+#endif
 
 using greenlet::ThreadState;
 using greenlet::Mutex;
@@ -30,6 +42,12 @@ using greenlet::Require;
 using greenlet::PyFatalError;
 using greenlet::ExceptionState;
 using greenlet::StackState;
+using greenlet::StackCopier;
+using greenlet::LazyStackRestore;
+using greenlet::PerfMap;
+using greenlet::Timeline;
+using greenlet::SwitchLog;
+using greenlet::LatencyHistogram;
 using greenlet::Greenlet;
 
 
@@ -370,9 +388,14 @@ public:
 
 static const GreenletGlobals mod_globs(0);
 
-// Protected by the GIL. Incremented when we create a main greenlet,
-// in a new thread, decremented when it is destroyed.
+// Incremented when we create a main greenlet, in a new thread,
+// decremented when it is destroyed (which can be in another thread).
+#if G_USE_STANDARD_THREADING == 1
+static std::atomic<Py_ssize_t> total_main_greenlets(0);
+#else
+// Protected by the GIL.
 static Py_ssize_t total_main_greenlets;
+#endif
 
 struct ThreadState_DestroyWithGIL
 {
@@ -426,13 +449,10 @@ struct ThreadState_DestroyNoGIL
         }
 
         // NOTE: Because we're not holding the GIL here, some other
-        // Python thread could run and call ``os.fork()``, which would
-        // be bad if that happenend while we are holding the cleanup
-        // lock (it wouldn't function in the child process).
-        // Make a best effort to try to keep the duration we hold the
-        // lock short.
-        // TODO: On platforms that support it, use ``pthread_atfork`` to
-        // drop this lock.
+        // Python thread could run and call ``os.fork()`` while we are
+        // holding the cleanup lock. Where we can, fork() waits for
+        // the lock (see lock_before_fork()); still, keep the duration
+        // we hold it short.
         LockGuard cleanup_lock(*mod_globs.thread_states_to_destroy_lock);
 
         if (state && state->has_main_greenlet()) {
@@ -481,6 +501,23 @@ struct ThreadState_DestroyNoGIL
         return 0;
     }
 
+#if G_USE_STANDARD_THREADING == 1 && !defined(_WIN32)
+    // Registered with ``pthread_atfork``. The thread calling fork()
+    // holds the cleanup lock across it, so the child can't inherit
+    // the lock held by a thread that doesn't exist there.
+    static void
+    lock_before_fork()
+    {
+        mod_globs.thread_states_to_destroy_lock->lock();
+    }
+
+    static void
+    unlock_after_fork()
+    {
+        mod_globs.thread_states_to_destroy_lock->unlock();
+    }
+#endif
+
 };
 
 // The intent when GET_THREAD_STATE() is used multiple times in a function is to
@@ -543,6 +580,22 @@ static ThreadStateCreator& GET_THREAD_STATE()
 }
 #endif
 
+/**
+ * The current thread's state if it has one, without creating it (or,
+ * without standard threading, anything else).
+ */
+static inline ThreadState*
+current_thread_state_if_created()
+{
+#if G_USE_STANDARD_THREADING == 1
+    return g_thread_state_global.borrow_if_created();
+#else
+    return _g_thread_state_global_ptr
+        ? _g_thread_state_global_ptr->borrow_if_created()
+        : nullptr;
+#endif
+}
+
 
 Greenlet::Greenlet(PyGreenlet* p)
 {
@@ -558,7 +611,13 @@ Greenlet::Greenlet(PyGreenlet* p, const StackState& initial_stack)
 }
 
 UserGreenlet::UserGreenlet(PyGreenlet* p,BorrowedGreenlet the_parent)
-    : Greenlet(p), _parent(the_parent)
+    : Greenlet(p),
+      _native_run(nullptr),
+      _native_arg(nullptr),
+      _parent(the_parent),
+      _registered_in(nullptr),
+      _registry_prev(nullptr),
+      _registry_next(nullptr)
 {
     this->_self = p;
 }
@@ -820,8 +879,11 @@ Greenlet::slp_restore_state() G_NOEXCEPT
 #ifdef SLP_BEFORE_RESTORE_STATE
     SLP_BEFORE_RESTORE_STATE();
 #endif
+    ThreadState* const state = this->thread_state();
+    switching_bytes_copied += this->stack_state.stack_saved();
     this->stack_state.copy_heap_to_stack(
-           this->thread_state()->borrow_current()->stack_state);
+           state->borrow_current()->stack_state,
+           state->lazy_restore_record());
 }
 
 
@@ -836,7 +898,8 @@ Greenlet::slp_save_state(char *const stackref) G_NOEXCEPT
     SLP_BEFORE_SAVE_STATE();
 #endif
     return this->stack_state.copy_stack_to_heap(stackref,
-                                                this->thread_state()->borrow_current()->stack_state);
+                                                this->thread_state()->borrow_current()->stack_state,
+                                                switching_bytes_copied);
 }
 
 
@@ -891,6 +954,24 @@ UserGreenlet::g_switch()
                 assert(!this->switch_args);
             }
 
+            // If this thread starts greenlets from a fixed base, hand
+            // the target off to the trampoline parked there instead
+            // of starting it from wherever we happen to be. (A throw
+            // into a greenlet that hasn't started never runs any of
+            // its code, so that doesn't need to go anywhere.)
+            ThreadState& thread_state = GET_THREAD_STATE().state();
+            const OwnedGreenlet& trampoline = thread_state.get_spawn_trampoline();
+            if (trampoline
+                && trampoline->active()
+                && target->args()
+                && !thread_state.is_current(trampoline)) {
+                thread_state.request_spawn(real_target->self());
+                OwnedObject no_args = OwnedObject::owning(mod_globs.empty_tuple);
+                trampoline->args() <<= no_args;
+                err = trampoline->g_switchstack();
+                break;
+            }
+
             try {
                 // This can only throw back to us while we're
                 // still in this greenlet. Once the new greenlet
@@ -969,6 +1050,20 @@ Greenlet::g_switchstack_success() G_NOEXCEPT
     ThreadState* thread_state = this->thread_state();
     OwnedGreenlet result(thread_state->get_current());
     thread_state->set_current(this->self());
+    // Only read the clock if something wants the time.
+    if (SwitchLog::clock_needed() || switching_started_at || Timeline::enabled()) {
+        const uint64_t now = SwitchLog::now();
+        thread_state->switched_at(now);
+        thread_state->switch_log().record(this->args() ? SwitchLog::SWITCH : SwitchLog::THROW,
+                                          result.borrow_o(), this->self().borrow_o(),
+                                          switching_bytes_copied, now);
+        if (switching_started_at) {
+            thread_state->switch_latency().record(now - switching_started_at);
+        }
+        if (Timeline::enabled()) {
+            Timeline::running(now, thread_state, this->self().borrow_o(), this->main());
+        }
+    }
     //assert(thread_state->borrow_current().borrow() == this->_self);
     return result;
 }
@@ -984,7 +1079,9 @@ UserGreenlet::g_initialstub(void* mark)
     // GetAttr() and have to try again.
     // We'll restore them when we return in that case.
     // Scope them tightly to avoid ref leaks.
-    {
+    // A native greenlet has no ``run`` to look up, so no Python code
+    // runs and none of this can happen.
+    if (!this->_native_run) {
         SwitchingArgs args(this->switch_args);
 
         /* save exception in case getattr clears it */
@@ -1045,6 +1142,7 @@ UserGreenlet::g_initialstub(void* mark)
     this->python_state.set_initial_state(PyThreadState_GET());
     this->exception_state.clear();
     this->_main_greenlet = thread_state.get_main_greenlet();
+    thread_state.register_greenlet(this);
 
     /* perform the initial switch */
     switchstack_result_t err = this->g_switchstack();
@@ -1075,6 +1173,7 @@ UserGreenlet::g_initialstub(void* mark)
     if (err.status < 0) {
         /* start failed badly, restore greenlet state */
         // XXX: This code path is not tested.
+        ThreadState::unregister_greenlet(this);
         this->stack_state = StackState();
         this->_main_greenlet.CLEAR();
     }
@@ -1082,6 +1181,32 @@ UserGreenlet::g_initialstub(void* mark)
 }
 
 
+/**
+ * The name tools like perf and the timeline should show for a
+ * greenlet running *run*: its ``__qualname__``, or failing that, the
+ * name of its type.
+ */
+static std::string
+run_name(PyObject* run)
+{
+    PyObject* qualname = PyObject_GetAttrString(run, "__qualname__");
+    const char* name = nullptr;
+    if (qualname) {
+#if PY_MAJOR_VERSION >= 3
+        name = PyUnicode_Check(qualname) ? PyUnicode_AsUTF8(qualname) : nullptr;
+#else
+        name = PyString_Check(qualname) ? PyString_AsString(qualname) : nullptr;
+#endif
+    }
+    if (!name) {
+        PyErr_Clear();
+        name = Py_TYPE(run)->tp_name;
+    }
+    const std::string result(name);
+    Py_XDECREF(qualname);
+    return result;
+}
+
 void
 UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& run) G_NOEXCEPT
 {
@@ -1105,6 +1230,13 @@ UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& run)
 
     this->stack_state.set_active(); /* running */
 
+    if (this->thread_state()->is_spawn_trampoline(origin_greenlet)) {
+        // We were started from the fixed base on behalf of some
+        // other greenlet; as far as anyone can tell, that greenlet
+        // switched to us directly.
+        origin_greenlet = this->thread_state()->take_spawn_requester();
+    }
+
     // XXX: We could clear this much earlier, right?
     // Or would that introduce the possibility of running Python
     // code when we don't want to?
@@ -1123,18 +1255,24 @@ UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& run)
     // never return there.
 
     if (OwnedObject tracefunc = this->thread_state()->get_tracefunc()) {
-        try {
-            g_calltrace(tracefunc,
-                        args ? mod_globs.event_switch : mod_globs.event_throw,
-                        origin_greenlet,
-                        this->_self);
-        }
-        catch (const PyErrOccurred&) {
-            /* Turn trace errors into switch throws */
-            args.CLEAR();
+        if (!this->thread_state()->is_spawn_trampoline(this->_self)) {
+            try {
+                g_calltrace(tracefunc,
+                            args ? mod_globs.event_switch : mod_globs.event_throw,
+                            origin_greenlet,
+                            this->_self);
+            }
+            catch (const PyErrOccurred&) {
+                /* Turn trace errors into switch throws */
+                args.CLEAR();
+            }
         }
     }
 
+    this->thread_state()->switch_log().record(SwitchLog::START,
+                                              origin_greenlet.borrow_o(), this->self().borrow_o(),
+                                              0);
+
     // We no longer need the origin, it was only here for
     // tracing.
     // We may never actually exit this stack frame so we need
@@ -1148,9 +1286,28 @@ UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& run)
         result = NULL;
     }
     else {
-        /* call g.run(*args, **kwargs) */
-        // This could result in further switches
-        result = run.PyCall(args.args(), args.kwargs());
+        GREENLET_PROBE1(start, this->self().borrow());
+        if (PerfMap::enabled() || Timeline::enabled()) {
+            const std::string name = run ? run_name(run.borrow()) : "<native>";
+            PerfMap::started(this->self().borrow_o(), name.c_str());
+            if (Timeline::enabled()) {
+                Timeline::started(SwitchLog::now(), this->self().borrow_o(), name);
+            }
+        }
+        if (run) {
+            /* call g.run(*args, **kwargs) */
+            // This could result in further switches
+            result = run.PyCall(args.args(), args.kwargs());
+        }
+        else {
+            // Native: pass what ``switch()`` would have returned to a
+            // greenlet that was already running.
+            OwnedObject first_value;
+            first_value <<= args;
+            first_value = single_result(first_value);
+            result = OwnedObject::consuming(
+                this->_native_run(this->_native_arg, first_value.borrow_o()));
+        }
     }
     args.CLEAR();
     run.CLEAR();
@@ -1168,9 +1325,14 @@ UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& run)
     this->release_args();
 
     result = g_handle_exit(result);
+    GREENLET_PROBE2(finish, this->self().borrow(), result ? 0 : 1);
+    this->thread_state()->switch_log().record(SwitchLog::FINISH,
+                                              this->self().borrow_o(), this->_parent.borrow_o(),
+                                              0);
     assert(this->thread_state()->borrow_current() == this->_self);
     /* jump back to parent */
     this->stack_state.set_inactive(); /* dead */
+    ThreadState::unregister_greenlet(this);
 
     // TODO: Can we decref some things here? Release our main greenlet
     // and maybe parent?
@@ -1203,6 +1365,7 @@ UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& run)
     }
     /* We ran out of parents, cannot continue */
     PyErr_WriteUnraisable(this->self().borrow_o());
+    this->thread_state()->switch_log().dump(stderr);
     Py_FatalError("greenlet: ran out of parent greenlets while propagating exception; "
                   "cannot continue");
 }
@@ -1219,12 +1382,15 @@ Greenlet::g_switchstack(void)
             return switchstack_result_t(0,
                                         this, this->thread_state()->borrow_current());
         }
+        switching_started_at = LatencyHistogram::enabled ? SwitchLog::now() : 0;
         BorrowedGreenlet current = this->thread_state()->borrow_current();
         PyThreadState* tstate = PyThreadState_GET();
         current->python_state << tstate;
         current->exception_state << tstate;
         this->python_state.will_switch_from(tstate);
         switching_thread_state = this;
+        switching_bytes_copied = 0;
+        GREENLET_PROBE2(switch__entry, current.borrow(), this->self().borrow());
     }
     // If this is the first switch into a greenlet, this will
     // return twice, once with 1 in the new greenlet, once with 0
@@ -1255,6 +1421,9 @@ Greenlet::g_switchstack(void)
     Greenlet* after_switch = switching_thread_state;
     OwnedGreenlet origin = after_switch->g_switchstack_success();
     switching_thread_state = nullptr;
+    GREENLET_PROBE3(switch__exit, origin.borrow(), after_switch->self().borrow(),
+                    switching_bytes_copied);
+    PerfMap::switched(origin.borrow_o(), after_switch->self().borrow_o());
     return switchstack_result_t(err, after_switch, origin);
 }
 
@@ -1330,7 +1499,12 @@ Greenlet::g_switch_finish(const switchstack_result_t& err)
         assert(err.status >= 0);
         assert(state.borrow_current() == this->self());
 
-        if (OwnedObject tracefunc = state.get_tracefunc()) {
+        // Switches into and out of the spawn trampoline are an
+        // implementation detail, not something to report.
+        OwnedObject tracefunc = state.get_tracefunc();
+        if (tracefunc
+            && !state.is_spawn_trampoline(this->self())
+            && !state.is_spawn_trampoline(err.origin_greenlet)) {
             g_calltrace(tracefunc,
                         this->args() ? mod_globs.event_switch : mod_globs.event_throw,
                         err.origin_greenlet,
@@ -1342,11 +1516,12 @@ Greenlet::g_switch_finish(const switchstack_result_t& err)
 
         if (PyErr_Occurred()) {
             // We get here if we fell of the end of the run() function
-            // raising an exception. The switch itself was
-            // successful, but the function raised.
+            // raising an exception, or an exception was thrown into
+            // us. The switch itself was successful. See g_switch().
             // valgrind reports that memory allocated here can still
             // be reached after a test run.
-            throw PyErrOccurred();
+            this->release_args();
+            return OwnedObject();
         }
 
         OwnedObject result;
@@ -1553,8 +1728,11 @@ Greenlet::murder_in_place()
 void
 UserGreenlet::murder_in_place()
 {
-    this->_main_greenlet.CLEAR();
+    ThreadState::unregister_greenlet(this);
+    // Still through the main greenlet, deactivate_and_free() needs
+    // our thread.
     Greenlet::murder_in_place();
+    this->_main_greenlet.CLEAR();
 }
 
 inline void
@@ -1563,6 +1741,12 @@ Greenlet::deactivate_and_free()
     if (!this->active()) {
         return;
     }
+    // If our thread is still running, its current greenlet may be
+    // running on top of what's left of our stack.
+    const ThreadState* const thread_state = this->thread_state();
+    if (thread_state && thread_state->borrow_current()) {
+        this->stack_state.unlink_from(thread_state->borrow_current()->stack_state);
+    }
     // Throw away any saved stack.
     this->stack_state = StackState();
     assert(!this->stack_state.active());
@@ -1609,7 +1793,10 @@ Greenlet::deallocing_greenlet_in_thread(const ThreadState* current_thread_state)
 
         // We don't care about the return value, only whether an
         // exception happened.
-        this->throw_GreenletExit_during_dealloc(*current_thread_state);
+        GREENLET_PROBE2(kill, this->self().borrow(), GREENLET_KILL_THROWN);
+        if (!this->throw_GreenletExit_during_dealloc(*current_thread_state)) {
+            throw PyErrOccurred();
+        }
         return;
     }
 
@@ -1622,12 +1809,14 @@ Greenlet::deallocing_greenlet_in_thread(const ThreadState* current_thread_state)
     // won't increase, and we'll go ahead with the DECREFs later.
     ThreadState *const  thread_state = this->thread_state();
     if (thread_state) {
+        GREENLET_PROBE2(kill, this->self().borrow(), GREENLET_KILL_QUEUED);
         thread_state->delete_when_thread_running(this->self());
     }
     else {
         // The thread is dead, we can't raise an exception.
         // We need to make it look non-active, though, so that dealloc
         // finishes killing it.
+        GREENLET_PROBE2(kill, this->self().borrow(), GREENLET_KILL_DISCARDED);
         this->deactivate_and_free();
     }
     return;
@@ -1660,6 +1849,16 @@ UserGreenlet::tp_traverse(visitproc visit, void* arg)
     Py_VISIT(this->_parent.borrow_o());
     Py_VISIT(this->_main_greenlet.borrow_o());
     Py_VISIT(this->_run_callable.borrow_o());
+#if G_USE_SUSPENDED_GC
+    // In a dead thread, Greenlet::tp_traverse visits the top frame
+    // itself, and it has become an ordinary reference.
+    if (!this->was_running_in_dead_thread()) {
+        const int result = this->python_state.traverse_suspended_frames(visit, arg);
+        if (result) {
+            return result;
+        }
+    }
+#endif
 
     return Greenlet::tp_traverse(visit, arg);
 }
@@ -1685,18 +1884,14 @@ green_traverse(PyGreenlet* self, visitproc visit, void* arg)
     //
     // - stack_prev is not visited: holds previous stack pointer, but it's not
     //    referenced
-    // - frames are not visited as we don't strongly reference them;
-    //    alive greenlets are not garbage collected
-    //    anyway. This can be a problem, however, if this greenlet is
-    //    never allowed to finish, and is referenced from the frame: we
-    //    have an uncollectable cycle in that case. Note that the
-    //    frame object itself is also frequently not even tracked by the GC
-    //    starting with Python 3.7 (frames are allocated by the
-    //    interpreter untracked, and only become tracked when their
-    //    evaluation is finished if they have a refcount > 1). All of
-    //    this is to say that we should probably strongly reference
-    //    the frame object. Doing so, while always allowing GC on a
-    //    greenlet, solves several leaks for us.
+    // - frames are not visited as such: while they execute, the
+    //    interpreter doesn't track them. When a greenlet is
+    //    suspended, though, what its frames reference is visited
+    //    (PythonState::traverse_suspended_frames()), so a greenlet that's
+    //    only referenced from its own frames, and never allowed to
+    //    finish, is an ordinary cycle; green_finalize() keeps the
+    //    cycle from being cleared, and it's killed once the collection
+    //    is over.
 
     Py_VISIT(self->dict);
     if (!self->pimpl) {
@@ -1722,6 +1917,18 @@ green_is_gc(BorrowedGreenlet self)
     if (self->main() || !self->active()) {
         result = 1;
     }
+#if G_USE_SUSPENDED_GC
+    /* With tp_finalize, they can be after all: green_finalize()
+       keeps the collector from clearing an active greenlet, and has
+       it killed instead. This
+       has to be the same answer every time, or a dict or tuple that
+       only refers to us while we're running could stop being tracked
+       for good.
+    */
+    else {
+        result = 1;
+    }
+#endif
     // The main greenlet pointer will eventually go away after the thread dies.
     if (self->was_running_in_dead_thread()) {
         // Our thread is dead! We can never run again. Might as well
@@ -1775,6 +1982,33 @@ green_clear(PyGreenlet* self)
     return self->pimpl->tp_clear();
 }
 
+// Set by set_exit_policy("abandon").
+static bool abandon_at_exit = false;
+
+/**
+ * Should a suspended greenlet that's going away be thrown away where
+ * it is, instead of being killed by raising GreenletExit in it? Only
+ * if the interpreter is exiting and we were asked to.
+ */
+static inline bool
+abandoning_greenlets()
+{
+    return abandon_at_exit && Py_IsFinalizing();
+}
+
+/**
+ * Throw away a suspended greenlet without running anything in it.
+ * green_dealloc(), green_finalize() and after_fork_child() all do it
+ * this way; deactivate_and_free() takes it out of the chain of stacks
+ * of its thread's running greenlet, which may still be on top of it.
+ */
+static void
+abandon_greenlet(BorrowedGreenlet self)
+{
+    GREENLET_PROBE2(kill, self.borrow(), GREENLET_KILL_DISCARDED);
+    self->murder_in_place();
+}
+
 /**
  * Returns 0 on failure (the object was resurrected) or 1 on success.
  **/
@@ -1859,6 +2093,51 @@ _green_dealloc_kill_started_non_main_greenlet(BorrowedGreenlet self)
 }
 
 
+#if G_USE_SUSPENDED_GC
+/**
+ * tp_finalize: the garbage collector found a suspended greenlet that
+ * only a cycle refers to (see green_is_gc()).
+ *
+ * Killing it means switching to it, which only its own thread can
+ * do, and not while the collector is running: the lists it's working
+ * through are anchored on its C stack, which the greenlet's stack
+ * would be copied over. So keep it, and with it the whole cycle,
+ * alive, and let its thread kill it once the collection is over
+ * (mod_gc_callback(), or the next time it uses greenlets), the same
+ * way green_dealloc() would have if its reference count had dropped
+ * to zero.
+ */
+static void
+green_finalize(PyGreenlet* self)
+{
+    BorrowedGreenlet me(self);
+    if (!me->active()
+        || !me->started()
+        || me->main()
+        || me->is_currently_running_in_some_thread()) {
+        return;
+    }
+    if (me.REFCNT() == 1) {
+        // A heap subclass's tp_dealloc, not the collector;
+        // green_dealloc() takes care of it.
+        return;
+    }
+    ThreadState* const thread_state = me->thread_state();
+    if (!thread_state) {
+        // Its thread is dead; it can be cleared like anything else.
+        return;
+    }
+    if (abandoning_greenlets()) {
+        // Nobody's going to run the killme list now.
+        abandon_greenlet(me);
+        return;
+    }
+    // Possibly another thread's list; like the deleteme list,
+    // that's fine while we hold the GIL.
+    thread_state->kill_when_collected(self);
+}
+#endif
+
 Greenlet::~Greenlet()
 {
     // XXX: Can't do this. tp_clear is a virtual function, and by the
@@ -1868,7 +2147,32 @@ Greenlet::~Greenlet()
 
 UserGreenlet::~UserGreenlet()
 {
+    ThreadState::unregister_greenlet(this);
+    // If we outlived our thread, whatever our stack held of its main
+    // greenlet was never released; once we and the thread state are
+    // gone, that may be all that keeps it alive.
+    PyGreenlet* old_main_greenlet = nullptr;
+    if (this->was_running_in_dead_thread() && !Py_IsFinalizing()) {
+        old_main_greenlet = this->_main_greenlet.borrow();
+        Py_INCREF(old_main_greenlet);
+    }
     this->tp_clear();
+    if (old_main_greenlet) {
+        const bool last_known_holder = Py_REFCNT(old_main_greenlet) == 2;
+        Py_DECREF(old_main_greenlet);
+        if (last_known_holder) {
+            PyErrPieces saved_err;
+            try {
+                ThreadState::forget_unreachable_main_greenlet(old_main_greenlet);
+            }
+            catch (const PyErrOccurred&) {
+            }
+            if (PyErr_Occurred()) {
+                PyErr_WriteUnraisable(nullptr);
+            }
+            saved_err.PyErrRestore();
+        }
+    }
 }
 
 MainGreenlet::~MainGreenlet()
@@ -1885,7 +2189,10 @@ green_dealloc(PyGreenlet* self)
     if (me->active()
         && me->started()
         && !me->main()) {
-        if (!_green_dealloc_kill_started_non_main_greenlet(me)) {
+        if (abandoning_greenlets()) {
+            abandon_greenlet(me);
+        }
+        else if (!_green_dealloc_kill_started_non_main_greenlet(me)) {
             return;
         }
     }
@@ -1915,6 +2222,7 @@ throw_greenlet(BorrowedGreenlet self, PyErrPieces& err_pieces)
     PyObject* result = nullptr;
     err_pieces.PyErrRestore();
     assert(PyErr_Occurred());
+    GREENLET_PROBE2(throw, self.borrow(), PyErr_Occurred());
     if (self->started() && !self->active()) {
         /* dead greenlet: turn GreenletExit into a regular return */
         result = g_handle_exit(OwnedObject()).relinquish_ownership();
@@ -2125,6 +2433,8 @@ UserGreenlet::run(const BorrowedObject nrun)
                         "after the start of the greenlet");
     }
     this->_run_callable = nrun;
+    this->_native_run = nullptr;
+    this->_native_arg = nullptr;
 }
 
 const OwnedObject&
@@ -2467,6 +2777,21 @@ PyGreenlet_New(PyObject* run, PyGreenlet* parent)
     return g.relinquish_ownership();
 }
 
+static PyGreenlet*
+PyGreenlet_NewNative(PyGreenlet_NativeFunc fn, void* arg, PyGreenlet* parent)
+{
+    if (!fn) {
+        PyErr_BadArgument();
+        return nullptr;
+    }
+    PyGreenlet* g = PyGreenlet_New(nullptr, parent);
+    if (g) {
+        // green_new() always makes a UserGreenlet.
+        static_cast<UserGreenlet*>(g->pimpl)->native_run(fn, arg);
+    }
+    return g;
+}
+
 static PyObject*
 PyGreenlet_Switch(PyGreenlet* g, PyObject* args, PyObject* kwargs)
 {
@@ -2488,6 +2813,50 @@ PyGreenlet_Switch(PyGreenlet* g, PyObject* args, PyObject* kwargs)
     return green_switch(g, args, kwargs);
 }
 
+static PyObject*
+PyGreenlet_SwitchValue(PyGreenlet* g, PyObject* value)
+{
+    if (!PyGreenlet_Check(g) || !value) {
+        PyErr_BadArgument();
+        return nullptr;
+    }
+    // ``g.switch(value)`` would pack *value* into a one-tuple that
+    // the other side immediately unpacks again. If *g* is already
+    // running, we can hand over *value* as it is: with no keyword
+    // arguments, a non-tuple comes out of ``single_result`` unchanged.
+    // A new greenlet needs a real tuple for ``run(*args)``, a dead one
+    // passes its arguments on to a parent that might be new, and a
+    // tuple would be unpacked, so those take the long way.
+    if (g->pimpl->active() && !PyTuple_Check(value)) {
+        using greenlet::SwitchingArgs;
+        SwitchingArgs switch_args(OwnedObject::owning(value), OwnedObject());
+        g->pimpl->args() <<= switch_args;
+        try {
+            return single_result(g->pimpl->g_switch()).relinquish_ownership();
+        }
+        catch (const PyErrOccurred&) {
+            return nullptr;
+        }
+    }
+    PyObject* args = PyTuple_Pack(1, value);
+    if (!args) {
+        return nullptr;
+    }
+    PyObject* result = green_switch(g, args, nullptr);
+    Py_DECREF(args);
+    return result;
+}
+
+static PyObject*
+PyGreenlet_SwitchNoArgs(PyGreenlet* g)
+{
+    if (!PyGreenlet_Check(g)) {
+        PyErr_BadArgument();
+        return nullptr;
+    }
+    return green_switch(g, mod_globs.empty_tuple, nullptr);
+}
+
 static PyObject*
 PyGreenlet_Throw(PyGreenlet* self, PyObject* typ, PyObject* val, PyObject* tb)
 {
@@ -2544,6 +2913,45 @@ Extern_PyGreenlet_GET_PARENT(PyGreenlet* self)
     // This can return NULL even if there is no exception
     return self->pimpl->parent().acquire();
 }
+
+static PyObject*
+PyGreenlet_Enumerate(PyGreenlet* thread)
+{
+    try {
+        ThreadState* state = nullptr;
+        if (!thread) {
+            state = &GET_THREAD_STATE().state();
+        }
+        else {
+            if (!PyGreenlet_Check(thread)) {
+                PyErr_BadArgument();
+                return NULL;
+            }
+            const BorrowedMainGreenlet main = thread->pimpl->find_main_greenlet_in_lineage();
+            if (main) {
+                // This is null if the thread is dead.
+                state = main->thread_state();
+            }
+        }
+        OwnedObject result = OwnedObject::consuming(Require(PyList_New(0)));
+        if (!state) {
+            return result.relinquish_ownership();
+        }
+        for (UserGreenlet* g = state->first_registered_greenlet(); g; g = g->next_registered()) {
+            if (state->is_spawn_trampoline(g->self())) {
+                continue;
+            }
+            if (PyList_Append(result.borrow(), g->self().borrow_o()) < 0) {
+                throw PyErrOccurred();
+            }
+        }
+        return result.relinquish_ownership();
+    }
+    catch (const PyErrOccurred&) {
+        return NULL;
+    }
+}
+
 } // extern C.
 /** End C API ****************************************************************/
 
@@ -2653,6 +3061,201 @@ mod_getcurrent(PyObject* UNUSED(module))
     return GET_THREAD_STATE().state().get_current().relinquish_ownership_o();
 }
 
+PyDoc_STRVAR(mod_enumerate_doc,
+             "enumerate(thread=None) -> list\n"
+             "\n"
+             "Return the greenlets that have been started in a thread and haven't\n"
+             "finished yet. With no argument, that's the current thread; otherwise,\n"
+             "it's the thread that the greenlet *thread* (such as a thread's main\n"
+             "greenlet) belongs to. The list is empty if that thread has exited.\n"
+             "Main greenlets aren't included, and the order isn't specified.\n"
+             "\n"
+             "This doesn't scan the heap: each thread keeps a list of its greenlets.\n"
+             "\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_enumerate(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    static const char* kwlist[] = {"thread", nullptr};
+    PyObject* thread = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:enumerate", (char**)kwlist, &thread)) {
+        return nullptr;
+    }
+    if (thread == Py_None) {
+        return PyGreenlet_Enumerate(nullptr);
+    }
+    if (!PyGreenlet_Check(thread)) {
+        PyErr_SetString(PyExc_TypeError, "thread must be a greenlet or None");
+        return nullptr;
+    }
+    return PyGreenlet_Enumerate(reinterpret_cast<PyGreenlet*>(thread));
+}
+
+PyDoc_STRVAR(mod_kill_all_doc,
+             "kill_all(greenlets, exception=GreenletExit) -> None\n"
+             "\n"
+             "Raise *exception* in each of *greenlets*, an iterable, in order;\n"
+             "greenlets that haven't started or have already finished are skipped.\n"
+             "This is the same as::\n"
+             "\n"
+             "    for glet in greenlets:\n"
+             "        if glet:\n"
+             "            glet.throw(exception)\n"
+             "\n"
+             "but the exception is only checked and instantiated once (so every\n"
+             "greenlet gets the same exception object) and the loop runs in C,\n"
+             "which makes killing many greenlets at once much faster.\n"
+             "\n"
+             "As with that loop, if the exception (or another one) propagates\n"
+             "back to the caller, it's raised here and the rest of the greenlets\n"
+             "aren't killed. Everything in *greenlets* is checked to be a greenlet\n"
+             "before any of them are killed.\n"
+             "\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_kill_all(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    static const char* kwlist[] = {"greenlets", "exception", nullptr};
+    PyArgParseParam greenlets;
+    PyArgParseParam exception(mod_globs.PyExc_GreenletExit);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O:kill_all", (char**)kwlist,
+                                     &greenlets, &exception)) {
+        return nullptr;
+    }
+    try {
+        // Our own copy: the greenlets we switch to could change a
+        // list we were given.
+        const OwnedObject targets = OwnedObject::consuming(Require(PySequence_Tuple(greenlets.borrow())));
+        const Py_ssize_t count = PyTuple_GET_SIZE(targets.borrow());
+        for (Py_ssize_t i = 0; i < count; i++) {
+            PyObject* const item = PyTuple_GET_ITEM(targets.borrow(), i);
+            if (!PyGreenlet_Check(item)) {
+                PyErr_Format(PyExc_TypeError,
+                             "kill_all() expected greenlets, not %s",
+                             Py_TYPE(item)->tp_name);
+                throw PyErrOccurred();
+            }
+        }
+
+        const PyErrPieces err_pieces(exception.borrow(), nullptr, nullptr);
+        for (Py_ssize_t i = 0; i < count; i++) {
+            BorrowedGreenlet glet(reinterpret_cast<PyGreenlet*>(PyTuple_GET_ITEM(targets.borrow(), i)));
+            if (!glet->active()) {
+                continue;
+            }
+            err_pieces.PyErrRestoreCopy();
+            GREENLET_PROBE2(throw, glet.borrow(), PyErr_Occurred());
+            glet->args() <<= nullptr;
+            // Whatever it switches back with is dropped.
+            const OwnedObject result(glet->g_switch());
+            if (!result) {
+                throw PyErrOccurred();
+            }
+        }
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_set_exit_policy_doc,
+             "set_exit_policy(policy) -> str\n"
+             "\n"
+             "Choose what happens to suspended greenlets that are still around\n"
+             "when the interpreter exits, and return the previous policy.\n"
+             "\n"
+             "- ``'kill'`` (the default): like any other greenlet whose last\n"
+             "  reference goes away, each one is switched to and has\n"
+             "  `GreenletExit` raised in it, so its ``finally`` blocks and\n"
+             "  ``with`` statements run.\n"
+             "- ``'abandon'``: they're thrown away without being switched to. Their\n"
+             "  frames are released, but nothing more runs in them. With very many\n"
+             "  greenlets this makes exiting much faster.\n"
+             "\n"
+             "Either way, this only applies once the interpreter has started\n"
+             "finalizing, after :mod:`atexit` functions have run.\n"
+             "\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_set_exit_policy(PyObject* UNUSED(module), PyObject* args)
+{
+    const char* policy;
+    if (!PyArg_ParseTuple(args, "s:set_exit_policy", &policy)) {
+        return nullptr;
+    }
+    const char* const previous = abandon_at_exit ? "abandon" : "kill";
+    if (strcmp(policy, "abandon") == 0) {
+        abandon_at_exit = true;
+    }
+    else if (strcmp(policy, "kill") == 0) {
+        abandon_at_exit = false;
+    }
+    else {
+        PyErr_Format(PyExc_ValueError,
+                     "The exit policy must be 'kill' or 'abandon', not '%s'",
+                     policy);
+        return nullptr;
+    }
+    return GNative_FromFormat("%s", previous);
+}
+
+PyDoc_STRVAR(mod_after_fork_child_doc,
+             "after_fork_child() -> int\n"
+             "\n"
+             "In a child process just after ``fork()``, throw away the suspended\n"
+             "greenlets inherited from the parent, without switching to them, and\n"
+             "return how many there were.\n"
+             "\n"
+             "Like greenlets abandoned by :func:`set_exit_policy`, they're finished\n"
+             "without running any more of their code (no ``finally`` blocks), and\n"
+             "their saved stacks are freed without being read; anything only those\n"
+             "stacks referred to is leaked. Afterwards they're inactive, but not\n"
+             "``dead``, and can't be switched to. In a prefork server,\n"
+             "that keeps workers from copying the master's greenlets page by page,\n"
+             "and from running their cleanup, which belongs to the master.\n"
+             "\n"
+             "Only the current thread's greenlets are affected (after ``fork()``,\n"
+             "no other thread is running), and the current greenlet and its\n"
+             "parents, which it will return to, are kept. To do this in every child,\n"
+             "register it::\n"
+             "\n"
+             "    os.register_at_fork(after_in_child=greenlet.after_fork_child)\n"
+             "\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_after_fork_child(PyObject* UNUSED(module))
+{
+    try {
+        ThreadState& state = GET_THREAD_STATE().state();
+        std::vector<PyGreenlet*> keep;
+        for (OwnedGreenlet g = state.get_current(); g; g = g->parent()) {
+            keep.push_back(g.borrow());
+        }
+        // Our own list: releasing their frames can run arbitrary
+        // code, which can start or finish other greenlets.
+        std::vector<OwnedGreenlet> doomed;
+        for (UserGreenlet* g = state.first_registered_greenlet(); g; g = g->next_registered()) {
+            if (state.is_spawn_trampoline(g->self())
+                || std::find(keep.begin(), keep.end(), g->self().borrow()) != keep.end()) {
+                continue;
+            }
+            doomed.push_back(OwnedGreenlet(g->self()));
+        }
+        Py_ssize_t discarded = 0;
+        for (std::vector<OwnedGreenlet>::iterator it = doomed.begin(); it != doomed.end(); ++it) {
+            if ((*it)->active()) {
+                abandon_greenlet(*it);
+                discarded++;
+            }
+        }
+        return PyLong_FromSsize_t(discarded);
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
 PyDoc_STRVAR(mod_settrace_doc,
              "settrace(callback) -> object\n"
              "\n"
@@ -2736,7 +3339,7 @@ PyDoc_STRVAR(mod_get_total_main_greenlets_doc,
 static PyObject*
 mod_get_total_main_greenlets(PyObject* UNUSED(module))
 {
-    return PyLong_FromSize_t(total_main_greenlets);
+    return PyLong_FromSsize_t(total_main_greenlets);
 }
 
 PyDoc_STRVAR(mod_get_clocks_used_doing_optional_cleanup_doc,
@@ -2801,22 +3404,1342 @@ mod_enable_optional_cleanup(PyObject* UNUSED(module), PyObject* flag)
     Py_RETURN_NONE;
 }
 
-static PyMethodDef GreenMethods[] = {
-    {"getcurrent",
-     (PyCFunction)mod_getcurrent,
-     METH_NOARGS,
-     mod_getcurrent_doc},
-    {"settrace", (PyCFunction)mod_settrace, METH_VARARGS, mod_settrace_doc},
-    {"gettrace", (PyCFunction)mod_gettrace, METH_NOARGS, mod_gettrace_doc},
-    {"set_thread_local", (PyCFunction)mod_set_thread_local, METH_VARARGS, mod_set_thread_local_doc},
-    {"get_pending_cleanup_count", (PyCFunction)mod_get_pending_cleanup_count, METH_NOARGS, mod_get_pending_cleanup_count_doc},
-    {"get_total_main_greenlets", (PyCFunction)mod_get_total_main_greenlets, METH_NOARGS, mod_get_total_main_greenlets_doc},
-    {"get_clocks_used_doing_optional_cleanup", (PyCFunction)mod_get_clocks_used_doing_optional_cleanup, METH_NOARGS, mod_get_clocks_used_doing_optional_cleanup_doc},
-    {"enable_optional_cleanup", (PyCFunction)mod_enable_optional_cleanup, METH_O, mod_enable_optional_cleanup_doc},
-    {NULL, NULL} /* Sentinel */
-};
+/**
+ * The body of the greenlet parked at a thread's fixed spawn base (see
+ * ``mod_enable_fixed_spawn_base``).
+ *
+ * When asked to, it starts a new greenlet from right here, which is
+ * always the same, shallow, stack position. The stacks of all the
+ * greenlets started this way begin at the same address, and they
+ * only overlap each other as much as they're actually using, no
+ * matter how deep the call stack of the greenlet that wanted them
+ * started was.
+ */
+static PyObject*
+spawn_trampoline_run(PyObject* UNUSED(module), PyObject* UNUSED(args))
+{
+    try {
+        while (true) {
+            ThreadState& state = GET_THREAD_STATE().state();
+            const OwnedGreenlet target = state.take_spawn_target();
+            if (!target) {
+                // We were just started, or somebody switched to us
+                // directly. There's nothing to do but park until
+                // there's something to start.
+                const OwnedGreenlet parent = state.borrow_current()->parent();
+                OwnedObject no_args = OwnedObject::owning(mod_globs.empty_tuple);
+                parent->args() <<= no_args;
+                if (!parent->g_switch()) {
+                    throw PyErrOccurred();
+                }
+                continue;
+            }
 
-static const char* const copy_on_greentype[] = {
+            try {
+                // We only come back here when the next greenlet
+                // needs to be started.
+                if (!target->g_switch()) {
+                    throw PyErrOccurred();
+                }
+            }
+            catch (const PyErrOccurred&) {
+                if (target->started()) {
+                    // Starting it worked; it's us that somebody
+                    // threw an exception into later on.
+                    throw;
+                }
+                // The exception belongs to the greenlet that asked us
+                // to start the target, so raise it there.
+                const OwnedGreenlet requester = state.take_spawn_requester();
+                if (!requester->g_switch()) {
+                    throw PyErrOccurred();
+                }
+            }
+        }
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
+static PyMethodDef spawn_trampoline_def = {
+    "spawn_trampoline",
+    (PyCFunction)spawn_trampoline_run,
+    METH_NOARGS,
+    NULL
+};
+
+PyDoc_STRVAR(mod_enable_fixed_spawn_base_doc,
+             "enable_fixed_spawn_base(bool) -> None\n"
+             "\n"
+             "Start the new greenlets of this thread from a fixed stack position.\n"
+             "\n"
+             "Normally, a greenlet's stack begins wherever ``switch()`` was first\n"
+             "called on it, so a greenlet started from deep within some call stack\n"
+             "overlaps the stacks of many other greenlets, and switching between\n"
+             "them copies correspondingly more memory. When this is enabled, a\n"
+             "helper greenlet is parked at the current stack depth, and every greenlet\n"
+             "the current thread starts from then on is started from there instead.\n"
+             "Call this as close to the top of the thread as possible, before\n"
+             "starting any greenlets. Passing a false value goes back to starting\n"
+             "greenlets wherever they are first switched to.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0"
+             );
+static PyObject*
+mod_enable_fixed_spawn_base(PyObject* UNUSED(module), PyObject* flag)
+{
+    int is_true = PyObject_IsTrue(flag);
+    if (is_true == -1) {
+        return nullptr;
+    }
+
+    try {
+        ThreadState& state = GET_THREAD_STATE().state();
+        if (!is_true) {
+            state.clear_spawn_trampoline();
+            Py_RETURN_NONE;
+        }
+        if (state.get_spawn_trampoline()) {
+            Py_RETURN_NONE;
+        }
+
+        const NewReference run(Require(PyCFunction_New(&spawn_trampoline_def, nullptr)));
+        const OwnedGreenlet trampoline = OwnedGreenlet::consuming(PyGreenlet_New(run.borrow(), nullptr));
+        if (!trampoline) {
+            throw PyErrOccurred();
+        }
+        // Record it first so that neither starting it nor it
+        // switching back to us gets reported to the trace function.
+        state.set_spawn_trampoline(trampoline);
+        OwnedObject no_args = OwnedObject::owning(mod_globs.empty_tuple);
+        trampoline->args() <<= no_args;
+        try {
+            // This returns as soon as it has parked itself down the
+            // stack from here.
+            if (!trampoline->g_switch()) {
+                throw PyErrOccurred();
+            }
+        }
+        catch (const PyErrOccurred&) {
+            state.clear_spawn_trampoline();
+            throw;
+        }
+        Py_RETURN_NONE;
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
+PyDoc_STRVAR(mod_enable_perf_map_doc,
+             "enable_perf_map(bool) -> str or None\n"
+             "\n"
+             "Help Linux ``perf`` attribute samples to greenlets.\n"
+             "\n"
+             "While this is enabled, each greenlet that starts is described, by its\n"
+             "address (its :func:`id`) and the name of its ``run``, in a file in the\n"
+             "format of perf's ``/tmp/perf-<pid>.map`` files, and every switch calls\n"
+             "``greenlet_perf_switch(origin, target)``, a C function that can be\n"
+             "recorded with ``perf probe``. Returns the path to the file, or None\n"
+             "when disabling. Raises :exc:`OSError` if the file can't be opened, or\n"
+             "this isn't supported on this platform.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0"
+             );
+static PyObject*
+mod_enable_perf_map(PyObject* UNUSED(module), PyObject* flag)
+{
+    const int is_true = PyObject_IsTrue(flag);
+    if (is_true == -1) {
+        return nullptr;
+    }
+    if (!is_true) {
+        PerfMap::disable();
+        Py_RETURN_NONE;
+    }
+    const char* const path = PerfMap::enable();
+    if (!path) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FromString(path);
+#else
+    return PyString_FromString(path);
+#endif
+}
+
+PyDoc_STRVAR(mod_get_stack_copy_threshold_doc,
+             "get_stack_copy_threshold() -> Integer\n"
+             "\n"
+             "Return the size, in bytes, at which saving a greenlet's stack to the heap\n"
+             "starts using stores that bypass the CPU caches.\n"
+             "\n"
+             "See :func:`set_stack_copy_threshold`.");
+static PyObject*
+mod_get_stack_copy_threshold(PyObject* UNUSED(module))
+{
+    return PyLong_FromSize_t(StackCopier::threshold());
+}
+
+PyDoc_STRVAR(mod_set_stack_copy_threshold_doc,
+             "set_stack_copy_threshold(nbytes) -> None\n"
+             "\n"
+             "Set the size, in bytes, at which saving a greenlet's stack to the heap\n"
+             "starts using non-temporal stores. Those keep a saved stack, which won't be\n"
+             "needed until its greenlet runs again, from pushing what the next greenlet\n"
+             "will use out of the CPU caches, at the cost of having to fetch it from\n"
+             "memory when it is restored. Values below an internal minimum are raised\n"
+             "to that minimum. By default, the threshold is so large that this is\n"
+             "never done. This has no effect when ``STACK_COPY_KERNEL`` is\n"
+             "``'memcpy'``.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0"
+             );
+static PyObject*
+mod_set_stack_copy_threshold(PyObject* UNUSED(module), PyObject* nbytes)
+{
+    const Py_ssize_t threshold = PyNumber_AsSsize_t(nbytes, PyExc_OverflowError);
+    if (threshold == -1 && PyErr_Occurred()) {
+        return nullptr;
+    }
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "The threshold cannot be negative.");
+        return nullptr;
+    }
+    StackCopier::threshold(threshold);
+    Py_RETURN_NONE;
+}
+
+#if G_USE_MREMAP_STACK_SAVE
+PyDoc_STRVAR(mod_set_stack_remap_threshold_doc,
+             "set_stack_remap_threshold(nbytes) -> None\n"
+             "\n"
+             "Set the size, in bytes, at which saving a greenlet's stack to the heap\n"
+             "moves whole pages of it with ``mremap`` instead of copying them.\n"
+             "\n"
+             "Only available when greenlet is compiled with ``G_USE_MREMAP_STACK_SAVE``.\n"
+             "This is experimental. It may be changed or removed in the future.");
+static PyObject*
+mod_set_stack_remap_threshold(PyObject* UNUSED(module), PyObject* nbytes)
+{
+    const Py_ssize_t threshold = PyNumber_AsSsize_t(nbytes, PyExc_OverflowError);
+    if (threshold == -1 && PyErr_Occurred()) {
+        return nullptr;
+    }
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "The threshold cannot be negative.");
+        return nullptr;
+    }
+    StackCopier::remap_threshold(threshold);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_get_stack_remap_threshold_doc,
+             "get_stack_remap_threshold() -> Integer\n"
+             "\n"
+             "See :func:`set_stack_remap_threshold`.");
+static PyObject*
+mod_get_stack_remap_threshold(PyObject* UNUSED(module))
+{
+    return PyLong_FromSize_t(StackCopier::remap_threshold());
+}
+#endif
+
+PyDoc_STRVAR(mod_set_lazy_stack_restore_threshold_doc,
+             "set_lazy_stack_restore_threshold(nbytes) -> None\n"
+             "\n"
+             "Restore saved stacks of at least *nbytes* lazily; 0 (the default)\n"
+             "turns that off.\n"
+             "\n"
+             "Switching to a greenlet normally copies all of its saved stack back\n"
+             "onto the C stack. A lazily restored stack only has the first pages, the\n"
+             "ones the greenlet resumes in, copied; the rest are copied in one at a\n"
+             "time, by a helper thread, when the greenlet returns far enough to touch\n"
+             "them. This can help when greenlets with deep stacks (for example,\n"
+             "recursive parsers) switch often but seldom return from more than a few\n"
+             "frames in between.\n"
+             "\n"
+             "This uses ``userfaultfd(2)`` and is only available on Linux. Raises\n"
+             ":exc:`OSError` if it isn't available, or the process isn't allowed to\n"
+             "use it. It is turned off in the child after a ``fork()``.\n"
+             "\n"
+             "See :func:`get_stack_restore_stats`.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0"
+             );
+static PyObject*
+mod_set_lazy_stack_restore_threshold(PyObject* UNUSED(module), PyObject* nbytes)
+{
+    const Py_ssize_t threshold = PyNumber_AsSsize_t(nbytes, PyExc_OverflowError);
+    if (threshold == -1 && PyErr_Occurred()) {
+        return nullptr;
+    }
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "The threshold cannot be negative.");
+        return nullptr;
+    }
+    if (const int err = LazyStackRestore::threshold(threshold)) {
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_get_lazy_stack_restore_threshold_doc,
+             "get_lazy_stack_restore_threshold() -> Integer\n"
+             "\n"
+             "Return the size at which saved stacks are restored lazily, or 0.\n"
+             "\n"
+             "See :func:`set_lazy_stack_restore_threshold`.");
+static PyObject*
+mod_get_lazy_stack_restore_threshold(PyObject* UNUSED(module))
+{
+    return PyLong_FromSize_t(LazyStackRestore::threshold());
+}
+
+PyDoc_STRVAR(mod_get_stack_restore_stats_doc,
+             "get_stack_restore_stats() -> dict\n"
+             "\n"
+             "Return how much stack was restored by the most recent switch in this\n"
+             "thread. The keys are:\n"
+             "\n"
+             "``eager_bytes``\n"
+             "    The bytes copied back when the greenlet was switched to.\n"
+             "``deferred_bytes``\n"
+             "    The bytes left to be restored lazily.\n"
+             "``faulted_bytes``\n"
+             "    The bytes that have been restored lazily in this thread since then.\n"
+             "``total_deferred_bytes``, ``total_faulted_bytes``\n"
+             "    The same, for all switches in all threads.\n"
+             "\n"
+             "See :func:`set_lazy_stack_restore_threshold`.");
+static PyObject*
+mod_get_stack_restore_stats(PyObject* UNUSED(module))
+{
+    try {
+        const LazyStackRestore::ThreadRecord& record = GET_THREAD_STATE().state().lazy_restore_record();
+#if G_USE_LAZY_STACK_RESTORE
+        const size_t faulted_bytes = record.faulted_bytes;
+#else
+        const size_t faulted_bytes = 0;
+#endif
+        return Require(Py_BuildValue(
+            "{s:n,s:n,s:n,s:n,s:n}",
+            "eager_bytes", static_cast<Py_ssize_t>(record.eager_bytes),
+            "deferred_bytes", static_cast<Py_ssize_t>(record.deferred_bytes),
+            "faulted_bytes", static_cast<Py_ssize_t>(faulted_bytes),
+            "total_deferred_bytes", static_cast<Py_ssize_t>(LazyStackRestore::total_deferred()),
+            "total_faulted_bytes", static_cast<Py_ssize_t>(LazyStackRestore::total_faulted())));
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
+PyDoc_STRVAR(mod_get_switch_log_doc,
+             "get_switch_log() -> list\n"
+             "\n"
+             "Return the most recent switches in this thread, oldest first, as a list\n"
+             "of ``(timestamp, event, origin, target, nbytes)`` tuples.\n"
+             "\n"
+             "*timestamp* is in nanoseconds, from an arbitrary starting point. *event*\n"
+             "is ``'switch'`` or ``'throw'`` for a switch from *origin* to *target*,\n"
+             "``'start'`` when *target* is about to call its ``run`` (having been\n"
+             "switched to by *origin*), or ``'finish'`` when *origin*'s ``run`` is done\n"
+             "and it's about to switch to *target*, its parent. Greenlets are given\n"
+             "by their :func:`id`. *nbytes* is how much of the C stack a switch copied.\n"
+             "\n"
+             "The log holds the last few thousand entries recorded while\n"
+             ":func:`enable_switch_log` was on. It is written to standard error if\n"
+             "greenlet has to abort the process.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_get_switch_log(PyObject* UNUSED(module))
+{
+    try {
+        const SwitchLog& log = GET_THREAD_STATE().state().switch_log();
+        const size_t n = log.size();
+        OwnedObject result = OwnedObject::consuming(Require(PyList_New(n)));
+        for (size_t i = 0; i < n; i++) {
+            const SwitchLog::Entry& e = log[i];
+            PyObject* item = Require(Py_BuildValue(
+                "(KsKKk)",
+                static_cast<unsigned long long>(e.timestamp),
+                SwitchLog::event_name(e.event),
+                static_cast<unsigned long long>(e.origin),
+                static_cast<unsigned long long>(e.target),
+                static_cast<unsigned long>(e.nbytes)));
+            PyList_SET_ITEM(result.borrow(), i, item);
+        }
+        return result.relinquish_ownership();
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
+PyDoc_STRVAR(mod_enable_switch_log_doc,
+             "enable_switch_log(bool) -> None\n"
+             "\n"
+             "Start (or stop) recording every switch, in every thread, for\n"
+             ":func:`get_switch_log`. Each thread's log is allocated when it records\n"
+             "its first switch. Stopping keeps what has been recorded.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_enable_switch_log(PyObject* UNUSED(module), PyObject* flag)
+{
+    const int is_true = PyObject_IsTrue(flag);
+    if (is_true == -1) {
+        return nullptr;
+    }
+    SwitchLog::enabled = is_true;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_advise_idle_doc,
+             "advise_idle(seconds, pageout=False) -> Integer\n"
+             "\n"
+             "Tell the operating system that the saved stacks of greenlets that have\n"
+             "been suspended for at least *seconds* won't be needed soon, so it should\n"
+             "reclaim their memory before other memory, should it run short. With a\n"
+             "true *pageout*, ask for them to be swapped out right away instead.\n"
+             "Stacks are only advised about once per suspension. Returns how many were\n"
+             "advised about.\n"
+             "\n"
+             "This only applies to saved stacks of at least 16KB, which have pages\n"
+             "of their own when greenlet is compiled with ``G_USE_MMAP_STACK_COPY``\n"
+             "defined to 1, on Linux. It uses ``madvise(2)`` with ``MADV_COLD`` or\n"
+             "``MADV_PAGEOUT``, which need Linux 5.4; it raises :exc:`OSError` if\n"
+             "those aren't available. Otherwise, it does nothing.\n"
+             "\n"
+             "See :func:`get_idle_stack_stats`.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_advise_idle(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    static const char* const kwlist[] = {
+        "seconds",
+        "pageout",
+        NULL
+    };
+    double seconds;
+    PyObject* pageout = Py_False;
+    if (!PyArg_ParseTupleAndKeywords(
+             args, kwargs, "d|O:advise_idle", (char**)kwlist, &seconds, &pageout)) {
+        return nullptr;
+    }
+    const int use_pageout = PyObject_IsTrue(pageout);
+    if (use_pageout < 0) {
+        return nullptr;
+    }
+#if G_USE_MMAP_STACK_COPY
+    const Py_ssize_t count = StackCopier::advise_idle(seconds, use_pageout ? MADV_PAGEOUT : MADV_COLD);
+    if (count < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return PyLong_FromSsize_t(count);
+#else
+    (void)seconds;
+    return PyLong_FromLong(0);
+#endif
+}
+
+PyDoc_STRVAR(mod_enable_switch_latency_doc,
+             "enable_switch_latency(bool) -> None\n"
+             "\n"
+             "Start (or stop) timing every switch, in every thread, and counting the\n"
+             "durations in a histogram for the thread. See :func:`get_switch_latency`.\n"
+             "Timing a switch costs an extra clock read.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_enable_switch_latency(PyObject* UNUSED(module), PyObject* flag)
+{
+    const int is_true = PyObject_IsTrue(flag);
+    if (is_true == -1) {
+        return nullptr;
+    }
+    LatencyHistogram::enabled = is_true;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_get_switch_latency_doc,
+             "get_switch_latency(reset=False) -> dict\n"
+             "\n"
+             "Return a snapshot of how long switches in this thread have taken, in\n"
+             "nanoseconds, from starting to save the current greenlet to finishing\n"
+             "restoring the next, while :func:`enable_switch_latency` was on. If *reset*\n"
+             "is true, start counting again afterwards. The keys are:\n"
+             "\n"
+             "``count``, ``min``, ``max``, ``mean``\n"
+             "    Exactly what they say.\n"
+             "``p50``, ``p99``, ``p999``\n"
+             "    The median, 99th and 99.9th percentiles, within 6.25%.\n"
+             "``buckets``\n"
+             "    The histogram, as a list of ``(highest_value, count)`` pairs, one for\n"
+             "    each non-empty bucket, in order.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_get_switch_latency(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    static const char* kwlist[] = {"reset", nullptr};
+    PyObject* reset = Py_False;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:get_switch_latency",
+                                     (char**)kwlist, &reset)) {
+        return nullptr;
+    }
+    const int do_reset = PyObject_IsTrue(reset);
+    if (do_reset == -1) {
+        return nullptr;
+    }
+    try {
+        LatencyHistogram& histogram = GET_THREAD_STATE().state().switch_latency();
+        OwnedObject buckets = OwnedObject::consuming(Require(PyList_New(0)));
+        for (size_t i = 0; i < LatencyHistogram::bucket_count; i++) {
+            const uint64_t count = histogram.count_at(i);
+            if (!count) {
+                continue;
+            }
+            OwnedObject item = OwnedObject::consuming(Require(Py_BuildValue(
+                "(KK)",
+                static_cast<unsigned long long>(LatencyHistogram::highest_value_at(i)),
+                static_cast<unsigned long long>(count))));
+            if (PyList_Append(buckets.borrow(), item.borrow()) < 0) {
+                throw PyErrOccurred();
+            }
+        }
+        PyObject* result = Require(Py_BuildValue(
+            "{s:K,s:K,s:K,s:d,s:K,s:K,s:K,s:O}",
+            "count", static_cast<unsigned long long>(histogram.total_count()),
+            "min", static_cast<unsigned long long>(histogram.min_value()),
+            "max", static_cast<unsigned long long>(histogram.max_value()),
+            "mean", histogram.mean(),
+            "p50", static_cast<unsigned long long>(histogram.value_at_percentile(50.0)),
+            "p99", static_cast<unsigned long long>(histogram.value_at_percentile(99.0)),
+            "p999", static_cast<unsigned long long>(histogram.value_at_percentile(99.9)),
+            "buckets", buckets.borrow()));
+        if (do_reset) {
+            histogram.reset();
+        }
+        return result;
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
+PyDoc_STRVAR(mod_start_timeline_doc,
+             "start_timeline(path) -> None\n"
+             "\n"
+             "Start recording which greenlet runs when, in every thread, to the file\n"
+             "*path*, in the Chrome Trace Event format that Perfetto and\n"
+             "``chrome://tracing`` can open. Each greenlet that starts from now on is\n"
+             "named after its ``run``. The file isn't complete until\n"
+             ":func:`stop_timeline` is called.\n"
+             "\n"
+             "Raises :exc:`RuntimeError` if a timeline is already being recorded,\n"
+             "and :exc:`OSError` if *path* can't be opened.\n"
+             "\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_start_timeline(PyObject* UNUSED(module), PyObject* args)
+{
+#if PY_MAJOR_VERSION >= 3
+    PyObject* bytes = nullptr;
+    if (!PyArg_ParseTuple(args, "O&:start_timeline", PyUnicode_FSConverter, &bytes)) {
+        return nullptr;
+    }
+    const OwnedObject path = OwnedObject::consuming(bytes);
+    const char* const c_path = PyBytes_AS_STRING(bytes);
+#else
+    const char* c_path = nullptr;
+    if (!PyArg_ParseTuple(args, "s:start_timeline", &c_path)) {
+        return nullptr;
+    }
+#endif
+    if (Timeline::enabled()) {
+        PyErr_SetString(PyExc_RuntimeError, "A timeline is already being recorded");
+        return nullptr;
+    }
+    try {
+        ThreadState& state = GET_THREAD_STATE().state();
+        const BorrowedGreenlet current = state.borrow_current();
+        if (!Timeline::start(c_path, SwitchLog::now(), &state, current.borrow_o(),
+                             current->main())) {
+            return PyErr_SetFromErrnoWithFilename(PyExc_OSError, c_path);
+        }
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_stop_timeline_doc,
+             "stop_timeline() -> None\n"
+             "\n"
+             "Finish and close the file started by :func:`start_timeline`. Does\n"
+             "nothing if no timeline is being recorded. Raises :exc:`OSError` if\n"
+             "writing the file failed.\n"
+             "\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_stop_timeline(PyObject* UNUSED(module))
+{
+    if (!Timeline::stop(SwitchLog::now())) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_NONE;
+}
+
+/**
+ * Has the thread *state* belongs to exited? Its state lingers until
+ * we get around to cleaning up after it.
+ */
+static bool
+thread_state_has_exited(ThreadState* state)
+{
+    return !state->has_main_greenlet()
+        || state->borrow_main_greenlet()->thread_state() != state;
+}
+
+PyDoc_STRVAR(mod_get_memory_stats_doc,
+             "get_memory_stats() -> dict\n"
+             "\n"
+             "Return how many greenlets there are, and how much memory their saved\n"
+             "stacks hold, in each thread and in the whole process. These are kept\n"
+             "up to date as stacks are saved and freed, so this is cheap.\n"
+             "\n"
+             "The result has the key ``threads``, a dictionary mapping the\n"
+             "``threading.get_ident()`` of each thread using greenlets to a\n"
+             "dictionary of its statistics, plus the same statistics for the whole\n"
+             "process (including saved stacks left over from exited threads), and\n"
+             "``pool_bytes``. The statistics are:\n"
+             "\n"
+             "``started``\n"
+             "    Greenlets (not counting main greenlets) that have started and\n"
+             "    haven't finished.\n"
+             "``suspended``\n"
+             "    Those of them that aren't running.\n"
+             "``saved_stacks``, ``saved_bytes``\n"
+             "    Greenlets (including main greenlets) that have some of their stack\n"
+             "    saved to the heap, and the total saved. This is the sum of\n"
+             "    ``_stack_saved``.\n"
+             "``largest_saved_bytes``\n"
+             "    The largest single saved stack, to within 6.25%.\n"
+             "\n"
+             "``pool_bytes`` is the memory kept for reuse by future saved stacks\n"
+             "(see :func:`advise_idle`).\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0");
+
+static PyObject*
+memory_stats_dict(const size_t started, const size_t suspended,
+                  const size_t saved_stacks, const size_t saved_bytes,
+                  const size_t largest_saved_bytes)
+{
+    return Py_BuildValue(
+        "{s:n,s:n,s:n,s:n,s:n}",
+        "started", static_cast<Py_ssize_t>(started),
+        "suspended", static_cast<Py_ssize_t>(suspended),
+        "saved_stacks", static_cast<Py_ssize_t>(saved_stacks),
+        "saved_bytes", static_cast<Py_ssize_t>(saved_bytes),
+        "largest_saved_bytes", static_cast<Py_ssize_t>(largest_saved_bytes));
+}
+
+static PyObject*
+mod_get_memory_stats(PyObject* UNUSED(module))
+{
+    using greenlet::MemoryStats;
+    // Make sure this thread is included.
+    GET_THREAD_STATE().state();
+    try {
+        OwnedObject threads = OwnedObject::consuming(Require(PyDict_New()));
+        size_t started = 0;
+        size_t suspended = 0;
+        size_t saved_stacks = MemoryStats::orphaned.saved_stacks();
+        size_t saved_bytes = MemoryStats::orphaned.saved_bytes();
+        size_t largest = MemoryStats::orphaned.largest_saved();
+        for (ThreadState* state = ThreadState::first(); state; state = state->next()) {
+            const MemoryStats& stats = state->memory_stats();
+            saved_stacks += stats.saved_stacks();
+            saved_bytes += stats.saved_bytes();
+            if (stats.largest_saved() > largest) {
+                largest = stats.largest_saved();
+            }
+            if (thread_state_has_exited(state)) {
+                continue;
+            }
+            size_t thread_started = state->registered_greenlet_count();
+            const OwnedGreenlet& trampoline = state->get_spawn_trampoline();
+            if (trampoline && trampoline->active()) {
+                thread_started--;
+            }
+            const ThreadState* const other = state;
+            const size_t thread_suspended = thread_started
+                - (other->borrow_current()->main() ? 0 : 1);
+            started += thread_started;
+            suspended += thread_suspended;
+
+            OwnedObject key = OwnedObject::consuming(
+                Require(PyLong_FromUnsignedLong(state->thread_ident())));
+            OwnedObject value = OwnedObject::consuming(Require(memory_stats_dict(
+                thread_started, thread_suspended,
+                stats.saved_stacks(), stats.saved_bytes(), stats.largest_saved())));
+            if (PyDict_SetItem(threads.borrow(), key.borrow(), value.borrow()) < 0) {
+                throw PyErrOccurred();
+            }
+        }
+        OwnedObject result = OwnedObject::consuming(Require(memory_stats_dict(
+            started, suspended, saved_stacks, saved_bytes, largest)));
+#if G_USE_MMAP_STACK_COPY
+        const size_t pool_bytes = StackCopier::total_cached_bytes();
+#else
+        const size_t pool_bytes = 0;
+#endif
+        OwnedObject pool = OwnedObject::consuming(
+            Require(PyLong_FromSsize_t(static_cast<Py_ssize_t>(pool_bytes))));
+        if (PyDict_SetItemString(result.borrow(), "pool_bytes", pool.borrow()) < 0
+            || PyDict_SetItemString(result.borrow(), "threads", threads.borrow()) < 0) {
+            throw PyErrOccurred();
+        }
+        return result.relinquish_ownership();
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
+#if G_USE_WATCHDOG
+/* The callable given to enable_watchdog(), if any. */
+static PyObject* watchdog_callback = nullptr;
+
+/**
+ * What the watchdog found running for too long in one thread.
+ */
+struct StuckGreenlet
+{
+    ThreadState* state;
+    unsigned long thread_ident;
+    uint64_t switched_at;
+    OwnedGreenlet greenlet;
+};
+
+/**
+ * Is the greenlet *stuck* found still running? Running Python code
+ * to report it could let it switch, or its thread exit.
+ */
+static bool
+still_stuck(const StuckGreenlet& stuck)
+{
+    for (ThreadState* state = ThreadState::first(); state; state = state->next()) {
+        if (state == stuck.state) {
+            return !thread_state_has_exited(state)
+                && state->thread_ident() == stuck.thread_ident
+                && state->switched_at() == stuck.switched_at;
+        }
+    }
+    return false;
+}
+
+static void
+watchdog_report(const StuckGreenlet& stuck, PyObject* frame, const double seconds)
+{
+    PyObject* f = PySys_GetObject("stderr");
+    if (!f || f == Py_None) {
+        return;
+    }
+    char elapsed[32];
+    PyOS_snprintf(elapsed, sizeof(elapsed), "%.3f", seconds);
+    OwnedObject message = OwnedObject::consuming(Require(PyUnicode_FromFormat(
+        "greenlet: %R in thread %lu has been running for %s seconds without switching\n",
+        stuck.greenlet.borrow_o(), stuck.thread_ident, elapsed)));
+    if (PyFile_WriteObject(message.borrow(), f, Py_PRINT_RAW) < 0) {
+        throw PyErrOccurred();
+    }
+    if (frame != Py_None) {
+        OwnedObject traceback = OwnedObject::consuming(Require(PyImport_ImportModule("traceback")));
+        OwnedObject print_stack = traceback.PyRequireAttr("print_stack");
+        OwnedObject result = OwnedObject::consuming(Require(
+            PyObject_CallFunctionObjArgs(print_stack.borrow(), frame, Py_None, f, NULL)));
+    }
+}
+
+/**
+ * Called by the watchdog's thread, holding the GIL: report each
+ * greenlet that has been running since before *now* - *threshold*,
+ * once each time that happens.
+ */
+static void
+watchdog_check(const uint64_t now, const uint64_t threshold)
+{
+    std::vector<StuckGreenlet> found;
+    for (ThreadState* state = ThreadState::first(); state; state = state->next()) {
+        if (thread_state_has_exited(state) || !state->watchdog_should_report(now - threshold)) {
+            continue;
+        }
+        const ThreadState* const other = state;
+        StuckGreenlet stuck = {state, state->thread_ident(), state->switched_at(),
+                               other->borrow_current()};
+        found.push_back(stuck);
+    }
+    if (found.empty()) {
+        return;
+    }
+
+    PyErrPieces saved;
+    // Hold our own reference, in case the callback disables us.
+    const OwnedObject callback = OwnedObject::owning(watchdog_callback);
+    try {
+        OwnedObject sys = OwnedObject::consuming(Require(PyImport_ImportModule("sys")));
+        OwnedObject frames = OwnedObject::consuming(Require(
+            PyObject_CallMethod(sys.borrow(), "_current_frames", NULL)));
+        for (std::vector<StuckGreenlet>::const_iterator it = found.begin(); it != found.end(); ++it) {
+            const StuckGreenlet& stuck = *it;
+            OwnedObject ident = OwnedObject::consuming(Require(PyLong_FromUnsignedLong(stuck.thread_ident)));
+            PyObject* frame = PyDict_GetItem(frames.borrow(), ident.borrow());
+            if (!frame) {
+                frame = Py_None;
+            }
+            const double seconds = (now - stuck.switched_at) / 1e9;
+            if (!callback) {
+                try {
+                    watchdog_report(stuck, frame, seconds);
+                }
+                catch (const PyErrOccurred&) {
+                    PyErr_WriteUnraisable(nullptr);
+                }
+                continue;
+            }
+            OwnedObject py_seconds = OwnedObject::consuming(Require(PyFloat_FromDouble(seconds)));
+            OwnedObject result = OwnedObject::consuming(PyObject_CallFunctionObjArgs(
+                callback.borrow(), stuck.greenlet.borrow_o(), frame, py_seconds.borrow(), NULL));
+            if (!result) {
+                PyErr_WriteUnraisable(callback.borrow());
+                continue;
+            }
+            if (result.borrow() == Py_None) {
+                continue;
+            }
+            if (!PyExceptionClass_Check(result.borrow())) {
+                PyErr_Format(PyExc_TypeError,
+                             "The watchdog callback must return None or an exception class, not %s",
+                             Py_TYPE(result.borrow())->tp_name);
+                PyErr_WriteUnraisable(callback.borrow());
+                continue;
+            }
+            if (still_stuck(stuck)) {
+                PyThreadState_SetAsyncExc(stuck.thread_ident, result.borrow());
+            }
+        }
+    }
+    catch (const PyErrOccurred&) {
+        PyErr_WriteUnraisable(nullptr);
+    }
+    saved.PyErrRestore();
+}
+#endif
+
+PyDoc_STRVAR(mod_enable_watchdog_doc,
+             "enable_watchdog(threshold, callback=None) -> None\n"
+             "\n"
+             "Start a background thread that reports greenlets that run for more\n"
+             "than *threshold* seconds without switching, in any thread. Each time\n"
+             "a greenlet does, it's reported once, within about a quarter of the\n"
+             "threshold.\n"
+             "\n"
+             "By default, the report is written to ``sys.stderr``, along with the\n"
+             "stack of the greenlet. If *callback* is given, it's called instead,\n"
+             "in the watchdog's thread, as ``callback(glet, frame, seconds)``, where\n"
+             "*frame* is the greenlet's current frame (or None) and *seconds* is how\n"
+             "long it has been running. If the callback returns an exception class,\n"
+             "and the greenlet is still running, that exception is raised in it\n"
+             "asynchronously (like :c:func:`PyThreadState_SetAsyncExc`), the next\n"
+             "time it runs Python code.\n"
+             "\n"
+             "If the watchdog is already enabled, this changes the threshold and\n"
+             "callback. Greenlets can only be seen when the watchdog's thread can\n"
+             "get the GIL.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_enable_watchdog(PyObject* module, PyObject* args, PyObject* kwargs)
+{
+    static const char* const kwlist[] = {
+        "threshold",
+        "callback",
+        NULL
+    };
+    double threshold;
+    PyObject* callback = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(
+             args, kwargs, "d|O:enable_watchdog", (char**)kwlist, &threshold, &callback)) {
+        return nullptr;
+    }
+#if G_USE_WATCHDOG
+    using greenlet::Watchdog;
+    if (!(threshold > 0)) {
+        PyErr_SetString(PyExc_ValueError, "The threshold must be positive.");
+        return nullptr;
+    }
+    if (callback != Py_None && !PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "The callback must be callable or None.");
+        return nullptr;
+    }
+    if (Watchdog::in_thread()) {
+        PyErr_SetString(PyExc_RuntimeError, "The watchdog cannot be enabled from its own callback.");
+        return nullptr;
+    }
+    static bool registered_atexit = false;
+    if (!registered_atexit) {
+        // The thread has to be stopped before the interpreter is
+        // finalized, while it can still take the GIL.
+        OwnedObject atexit = OwnedObject::consuming(PyImport_ImportModule("atexit"));
+        if (!atexit) {
+            return nullptr;
+        }
+        OwnedObject disable = OwnedObject::consuming(PyObject_GetAttrString(module, "disable_watchdog"));
+        if (!disable) {
+            return nullptr;
+        }
+        OwnedObject result = OwnedObject::consuming(PyObject_CallMethod(
+            atexit.borrow(), "register", "O", disable.borrow()));
+        if (!result) {
+            return nullptr;
+        }
+        registered_atexit = true;
+    }
+    PyObject* old_callback = watchdog_callback;
+    watchdog_callback = callback == Py_None ? nullptr : callback;
+    Py_XINCREF(watchdog_callback);
+    Py_XDECREF(old_callback);
+    if (threshold > 1e9) {
+        threshold = 1e9;
+    }
+    const bool was_running = Watchdog::running();
+    if (!Watchdog::start(static_cast<uint64_t>(threshold * 1e9), watchdog_check)) {
+        Py_CLEAR(watchdog_callback);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to start the watchdog thread.");
+        return nullptr;
+    }
+    if (!was_running) {
+        // Switches weren't timed while it was off; count from now.
+        const uint64_t now = SwitchLog::now();
+        for (ThreadState* state = ThreadState::first(); state; state = state->next()) {
+            state->switched_at(now);
+        }
+    }
+    Py_RETURN_NONE;
+#else
+    (void)module;
+    (void)threshold;
+    (void)callback;
+    PyErr_SetString(PyExc_NotImplementedError, "The watchdog requires Python 3.");
+    return nullptr;
+#endif
+}
+
+PyDoc_STRVAR(mod_disable_watchdog_doc,
+             "disable_watchdog() -> None\n"
+             "\n"
+             "Stop the thread started by :func:`enable_watchdog`, and wait for it to\n"
+             "exit (unless this is called from its callback). Does nothing if it isn't\n"
+             "running.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0");
+static PyObject*
+mod_disable_watchdog(PyObject* UNUSED(module))
+{
+#if G_USE_WATCHDOG
+    greenlet::Watchdog::stop();
+    Py_CLEAR(watchdog_callback);
+#endif
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_get_idle_stack_stats_doc,
+             "get_idle_stack_stats() -> dict\n"
+             "\n"
+             "Return information about the saved stacks that :func:`advise_idle`\n"
+             "can advise about. The keys are:\n"
+             "\n"
+             "``mapped_copies``, ``mapped_bytes``\n"
+             "    How many saved stacks have pages of their own, and their total size.\n"
+             "``cached_bytes``\n"
+             "    The size of the pages kept for reuse by future saved stacks. These\n"
+             "    are given back by :func:`advise_idle`.\n"
+             "``advised_copies``, ``advised_bytes``\n"
+             "    How many saved stacks :func:`advise_idle` has advised about since\n"
+             "    the process started, and their total size.");
+static PyObject*
+mod_get_idle_stack_stats(PyObject* UNUSED(module))
+{
+#if G_USE_MMAP_STACK_COPY
+    const size_t mapped_copies = StackCopier::total_mapped_copies();
+    const size_t mapped_bytes = StackCopier::total_mapped_bytes();
+    const size_t cached_bytes = StackCopier::total_cached_bytes();
+    const size_t advised_copies = StackCopier::total_advised_copies();
+    const size_t advised_bytes = StackCopier::total_advised_bytes();
+#else
+    const size_t mapped_copies = 0;
+    const size_t mapped_bytes = 0;
+    const size_t cached_bytes = 0;
+    const size_t advised_copies = 0;
+    const size_t advised_bytes = 0;
+#endif
+    return Py_BuildValue(
+        "{s:n,s:n,s:n,s:n,s:n}",
+        "mapped_copies", static_cast<Py_ssize_t>(mapped_copies),
+        "mapped_bytes", static_cast<Py_ssize_t>(mapped_bytes),
+        "cached_bytes", static_cast<Py_ssize_t>(cached_bytes),
+        "advised_copies", static_cast<Py_ssize_t>(advised_copies),
+        "advised_bytes", static_cast<Py_ssize_t>(advised_bytes));
+}
+
+#if G_USE_SUSPENDED_GC
+PyDoc_STRVAR(mod_gc_callback_doc,
+             "_gc_callback(phase, info)\n"
+             "\n"
+             "Registered in :data:`gc.callbacks`. Kills the suspended greenlets\n"
+             "of this thread that the last collection found were garbage.\n");
+static PyObject*
+mod_gc_callback(PyObject* UNUSED(module), PyObject* UNUSED(args))
+{
+    // Both phases run outside the collection proper, so either is
+    // safe; the greenlets were queued by the one that just finished.
+    ThreadState* const state = current_thread_state_if_created();
+    if (state) {
+        state->kill_suspended_garbage();
+    }
+    Py_RETURN_NONE;
+}
+#endif
+
+#if G_USE_STANDARD_THREADING == 1
+/***********************************************************
+ * greenlet.Executor
+ */
+using greenlet::Executor;
+
+typedef struct {
+    PyObject_HEAD
+    Executor* executor;
+} PyGreenletExecutor;
+
+static PyObject*
+executor_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    static const char* kwlist[] = {nullptr};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":Executor", (char**)kwlist)) {
+        return nullptr;
+    }
+    PyGreenletExecutor* self = reinterpret_cast<PyGreenletExecutor*>(type->tp_alloc(type, 0));
+    if (self) {
+        self->executor = new Executor();
+    }
+    return reinterpret_cast<PyObject*>(self);
+}
+
+static int
+executor_traverse(PyGreenletExecutor* self, visitproc visit, void* arg)
+{
+    return self->executor->traverse(visit, arg);
+}
+
+static int
+executor_clear(PyGreenletExecutor* self)
+{
+    self->executor->clear();
+    return 0;
+}
+
+static void
+executor_dealloc(PyGreenletExecutor* self)
+{
+    PyObject_GC_UnTrack(self);
+    delete self->executor;
+    Py_TYPE(self)->tp_free(self);
+}
+
+PyDoc_STRVAR(executor_submit_doc,
+             "submit(glet) -> None\n"
+             "\n"
+             "Queue *glet*, a greenlet that hasn't started, for one of the threads\n"
+             "in :meth:`run` to start. From one of those threads, it goes on that\n"
+             "thread's own queue; otherwise, on the shortest one.\n"
+             "\n"
+             "Raises :exc:`ValueError` if *glet* has started, and\n"
+             ":exc:`RuntimeError` after :meth:`shutdown`, except from the threads\n"
+             "still in :meth:`run`.\n");
+static PyObject*
+executor_submit(PyGreenletExecutor* self, PyObject* glet)
+{
+    if (!PyGreenlet_Check(glet)) {
+        PyErr_Format(PyExc_TypeError,
+                     "submit() expected a greenlet, not %s",
+                     Py_TYPE(glet)->tp_name);
+        return nullptr;
+    }
+    if (reinterpret_cast<PyGreenlet*>(glet)->pimpl->started()) {
+        PyErr_SetString(PyExc_ValueError, "Only greenlets that haven't started can be submitted.");
+        return nullptr;
+    }
+    const ThreadState* const thread = &GET_THREAD_STATE().state();
+    Executor& executor = *self->executor;
+    if (executor.shut_down() && !executor.worker_for(thread)) {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot submit to an Executor after shutdown().");
+        return nullptr;
+    }
+    Py_INCREF(glet);
+    executor.submit(reinterpret_cast<PyGreenlet*>(glet), thread);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(executor_run_doc,
+             "run() -> int\n"
+             "\n"
+             "Make this thread one of the executor's workers: start the submitted\n"
+             "greenlets, one at a time, with the greenlet that called this as their\n"
+             "parent, until :meth:`shutdown` has been called and there's nothing\n"
+             "left to do. Returns how many greenlets this thread started.\n"
+             "\n"
+             "A greenlet that switches back to its parent before it finishes stays\n"
+             "suspended in this thread, and the next one is started. When this\n"
+             "thread runs out of greenlets, it takes the older half of another\n"
+             "thread's queue; if they're all empty, it waits, with the GIL released.\n"
+             "\n"
+             "An :exc:`Exception` that a greenlet raises is reported with\n"
+             ":func:`sys.unraisablehook` and the next one is started; any other\n"
+             "exception, such as :exc:`KeyboardInterrupt`, is raised here.\n");
+static PyObject*
+executor_run(PyGreenletExecutor* self)
+{
+    Executor& executor = *self->executor;
+    ThreadState& state = GET_THREAD_STATE().state();
+    if (executor.worker_for(&state)) {
+        PyErr_SetString(PyExc_RuntimeError, "This thread is already running this Executor.");
+        return nullptr;
+    }
+    const OwnedGreenlet hub = state.get_current();
+    Executor::Worker* const worker = executor.add_worker(&state);
+    Py_ssize_t started = 0;
+    try {
+        for (;;) {
+            PyGreenlet* const task = executor.take(worker);
+            if (!task) {
+                if (executor.shut_down()) {
+                    break;
+                }
+                executor.sleep(std::chrono::milliseconds(100));
+                if (PyErr_CheckSignals() < 0) {
+                    throw PyErrOccurred();
+                }
+                continue;
+            }
+            const OwnedGreenlet glet = OwnedGreenlet::consuming(task);
+            if (glet->started()) {
+                // Submitted twice, or started since some other way.
+                continue;
+            }
+            // Becoming its parent moves it to this thread; its first
+            // switch (g_initialstub) binds it here for good.
+            try {
+                glet->parent(hub.borrow_o());
+            }
+            catch (const PyErrOccurred&) {
+                // Say, a cycle: the hub descends from it. That's this
+                // greenlet's problem, not the worker's.
+                PyErr_WriteUnraisable(glet.borrow_o());
+                continue;
+            }
+            started++;
+            greenlet::SwitchingArgs no_args(OwnedObject::owning(mod_globs.empty_tuple.borrow()), OwnedObject());
+            glet->args() <<= no_args;
+            const OwnedObject result(glet->g_switch());
+            if (!result) {
+                if (!PyErr_ExceptionMatches(PyExc_Exception)) {
+                    throw PyErrOccurred();
+                }
+                PyErr_WriteUnraisable(glet.borrow_o());
+            }
+        }
+    }
+    catch (const PyErrOccurred&) {
+        executor.remove_worker(worker);
+        return nullptr;
+    }
+    executor.remove_worker(worker);
+    return PyLong_FromSsize_t(started);
+}
+
+PyDoc_STRVAR(executor_shutdown_doc,
+             "shutdown() -> None\n"
+             "\n"
+             "Stop taking greenlets from other threads, and let the threads in\n"
+             ":meth:`run` return once everything queued has been started.\n");
+static PyObject*
+executor_shutdown(PyGreenletExecutor* self)
+{
+    self->executor->shutdown();
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+executor_get_pending(PyGreenletExecutor* self, void* UNUSED(context))
+{
+    return PyLong_FromSize_t(self->executor->pending());
+}
+
+static PyObject*
+executor_get_steals(PyGreenletExecutor* self, void* UNUSED(context))
+{
+    return PyLong_FromSize_t(self->executor->steals());
+}
+
+static PyMethodDef executor_methods[] = {
+    {"submit", (PyCFunction)executor_submit, METH_O, executor_submit_doc},
+    {"run", (PyCFunction)executor_run, METH_NOARGS, executor_run_doc},
+    {"shutdown", (PyCFunction)executor_shutdown, METH_NOARGS, executor_shutdown_doc},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyGetSetDef executor_getsets[] = {
+    {"pending", (getter)executor_get_pending, NULL,
+     "The number of greenlets submitted and not yet taken by a thread."},
+    {"steals", (getter)executor_get_steals, NULL,
+     "How many times a thread has taken greenlets from another's queue."},
+    {NULL}
+};
+
+static PyTypeObject PyGreenletExecutor_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "greenlet.Executor",         /* tp_name */
+    sizeof(PyGreenletExecutor),  /* tp_basicsize */
+    0,                           /* tp_itemsize */
+    /* methods */
+    (destructor)executor_dealloc, /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    0,                         /* tp_repr */
+    0,                         /* tp_as _number*/
+    0,                         /* tp_as _sequence*/
+    0,                         /* tp_as _mapping*/
+    0,                         /* tp_hash */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer*/
+    G_TPFLAGS_DEFAULT,         /* tp_flags */
+    "Executor() -> Executor\n\n"
+    "Starts greenlets submitted from any thread in whichever of its\n"
+    "worker threads (those in :meth:`run`) is free, moving queued greenlets\n"
+    "from busy threads to idle ones. Only greenlets that haven't started\n"
+    "can move between threads.",  /* tp_doc */
+    (traverseproc)executor_traverse, /* tp_traverse */
+    (inquiry)executor_clear,         /* tp_clear */
+    0,                                  /* tp_richcompare */
+    0,                                  /* tp_weaklistoffset */
+    0,                                  /* tp_iter */
+    0,                                  /* tp_iternext */
+    executor_methods,                   /* tp_methods */
+    0,                                  /* tp_members */
+    executor_getsets,                   /* tp_getset */
+    0,                                  /* tp_base */
+    0,                                  /* tp_dict */
+    0,                                  /* tp_descr_get */
+    0,                                  /* tp_descr_set */
+    0,                                  /* tp_dictoffset */
+    0,                                  /* tp_init */
+    PyType_GenericAlloc,                /* tp_alloc */
+    (newfunc)executor_new,              /* tp_new */
+    PyObject_GC_Del,                    /* tp_free */
+    0,                                  /* tp_is_gc */
+};
+#endif
+
+static PyMethodDef GreenMethods[] = {
+    {"getcurrent",
+     (PyCFunction)mod_getcurrent,
+     METH_NOARGS,
+     mod_getcurrent_doc},
+    {"enumerate",
+     (PyCFunction)mod_enumerate,
+     METH_VARARGS | METH_KEYWORDS,
+     mod_enumerate_doc},
+    {"kill_all", (PyCFunction)mod_kill_all, METH_VARARGS | METH_KEYWORDS, mod_kill_all_doc},
+    {"set_exit_policy", (PyCFunction)mod_set_exit_policy, METH_VARARGS, mod_set_exit_policy_doc},
+    {"after_fork_child", (PyCFunction)mod_after_fork_child, METH_NOARGS, mod_after_fork_child_doc},
+    {"settrace", (PyCFunction)mod_settrace, METH_VARARGS, mod_settrace_doc},
+    {"gettrace", (PyCFunction)mod_gettrace, METH_NOARGS, mod_gettrace_doc},
+    {"set_thread_local", (PyCFunction)mod_set_thread_local, METH_VARARGS, mod_set_thread_local_doc},
+    {"get_pending_cleanup_count", (PyCFunction)mod_get_pending_cleanup_count, METH_NOARGS, mod_get_pending_cleanup_count_doc},
+    {"get_total_main_greenlets", (PyCFunction)mod_get_total_main_greenlets, METH_NOARGS, mod_get_total_main_greenlets_doc},
+    {"get_clocks_used_doing_optional_cleanup", (PyCFunction)mod_get_clocks_used_doing_optional_cleanup, METH_NOARGS, mod_get_clocks_used_doing_optional_cleanup_doc},
+    {"enable_optional_cleanup", (PyCFunction)mod_enable_optional_cleanup, METH_O, mod_enable_optional_cleanup_doc},
+    {"enable_fixed_spawn_base", (PyCFunction)mod_enable_fixed_spawn_base, METH_O, mod_enable_fixed_spawn_base_doc},
+    {"enable_perf_map", (PyCFunction)mod_enable_perf_map, METH_O, mod_enable_perf_map_doc},
+    {"get_stack_copy_threshold", (PyCFunction)mod_get_stack_copy_threshold, METH_NOARGS, mod_get_stack_copy_threshold_doc},
+    {"set_stack_copy_threshold", (PyCFunction)mod_set_stack_copy_threshold, METH_O, mod_set_stack_copy_threshold_doc},
+#if G_USE_MREMAP_STACK_SAVE
+    {"set_stack_remap_threshold", (PyCFunction)mod_set_stack_remap_threshold, METH_O, mod_set_stack_remap_threshold_doc},
+    {"get_stack_remap_threshold", (PyCFunction)mod_get_stack_remap_threshold, METH_NOARGS, mod_get_stack_remap_threshold_doc},
+#endif
+    {"set_lazy_stack_restore_threshold", (PyCFunction)mod_set_lazy_stack_restore_threshold, METH_O, mod_set_lazy_stack_restore_threshold_doc},
+    {"get_lazy_stack_restore_threshold", (PyCFunction)mod_get_lazy_stack_restore_threshold, METH_NOARGS, mod_get_lazy_stack_restore_threshold_doc},
+    {"get_stack_restore_stats", (PyCFunction)mod_get_stack_restore_stats, METH_NOARGS, mod_get_stack_restore_stats_doc},
+    {"get_switch_log", (PyCFunction)mod_get_switch_log, METH_NOARGS, mod_get_switch_log_doc},
+    {"enable_switch_log", (PyCFunction)mod_enable_switch_log, METH_O, mod_enable_switch_log_doc},
+    {"enable_switch_latency", (PyCFunction)mod_enable_switch_latency, METH_O,
+     mod_enable_switch_latency_doc},
+    {"get_switch_latency", (PyCFunction)mod_get_switch_latency, METH_VARARGS | METH_KEYWORDS,
+     mod_get_switch_latency_doc},
+    {"start_timeline", (PyCFunction)mod_start_timeline, METH_VARARGS, mod_start_timeline_doc},
+    {"stop_timeline", (PyCFunction)mod_stop_timeline, METH_NOARGS, mod_stop_timeline_doc},
+    {"advise_idle", (PyCFunction)mod_advise_idle, METH_VARARGS | METH_KEYWORDS, mod_advise_idle_doc},
+    {"get_idle_stack_stats", (PyCFunction)mod_get_idle_stack_stats, METH_NOARGS, mod_get_idle_stack_stats_doc},
+    {"get_memory_stats", (PyCFunction)mod_get_memory_stats, METH_NOARGS, mod_get_memory_stats_doc},
+    {"enable_watchdog", (PyCFunction)mod_enable_watchdog, METH_VARARGS | METH_KEYWORDS,
+     mod_enable_watchdog_doc},
+    {"disable_watchdog", (PyCFunction)mod_disable_watchdog, METH_NOARGS, mod_disable_watchdog_doc},
+#if G_USE_SUSPENDED_GC
+    {"_gc_callback", (PyCFunction)mod_gc_callback, METH_VARARGS, mod_gc_callback_doc},
+#endif
+    {NULL, NULL} /* Sentinel */
+};
+
+static const char* const copy_on_greentype[] = {
     "getcurrent",
     "error",
     "GreenletExit",
@@ -2844,16 +4767,34 @@ greenlet_internal_mod_init() G_NOEXCEPT
     try {
         CreatedModule m(greenlet_module_def);
 
+#if G_USE_SUSPENDED_GC
+        // The last slot; simpler to set here than to spell out all the
+        // ones in between.
+        PyGreenlet_Type.tp_finalize = (destructor)green_finalize;
+        PyGreenlet_Type.tp_flags |= Py_TPFLAGS_HAVE_FINALIZE;
+#endif
         Require(PyType_Ready(&PyGreenlet_Type));
 
 #if G_USE_STANDARD_THREADING == 0
         Require(PyType_Ready(&PyGreenletCleanup_Type));
 #endif
+#if G_USE_STANDARD_THREADING == 1
+        Require(PyType_Ready(&PyGreenletExecutor_Type));
+#endif
 
         new((void*)&mod_globs) GreenletGlobals;
+#if G_USE_STANDARD_THREADING == 1 && !defined(_WIN32)
+        pthread_atfork(ThreadState_DestroyNoGIL::lock_before_fork,
+                       ThreadState_DestroyNoGIL::unlock_after_fork,
+                       ThreadState_DestroyNoGIL::unlock_after_fork);
+#endif
         ThreadState::init();
+        StackCopier::init();
 
         m.PyAddObject("greenlet", PyGreenlet_Type);
+#if G_USE_STANDARD_THREADING == 1
+        m.PyAddObject("Executor", PyGreenletExecutor_Type);
+#endif
         m.PyAddObject("error", mod_globs.PyExc_GreenletError);
         m.PyAddObject("GreenletExit", mod_globs.PyExc_GreenletExit);
 
@@ -2863,10 +4804,26 @@ greenlet_internal_mod_init() G_NOEXCEPT
         // the same as NULL, which is ambiguous with a pointer.
         m.PyAddObject("GREENLET_USE_CONTEXT_VARS", (long)GREENLET_PY37);
         m.PyAddObject("GREENLET_USE_STANDARD_THREADING", (long)G_USE_STANDARD_THREADING);
+        m.PyAddObject("GREENLET_USE_MREMAP_STACK_SAVE", (long)G_USE_MREMAP_STACK_SAVE);
+        m.PyAddObject("GREENLET_USE_MMAP_STACK_COPY", (long)G_USE_MMAP_STACK_COPY);
+        m.PyAddObject("GREENLET_USE_USDT_PROBES", (long)G_USE_USDT_PROBES);
+        m.PyAddObject("GREENLET_USE_WATCHDOG", (long)G_USE_WATCHDOG);
+        m.PyAddObject("GREENLET_USE_SUSPENDED_GC", (long)G_USE_SUSPENDED_GC);
+#if G_USE_SUSPENDED_GC
+        {
+            OwnedObject gc = OwnedObject::consuming(Require(PyImport_ImportModule("gc")));
+            OwnedObject callbacks = gc.PyRequireAttr("callbacks");
+            OwnedObject gc_callback = m.PyRequireAttr("_gc_callback");
+            Require(PyList_Append(callbacks.borrow(), gc_callback.borrow()));
+        }
+#endif
 
         OwnedObject clocks_per_sec = OwnedObject::consuming(PyLong_FromSsize_t(CLOCKS_PER_SEC));
         m.PyAddObject("CLOCKS_PER_SEC", clocks_per_sec);
 
+        OwnedObject stack_copy_kernel = OwnedObject::consuming(Require(Greenlet_Intern(StackCopier::kernel_name())));
+        m.PyAddObject("STACK_COPY_KERNEL", stack_copy_kernel);
+
         /* also publish module-level data as attributes of the greentype. */
         // XXX: This is weird, and enables a strange pattern of
         // confusing the class greenlet with the module greenlet; with
@@ -2900,6 +4857,10 @@ greenlet_internal_mod_init() G_NOEXCEPT
         _PyGreenlet_API[PyGreenlet_STARTED_NUM] = (void*)Extern_PyGreenlet_STARTED;
         _PyGreenlet_API[PyGreenlet_ACTIVE_NUM] = (void*)Extern_PyGreenlet_ACTIVE;
         _PyGreenlet_API[PyGreenlet_GET_PARENT_NUM] = (void*)Extern_PyGreenlet_GET_PARENT;
+        _PyGreenlet_API[PyGreenlet_Enumerate_NUM] = (void*)PyGreenlet_Enumerate;
+        _PyGreenlet_API[PyGreenlet_SwitchValue_NUM] = (void*)PyGreenlet_SwitchValue;
+        _PyGreenlet_API[PyGreenlet_SwitchNoArgs_NUM] = (void*)PyGreenlet_SwitchNoArgs;
+        _PyGreenlet_API[PyGreenlet_NewNative_NUM] = (void*)PyGreenlet_NewNative;
 
         /* XXX: Note that our module name is ``greenlet._greenlet``, but for
            backwards compatibility with existing C code, we need the _C_API to
@@ -2911,6 +4872,8 @@ greenlet_internal_mod_init() G_NOEXCEPT
                                                "greenlet._C_API",
                                                NULL)));
         m.PyAddObject("_C_API", c_api_object);
+        OwnedObject c_api_version = OwnedObject::consuming(Require(PyLong_FromLong(PyGreenlet_API_VERSION)));
+        m.PyAddObject("_C_API_VERSION", c_api_version);
         assert(c_api_object.REFCNT() == 2);
         return m.borrow(); // But really it's the main reference.
     }
@@ -31,7 +31,21 @@ typedef struct _greenlet {
 /* C API functions */
 
 /* Total number of symbols that are exported */
-#define PyGreenlet_API_pointers 12
+#define PyGreenlet_API_pointers 16
+
+/*
+ * Incremented each time entries are added to the end of the table.
+ * After PyGreenlet_Import(), _PyGreenlet_API_version holds the
+ * version of the greenlet that was imported, which may be older than
+ * the header; entries it doesn't have must not be used.
+ *
+ * 0: Greenlets from before this version existed; everything
+ *    through PyGreenlet_GET_PARENT.
+ * 1: PyGreenlet_Enumerate.
+ * 2: PyGreenlet_SwitchValue, PyGreenlet_SwitchNoArgs.
+ * 3: PyGreenlet_NewNative.
+ */
+#define PyGreenlet_API_VERSION 3
 
 #define PyGreenlet_Type_NUM 0
 #define PyExc_GreenletError_NUM 1
@@ -47,10 +61,24 @@ typedef struct _greenlet {
 #define PyGreenlet_STARTED_NUM 9
 #define PyGreenlet_ACTIVE_NUM 10
 #define PyGreenlet_GET_PARENT_NUM 11
+#define PyGreenlet_Enumerate_NUM 12
+#define PyGreenlet_SwitchValue_NUM 13
+#define PyGreenlet_SwitchNoArgs_NUM 14
+#define PyGreenlet_NewNative_NUM 15
+
+/*
+ * The body of a greenlet made by PyGreenlet_NewNative(). *arg* is
+ * what was given to PyGreenlet_NewNative(), and *first_value* is a
+ * borrowed reference to what the first switch into the greenlet
+ * sent, as switch() would return it. Returns a new reference to the
+ * greenlet's result, or NULL with an exception set.
+ */
+typedef PyObject* (*PyGreenlet_NativeFunc)(void* arg, PyObject* first_value);
 
 #ifndef GREENLET_MODULE
 /* This section is used by modules that uses the greenlet C API */
 static void** _PyGreenlet_API = NULL;
+static long _PyGreenlet_API_version = 0;
 
 #    define PyGreenlet_Type \
         (*(PyTypeObject*)_PyGreenlet_API[PyGreenlet_Type_NUM])
@@ -129,14 +157,82 @@ static void** _PyGreenlet_API = NULL;
     (*(PyGreenlet* (*)(PyGreenlet*))                                     \
      _PyGreenlet_API[PyGreenlet_GET_PARENT_NUM])
 
+/*
+ * PyGreenlet_Enumerate(PyGreenlet *thread)
+ *
+ * greenlet.enumerate(thread), or greenlet.enumerate() if thread is NULL.
+ * Returns a new list. Requires _PyGreenlet_API_version >= 1.
+ */
+#    define PyGreenlet_Enumerate                 \
+        (*(PyObject * (*)(PyGreenlet * thread)) \
+             _PyGreenlet_API[PyGreenlet_Enumerate_NUM])
+
+/*
+ * PyGreenlet_SwitchValue(PyGreenlet *greenlet, PyObject *value)
+ *
+ * g.switch(value), without building an argument tuple when g is
+ * already running. Requires _PyGreenlet_API_version >= 2.
+ */
+#    define PyGreenlet_SwitchValue                            \
+        (*(PyObject * (*)(PyGreenlet * greenlet, PyObject * value)) \
+             _PyGreenlet_API[PyGreenlet_SwitchValue_NUM])
+
+/*
+ * PyGreenlet_SwitchNoArgs(PyGreenlet *greenlet)
+ *
+ * g.switch(). Requires _PyGreenlet_API_version >= 2.
+ */
+#    define PyGreenlet_SwitchNoArgs                  \
+        (*(PyObject * (*)(PyGreenlet * greenlet)) \
+             _PyGreenlet_API[PyGreenlet_SwitchNoArgs_NUM])
+
+/*
+ * PyGreenlet_NewNative(PyGreenlet_NativeFunc fn, void *arg, PyGreenlet *parent)
+ *
+ * Like PyGreenlet_New(), but the greenlet calls fn(arg, first_value)
+ * instead of a Python ``run``. Requires _PyGreenlet_API_version >= 3.
+ */
+#    define PyGreenlet_NewNative                          \
+        (*(PyGreenlet * (*)(PyGreenlet_NativeFunc fn,    \
+                            void* arg,                    \
+                            PyGreenlet* parent))          \
+             _PyGreenlet_API[PyGreenlet_NewNative_NUM])
+
 
 /* Macro that imports greenlet and initializes C API */
 /* NOTE: This has actually moved to ``greenlet._greenlet._C_API``, but we
    keep the older definition to be sure older code that might have a copy of
    the header still works. */
+/* Versions of greenlet from before _C_API_VERSION existed are 0. If
+   this succeeds, any exception the caller already had set is kept. */
 #    define PyGreenlet_Import()                                               \
         {                                                                     \
+            PyObject *_greenlet_et, *_greenlet_ev, *_greenlet_tb;             \
+            PyErr_Fetch(&_greenlet_et, &_greenlet_ev, &_greenlet_tb);         \
             _PyGreenlet_API = (void**)PyCapsule_Import("greenlet._C_API", 0); \
+            _PyGreenlet_API_version = 0;                                      \
+            if (_PyGreenlet_API) {                                            \
+                PyObject* _greenlet_mod = PyImport_ImportModule("greenlet");  \
+                PyObject* _greenlet_ver = _greenlet_mod                       \
+                    ? PyObject_GetAttrString(_greenlet_mod, "_C_API_VERSION") \
+                    : NULL;                                                   \
+                if (_greenlet_ver) {                                          \
+                    _PyGreenlet_API_version = PyLong_AsLong(_greenlet_ver);   \
+                }                                                             \
+                if (!_greenlet_ver || _PyGreenlet_API_version < 0) {          \
+                    _PyGreenlet_API_version = 0;                              \
+                    PyErr_Clear();                                            \
+                }                                                             \
+                Py_XDECREF(_greenlet_ver);                                    \
+                Py_XDECREF(_greenlet_mod);                                    \
+                PyErr_Restore(_greenlet_et, _greenlet_ev, _greenlet_tb);      \
+            }                                                                 \
+            else {                                                            \
+                /* The import's error is the one to report. */                \
+                Py_XDECREF(_greenlet_et);                                     \
+                Py_XDECREF(_greenlet_ev);                                     \
+                Py_XDECREF(_greenlet_tb);                                     \
+            }                                                                 \
         }
 
 #endif /* GREENLET_MODULE */
@@ -0,0 +1,300 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+#ifndef GREENLET_COROUTINE_HPP
+#define GREENLET_COROUTINE_HPP
+/**
+ * Waiting for C++20 coroutines from greenlets.
+ *
+ * A coroutine that returns a greenlet::coroutine::Task produces a
+ * Python object: it ``co_return``\ s a new reference, or ``nullptr``
+ * with a Python exception set. Tasks can ``co_await`` each other.
+ *
+ * ``greenlet::coroutine::wait(task)``, called in a greenlet, runs the
+ * task until it first suspends, then switches to the hub (the current
+ * greenlet's parent, unless another is given) so something else can
+ * run. Whatever resumes the coroutine, typically native event loop
+ * code running in the hub, ends up switching straight back into the
+ * waiting greenlet when the coroutine finishes: one switch per
+ * completion, with no Python code in between. ``wait()`` then returns
+ * what the coroutine returned. A task that finishes without
+ * suspending doesn't switch at all.
+ *
+ * The ``handle.resume()`` that finishes the coroutine returns when
+ * something switches back to the greenlet that called it; what was
+ * sent is dropped, and if an exception was thrown in instead, it's
+ * left set for the caller to deal with.
+ *
+ * If the waiting greenlet is switched to before the coroutine
+ * finishes, or an exception is thrown into it (including the
+ * GreenletExit that kills it), ``wait()`` stops waiting and raises
+ * (greenlet.error, for a plain switch). The coroutine is left to
+ * finish on its own, and frees itself when it does.
+ *
+ * Everything here happens in one thread, the one the greenlets belong
+ * to, with the GIL held. Like the rest of the C API, this uses the
+ * API pointers of the translation unit that includes it, which must
+ * have called PyGreenlet_Import(); so the types have internal
+ * linkage, and a Task can't be passed between translation units.
+ *
+ * Requires ``_PyGreenlet_API_version >= 2``.
+ */
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+#include "greenlet.h"
+
+namespace greenlet {
+namespace coroutine {
+namespace {
+
+class Task
+{
+public:
+    class promise_type
+    {
+    public:
+        class FinalAwaiter
+        {
+        public:
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle<>
+            await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+            {
+                promise_type& promise = handle.promise();
+                if (promise.continuation) {
+                    return promise.continuation;
+                }
+                if (promise.detached) {
+                    // Nobody wants the result anymore.
+                    handle.destroy();
+                    return std::noop_coroutine();
+                }
+                PyGreenlet* waiter = promise.waiter;
+                if (waiter) {
+                    promise.waiter = nullptr;
+                    // The waiter destroys the coroutine, so by the
+                    // time this returns, only locals are left.
+                    PyObject* result = PyGreenlet_SwitchNoArgs(waiter);
+                    Py_DECREF(waiter);
+                    Py_XDECREF(result);
+                }
+                return std::noop_coroutine();
+            }
+
+            void await_resume() const noexcept
+            {
+            }
+        };
+
+        promise_type()
+            : result(nullptr),
+              exc_type(nullptr),
+              exc_value(nullptr),
+              exc_tb(nullptr),
+              waiter(nullptr),
+              detached(false)
+        {}
+
+        ~promise_type()
+        {
+            Py_XDECREF(this->result);
+            Py_XDECREF(this->exc_type);
+            Py_XDECREF(this->exc_value);
+            Py_XDECREF(this->exc_tb);
+            Py_XDECREF(this->waiter);
+        }
+
+        Task get_return_object() noexcept
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        // Nothing runs until the task is waited for.
+        std::suspend_always initial_suspend() const noexcept
+        {
+            return std::suspend_always();
+        }
+
+        FinalAwaiter final_suspend() const noexcept
+        {
+            return FinalAwaiter();
+        }
+
+        void return_value(PyObject* value) noexcept
+        {
+            this->result = value;
+            if (!value) {
+                if (!PyErr_Occurred()) {
+                    PyErr_SetString(PyExc_SystemError,
+                                    "coroutine returned NULL without setting an error");
+                }
+                PyErr_Fetch(&this->exc_type, &this->exc_value, &this->exc_tb);
+            }
+        }
+
+        void unhandled_exception() noexcept
+        {
+            if (!PyErr_Occurred()) {
+                try {
+                    throw;
+                }
+                catch (const std::exception& e) {
+                    PyErr_SetString(PyExc_RuntimeError, e.what());
+                }
+                catch (...) {
+                    PyErr_SetString(PyExc_RuntimeError, "unknown C++ exception");
+                }
+            }
+            PyErr_Fetch(&this->exc_type, &this->exc_value, &this->exc_tb);
+        }
+
+        // A new reference, or nullptr with the exception set.
+        PyObject* take_result() noexcept
+        {
+            if (this->result) {
+                return std::exchange(this->result, nullptr);
+            }
+            PyErr_Restore(std::exchange(this->exc_type, nullptr),
+                          std::exchange(this->exc_value, nullptr),
+                          std::exchange(this->exc_tb, nullptr));
+            return nullptr;
+        }
+
+    private:
+        PyObject* result;
+        PyObject* exc_type;
+        PyObject* exc_value;
+        PyObject* exc_tb;
+        // The task that's awaiting this one, if any.
+        std::coroutine_handle<> continuation;
+        // The greenlet waiting for us, if any; a strong reference.
+        PyGreenlet* waiter;
+        // The waiter gave up; free ourself when done.
+        bool detached;
+
+        friend class Task;
+        friend PyObject* wait(Task&& task, PyGreenlet* hub);
+    };
+
+    Task(Task&& other) noexcept
+        : handle(std::exchange(other.handle, nullptr))
+    {}
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task()
+    {
+        if (this->handle) {
+            this->handle.destroy();
+        }
+    }
+
+    // Awaiting a task from another coroutine runs it there.
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        this->handle.promise().continuation = awaiting;
+        return this->handle;
+    }
+
+    PyObject* await_resume() noexcept
+    {
+        return this->handle.promise().take_result();
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept
+        : handle(handle)
+    {}
+
+    friend PyObject* wait(Task&& task, PyGreenlet* hub);
+};
+
+/**
+ * Run *task* in the current greenlet, switching to *hub* (by default,
+ * the current greenlet's parent) while it's suspended, and return its
+ * result: a new reference, or nullptr with an exception set.
+ */
+inline PyObject*
+wait(Task&& task, PyGreenlet* hub = nullptr)
+{
+    if (_PyGreenlet_API_version < 2) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "waiting for coroutines needs a newer greenlet");
+        return nullptr;
+    }
+    std::coroutine_handle<Task::promise_type> handle = task.handle;
+    if (!handle || handle.done()) {
+        PyErr_SetString(PyExc_GreenletError, "task has already been waited for");
+        return nullptr;
+    }
+
+    handle.resume();
+    if (handle.done()) {
+        return handle.promise().take_result();
+    }
+
+    PyGreenlet* current = PyGreenlet_GetCurrent();
+    if (!current) {
+        return nullptr;
+    }
+    if (hub) {
+        Py_INCREF(hub);
+    }
+    else {
+        hub = PyGreenlet_GET_PARENT(current);
+        if (!hub) {
+            Py_DECREF(current);
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_GreenletError,
+                                "the main greenlet can't wait without a hub");
+            }
+            // Nobody is left to switch to when it finishes.
+            task.handle.promise().detached = true;
+            task.handle = nullptr;
+            return nullptr;
+        }
+    }
+
+    handle.promise().waiter = current;
+    PyObject* switched = PyGreenlet_SwitchNoArgs(hub);
+    Py_DECREF(hub);
+    if (handle.done()) {
+        // The coroutine switched us back in; its handle is ours to
+        // destroy, along with the task.
+        Py_XDECREF(switched);
+        return handle.promise().take_result();
+    }
+
+    // Something else woke us up. Leave the coroutine to finish on
+    // its own.
+    Py_CLEAR(handle.promise().waiter);
+    handle.promise().detached = true;
+    task.handle = nullptr;
+    if (!switched) {
+        return nullptr;
+    }
+    Py_DECREF(switched);
+    PyErr_SetString(PyExc_GreenletError,
+                    "switched to a greenlet that was waiting for a coroutine");
+    return nullptr;
+}
+
+}; // anonymous namespace
+}; // namespace coroutine
+}; // namespace greenlet
+
+#endif
@@ -47,6 +47,33 @@ We have to save and restore this as well.
 #    define GREENLET_USE_CFRAME 0
 #endif
 
+#ifdef Py_GIL_DISABLED
+/*
+The free-threaded build of CPython 3.13. The switch itself keeps its
+state per thread, but a greenlet can still be deallocated or thrown
+into from another thread, and that goes through its own thread's
+``deleteme`` list and other state that only the GIL protects.
+*/
+#    error "greenlet does not support free-threaded (Py_GIL_DISABLED) builds of CPython yet."
+#endif
+
+#ifndef G_USE_SUSPENDED_GC
+/*
+Python 3.4 added tp_finalize (PEP 442), which the garbage collector
+calls on everything in an unreachable cycle before it clears any of
+it. That lets us kill a suspended greenlet that's only reachable from
+such a cycle (typically through the locals of its own frames) while
+its frames are still intact, so suspended greenlets can be collected.
+Python 3.11 keeps the locals of executing frames out of frame objects,
+where we can't reach them.
+*/
+#    if PY_VERSION_HEX >= 0x03040000 && PY_VERSION_HEX < 0x030B0000
+#        define G_USE_SUSPENDED_GC 1
+#    else
+#        define G_USE_SUSPENDED_GC 0
+#    endif
+#endif
+
 #ifndef Py_SET_REFCNT
 /* Py_REFCNT and Py_SIZE macros are converted to functions
 https://bugs.python.org/issue39573 */
@@ -115,6 +142,21 @@ PyObject* PyModule_Create(PyModuleDef* m)
 }
 #endif
 
+// Python 3.13 made Py_IsFinalizing() public.
+#if PY_VERSION_HEX < 0x030D0000
+static inline int Py_IsFinalizing()
+{
+#if PY_VERSION_HEX >= 0x03070000
+    return _Py_IsFinalizing();
+#elif PY_MAJOR_VERSION >= 3
+    return _Py_Finalizing != NULL;
+#else
+    // Python 2 stops being initialized as soon as finalizing begins.
+    return !Py_IsInitialized();
+#endif
+}
+#endif
+
 // bpo-43760 added PyThreadState_EnterTracing() to Python 3.11.0a2
 #if PY_VERSION_HEX < 0x030B00A2 && !defined(PYPY_VERSION)
 static inline void PyThreadState_EnterTracing(PyThreadState *tstate)
@@ -0,0 +1,304 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+#ifndef GREENLET_EXECUTOR_HPP
+#define GREENLET_EXECUTOR_HPP
+/**
+ * Queues of unstarted greenlets shared by several threads, for
+ * ``greenlet.Executor``.
+ *
+ * A started greenlet belongs to the thread whose stack it's on, but
+ * an unstarted one has no stack and no frames yet, and belongs to
+ * whichever thread its parent does; ``g_initialstub`` binds it to the
+ * thread that actually starts it. So any thread can run one, as long
+ * as it first becomes the parent (``check_switch_allowed`` then lets
+ * the first switch happen).
+ *
+ * Each thread that calls ``Executor.run()`` gets a Worker with a
+ * queue of its own. Greenlets submitted from a worker go on the back
+ * of its queue, and it takes them from the back, newest first, while
+ * what they refer to is likely still in the cache. Greenlets
+ * submitted from other threads go to the worker with the shortest
+ * queue. A worker with an empty queue steals the older half of the
+ * longest one, from the front, where its owner isn't looking; if
+ * there's nothing to steal, it sleeps, with the GIL released, until
+ * something is submitted (waking up now and then to check for
+ * signals).
+ *
+ * The queues are protected by the GIL; only sleeping and waking use
+ * the mutex. Each queue holds a reference to its greenlets.
+ */
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+#include <Python.h>
+
+#include "greenlet_compiler_compat.hpp"
+
+namespace greenlet {
+
+class Executor
+{
+public:
+    typedef std::deque<PyGreenlet*> queue_t;
+
+    struct Worker
+    {
+        // Whatever identifies the worker's thread; its ThreadState.
+        const void* const thread;
+        queue_t tasks;
+
+        Worker(const void* thread) : thread(thread)
+        {}
+    };
+
+private:
+    std::vector<Worker*> workers;
+    // Submitted while no thread was running; or left over by workers
+    // that returned.
+    queue_t unclaimed;
+    size_t _pending;
+    size_t _steals;
+    bool _shut_down;
+
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    // Both protected by sleep_lock.
+    size_t sleeping;
+    size_t wakeups;
+
+    G_NO_COPIES_OF_CLS(Executor);
+
+    static void clear_queue(queue_t& queue)
+    {
+        while (!queue.empty()) {
+            PyGreenlet* g = queue.back();
+            queue.pop_back();
+            Py_DECREF(g);
+        }
+    }
+
+    Worker* shortest_queue() const
+    {
+        Worker* result = nullptr;
+        for (std::vector<Worker*>::const_iterator it = workers.begin(); it != workers.end(); ++it) {
+            if (!result || (*it)->tasks.size() < result->tasks.size()) {
+                result = *it;
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Move the older half of the longest queue that isn't *thief*'s
+     * to the back of *thief*'s. Returns whether there was anything.
+     */
+    bool steal(Worker* thief)
+    {
+        Worker* victim = nullptr;
+        for (std::vector<Worker*>::const_iterator it = workers.begin(); it != workers.end(); ++it) {
+            if (*it != thief && (!victim || (*it)->tasks.size() > victim->tasks.size())) {
+                victim = *it;
+            }
+        }
+        if (!victim || victim->tasks.empty()) {
+            return false;
+        }
+        const size_t count = (victim->tasks.size() + 1) / 2;
+        // Keep their order: the newest of the stolen ones runs first.
+        thief->tasks.insert(thief->tasks.end(),
+                            victim->tasks.begin(), victim->tasks.begin() + count);
+        victim->tasks.erase(victim->tasks.begin(), victim->tasks.begin() + count);
+        this->_steals++;
+        return true;
+    }
+
+public:
+    Executor()
+        : _pending(0),
+          _steals(0),
+          _shut_down(false),
+          sleeping(0),
+          wakeups(0)
+    {}
+
+    ~Executor()
+    {
+        // Nothing's running: run() holds a reference to us.
+        assert(workers.empty());
+        this->clear();
+    }
+
+    inline size_t pending() const
+    {
+        return this->_pending;
+    }
+
+    inline size_t steals() const
+    {
+        return this->_steals;
+    }
+
+    inline bool shut_down() const
+    {
+        return this->_shut_down;
+    }
+
+    Worker* worker_for(const void* thread) const
+    {
+        for (std::vector<Worker*>::const_iterator it = workers.begin(); it != workers.end(); ++it) {
+            if ((*it)->thread == thread) {
+                return *it;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Queue *g*, stealing a reference, for *thread* if it's a worker
+     * or else the least busy worker.
+     */
+    void submit(PyGreenlet* g, const void* thread)
+    {
+        Worker* worker = this->worker_for(thread);
+        if (!worker) {
+            worker = this->shortest_queue();
+        }
+        if (worker) {
+            worker->tasks.push_back(g);
+        }
+        else {
+            this->unclaimed.push_back(g);
+        }
+        this->_pending++;
+        this->notify(false);
+    }
+
+    Worker* add_worker(const void* thread)
+    {
+        Worker* worker = new Worker(thread);
+        this->workers.push_back(worker);
+        return worker;
+    }
+
+    void remove_worker(Worker* worker)
+    {
+        this->workers.erase(std::find(this->workers.begin(), this->workers.end(), worker));
+        // Anything it didn't get to goes to the others, or waits for
+        // the next one.
+        for (queue_t::iterator it = worker->tasks.begin(); it != worker->tasks.end(); ++it) {
+            Worker* other = this->shortest_queue();
+            (other ? other->tasks : this->unclaimed).push_back(*it);
+        }
+        if (!worker->tasks.empty()) {
+            this->notify(true);
+        }
+        delete worker;
+    }
+
+    /**
+     * The next greenlet for *worker* to run, with the reference the
+     * queue had, or null if there's nothing anywhere.
+     */
+    PyGreenlet* take(Worker* worker)
+    {
+        if (worker->tasks.empty() && this->unclaimed.empty() && !this->steal(worker)) {
+            return nullptr;
+        }
+        PyGreenlet* result;
+        if (!worker->tasks.empty()) {
+            result = worker->tasks.back();
+            worker->tasks.pop_back();
+        }
+        else {
+            result = this->unclaimed.front();
+            this->unclaimed.pop_front();
+        }
+        this->_pending--;
+        return result;
+    }
+
+    /**
+     * Wait, with the GIL released, until notified or *timeout* has
+     * passed. Must hold the GIL.
+     */
+    template <typename D>
+    void sleep(const D& timeout)
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->sleep_lock);
+            this->sleeping++;
+        }
+        Py_BEGIN_ALLOW_THREADS;
+        {
+            // Released before we take the GIL back: whoever wakes us
+            // holds the GIL while it takes this.
+            std::unique_lock<std::mutex> lock(this->sleep_lock);
+            const std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + timeout;
+            while (!this->wakeups) {
+                if (this->wake.wait_until(lock, until) == std::cv_status::timeout) {
+                    break;
+                }
+            }
+            if (this->wakeups) {
+                this->wakeups--;
+            }
+            this->sleeping--;
+        }
+        Py_END_ALLOW_THREADS;
+    }
+
+    /**
+     * Wake one sleeping worker, or all of them.
+     */
+    void notify(const bool all)
+    {
+        std::lock_guard<std::mutex> lock(this->sleep_lock);
+        if (this->sleeping > this->wakeups) {
+            if (all) {
+                this->wakeups = this->sleeping;
+                this->wake.notify_all();
+            }
+            else {
+                this->wakeups++;
+                this->wake.notify_one();
+            }
+        }
+    }
+
+    void shutdown()
+    {
+        this->_shut_down = true;
+        this->notify(true);
+    }
+
+    template <typename V>
+    int traverse(V visit, void* arg) const
+    {
+        for (std::vector<Worker*>::const_iterator w = workers.begin(); w != workers.end(); ++w) {
+            for (queue_t::const_iterator it = (*w)->tasks.begin(); it != (*w)->tasks.end(); ++it) {
+                Py_VISIT(*it);
+            }
+        }
+        for (queue_t::const_iterator it = unclaimed.begin(); it != unclaimed.end(); ++it) {
+            Py_VISIT(*it);
+        }
+        return 0;
+    }
+
+    void clear()
+    {
+        for (std::vector<Worker*>::const_iterator w = workers.begin(); w != workers.end(); ++w) {
+            clear_queue((*w)->tasks);
+        }
+        clear_queue(this->unclaimed);
+        this->_pending = 0;
+    }
+};
+
+}; // namespace greenlet
+
+#endif
@@ -10,6 +10,13 @@
 #include "greenlet_refs.hpp"
 #include "greenlet_cpython_compat.hpp"
 #include "greenlet_allocator.hpp"
+#include "greenlet_stack_copy.hpp"
+#include "greenlet_lazy_restore.hpp"
+#include "greenlet_memory_stats.hpp"
+#if G_USE_SUSPENDED_GC
+// PyFrameObject's fields, for PythonState::traverse_suspended_frames().
+#include <frameobject.h>
+#endif
 
 using greenlet::refs::OwnedObject;
 using greenlet::refs::OwnedGreenlet;
@@ -122,11 +129,12 @@ namespace greenlet
         typedef greenlet::refs::OwnedReference<struct _frame> OwnedFrame;
     private:
         G_NO_COPIES_OF_CLS(PythonState);
-        // We own this if we're suspended (although currently we don't
-        // tp_traverse into it; that's a TODO). If we're running, it's
-        // empty. If we get deallocated and *still* have a frame, it
-        // won't be reachable from the place that normally decref's
-        // it, so we need to do it (hence owning it).
+        // We own this if we're suspended (the saved C stack holds
+        // the references; see traverse_suspended_frames()). If
+        // we're running, it's empty. If we get deallocated and
+        // *still* have a frame, it won't be reachable from the place
+        // that normally decref's it, so we need to do it (hence
+        // owning it).
         OwnedFrame _top_frame;
 #if  GREENLET_USE_CFRAME
         CFrame* cframe;
@@ -147,6 +155,9 @@ namespace greenlet
 
         int tp_traverse(visitproc visit, void* arg, bool visit_top_frame) G_NOEXCEPT;
         void tp_clear(bool own_top_frame) G_NOEXCEPT;
+#if G_USE_SUSPENDED_GC
+        int traverse_suspended_frames(visitproc visit, void* arg) const G_NOEXCEPT;
+#endif
         void set_initial_state(const PyThreadState* const tstate) G_NOEXCEPT;
 #if GREENLET_USE_CFRAME
         void set_new_cframe(CFrame& frame) G_NOEXCEPT;
@@ -169,7 +180,14 @@ namespace greenlet
         char* stack_copy;
         intptr_t _stack_saved;
         StackState* stack_prev;
-        inline int copy_stack_to_heap_up_to(const char* const stop) G_NOEXCEPT;
+        // Whether the copy was allocated by StackCopier as a mapping.
+        bool stack_copy_mapped;
+        // Where the size of our copy is accounted for, once we've
+        // started.
+        MemoryStats* stats;
+        inline int copy_stack_to_heap_up_to(const char* const stop,
+                                            const char* const overwritten_below,
+                                            size_t& nbytes) G_NOEXCEPT;
         inline void free_stack_copy() G_NOEXCEPT;
 
     public:
@@ -185,15 +203,23 @@ namespace greenlet
         ~StackState();
         StackState(const StackState& other);
         StackState& operator=(const StackState& other);
-        inline void copy_heap_to_stack(const StackState& current) G_NOEXCEPT;
-        inline int copy_stack_to_heap(char* const stackref, const StackState& current) G_NOEXCEPT;
+        inline void copy_heap_to_stack(const StackState& current,
+                                       LazyStackRestore::ThreadRecord& record) G_NOEXCEPT;
+        // Adds the number of bytes copied to *nbytes*.
+        inline int copy_stack_to_heap(char* const stackref, const StackState& current,
+                                      size_t& nbytes) G_NOEXCEPT;
         inline bool started() const G_NOEXCEPT;
         inline bool main() const G_NOEXCEPT;
         inline bool active() const G_NOEXCEPT;
         inline void set_active() G_NOEXCEPT;
         inline void set_inactive() G_NOEXCEPT;
+        // Take us out of the chain of stacks that *current* (the
+        // running greenlet of our thread) would save through.
+        inline void unlink_from(StackState& current) G_NOEXCEPT;
         inline intptr_t stack_saved() const G_NOEXCEPT;
         inline char* stack_start() const G_NOEXCEPT;
+        // Account for our copy in *new_stats* from now on.
+        inline void account_to(MemoryStats* new_stats) G_NOEXCEPT;
         static inline StackState make_main() G_NOEXCEPT;
         friend std::ostream& operator<<(std::ostream& os, const StackState& s);
     };
@@ -335,6 +361,14 @@ namespace greenlet
         }
 
         virtual OwnedObject throw_GreenletExit_during_dealloc(const ThreadState& current_thread_state);
+        /**
+         * Switch to this greenlet, and return what we're switched back
+         * with. If an exception is thrown into us instead, it's left
+         * set and the result is null; that's how greenlets are killed,
+         * and a C++ exception for it costs several times as much as
+         * the switch. Errors before we get to switch are thrown as
+         * PyErrOccurred.
+         */
         virtual OwnedObject g_switch() = 0;
         /**
          * Force the greenlet to appear dead. Used when it's not
@@ -521,17 +555,38 @@ namespace greenlet
 
     class UserGreenlet : public Greenlet
     {
+    public:
+        // The same as ``PyGreenlet_NativeFunc`` in greenlet.h.
+        typedef PyObject* (*native_run_t)(void* arg, PyObject* first_value);
     private:
         static greenlet::PythonAllocator<UserGreenlet> allocator;
         BorrowedGreenlet _self;
         OwnedMainGreenlet _main_greenlet;
         OwnedObject _run_callable;
+        // From PyGreenlet_NewNative(): a C function to call instead of
+        // ``run``, and the argument to pass it. Cleared if ``run`` is
+        // set.
+        native_run_t _native_run;
+        void* _native_arg;
         OwnedGreenlet _parent;
+        // While we're started and not dead, the thread we're listed
+        // in, and our neighbors in that list. See
+        // ThreadState::register_greenlet().
+        ThreadState* _registered_in;
+        UserGreenlet* _registry_prev;
+        UserGreenlet* _registry_next;
+        friend class ThreadState;
     public:
         static void* operator new(size_t UNUSED(count));
         static void operator delete(void* ptr);
 
         UserGreenlet(PyGreenlet* p, BorrowedGreenlet the_parent);
+
+        // The next greenlet in the list of our thread's greenlets.
+        inline UserGreenlet* next_registered() const G_NOEXCEPT
+        {
+            return this->_registry_next;
+        }
         virtual ~UserGreenlet();
 
         virtual refs::BorrowedMainGreenlet find_main_greenlet_in_lineage() const;
@@ -546,6 +601,14 @@ namespace greenlet
             return this->_run_callable;
         }
         virtual void run(const refs::BorrowedObject nrun);
+        // Run *fn* instead of ``run``. Only before we start.
+        inline void native_run(native_run_t fn, void* arg) G_NOEXCEPT
+        {
+            assert(!this->started());
+            this->_run_callable.CLEAR();
+            this->_native_run = fn;
+            this->_native_arg = arg;
+        }
 
         virtual const OwnedGreenlet parent() const;
         virtual void parent(const refs::BorrowedObject new_parent);
@@ -838,6 +901,50 @@ int PythonState::tp_traverse(visitproc visit, void* arg, bool own_top_frame) G_N
     return 0;
 }
 
+#if G_USE_SUSPENDED_GC
+/**
+ * Visit what the frames of a suspended greenlet refer to.
+ *
+ * While a frame is executing, the interpreter doesn't track it with
+ * the garbage collector (it starts tracking it once it's done, if
+ * it's still referenced), so nothing else visits its contents. The
+ * references that keep it alive are normally just the one the
+ * interpreter's caller holds (on our saved C stack; for the top
+ * frame, that's the one ``_top_frame`` stands for) and the ``f_back``
+ * of the frame it called. But anyone can take another with
+ * ``sys._getframe()``, and the collector can't see that; then its
+ * locals, and everything below it through ``f_back``, are reachable
+ * from outside, and visiting them would let the collector think
+ * they're ours to free. So we stop at the first frame with more
+ * references than that, and at the first tracked frame (a
+ * generator's, say), whose owner can hand out its ``f_back`` too.
+ *
+ * The value stacks of executing frames aren't visited (the
+ * interpreter keeps the stack pointer in a local variable); missing
+ * references only means missing a cycle, never freeing something
+ * that's alive.
+ */
+int PythonState::traverse_suspended_frames(visitproc visit, void* arg) const G_NOEXCEPT
+{
+    // The top frame has only the caller's reference; the rest also
+    // have the f_back of the frame above.
+    Py_ssize_t expected_refs = 1;
+    for (PyFrameObject* frame = this->_top_frame.borrow();
+         frame;
+         frame = frame->f_back, expected_refs = 2) {
+        PyObject* const obj = reinterpret_cast<PyObject*>(frame);
+        if (PyObject_GC_IsTracked(obj) || Py_REFCNT(obj) != expected_refs) {
+            break;
+        }
+        const int result = Py_TYPE(obj)->tp_traverse(obj, visit, arg);
+        if (result) {
+            return result;
+        }
+    }
+    return 0;
+}
+#endif
+
 void PythonState::tp_clear(bool own_top_frame) G_NOEXCEPT
 {
     PythonStateContext::tp_clear();
@@ -895,7 +1002,9 @@ StackState::StackState(void* mark, StackState& current)
       /* Skip a dying greenlet */
       stack_prev(current._stack_start
                  ? &current
-                 : current.stack_prev)
+                 : current.stack_prev),
+      stack_copy_mapped(false),
+      stats(current.stats)
 {
 }
 
@@ -904,7 +1013,9 @@ StackState::StackState()
       stack_stop(nullptr),
       stack_copy(nullptr),
       _stack_saved(0),
-      stack_prev(nullptr)
+      stack_prev(nullptr),
+      stack_copy_mapped(false),
+      stats(nullptr)
 {
 }
 
@@ -915,7 +1026,9 @@ StackState::StackState(const StackState& other)
       stack_stop(nullptr),
       stack_copy(nullptr),
       _stack_saved(0),
-      stack_prev(nullptr)
+      stack_prev(nullptr),
+      stack_copy_mapped(false),
+      stats(nullptr)
 {
     this->operator=(other);
 }
@@ -937,17 +1050,24 @@ StackState& StackState::operator=(const StackState& other)
     this->stack_copy = other.stack_copy;
     this->_stack_saved = other._stack_saved;
     this->stack_prev = other.stack_prev;
+    this->stack_copy_mapped = other.stack_copy_mapped;
+    this->stats = other.stats;
     return *this;
 }
 
 inline void StackState::free_stack_copy() G_NOEXCEPT
 {
-    PyMem_Free(this->stack_copy);
+    if (this->stats) {
+        this->stats->resized(this->_stack_saved, 0);
+    }
+    StackCopier::release(this->stack_copy, this->_stack_saved, this->stack_copy_mapped);
     this->stack_copy = nullptr;
+    this->stack_copy_mapped = false;
     this->_stack_saved = 0;
 }
 
-inline void StackState::copy_heap_to_stack(const StackState& current) G_NOEXCEPT
+inline void StackState::copy_heap_to_stack(const StackState& current,
+                                           LazyStackRestore::ThreadRecord& record) G_NOEXCEPT
 {
     // cerr << "copy_heap_to_stack" << endl
     //      << "\tFrom    : " << *this << endl
@@ -955,8 +1075,20 @@ inline void StackState::copy_heap_to_stack(const StackState& current) G_NOEXCEPT
     //      << endl;
     /* Restore the heap copy back into the C stack */
     if (this->_stack_saved != 0) {
-        memcpy(this->_stack_start, this->stack_copy, this->_stack_saved);
-        this->free_stack_copy();
+        if (LazyStackRestore::restore(this->_stack_start, this->stack_copy, this->_stack_saved,
+                                      this->stack_copy_mapped, record)) {
+            // It owns the copy now.
+            if (this->stats) {
+                this->stats->resized(this->_stack_saved, 0);
+            }
+            this->stack_copy = nullptr;
+            this->_stack_saved = 0;
+            this->stack_copy_mapped = false;
+        }
+        else {
+            StackCopier::restore(this->_stack_start, this->stack_copy, this->_stack_saved);
+            this->free_stack_copy();
+        }
     }
     StackState* owner = const_cast<StackState*>(&current);
     if (!owner->_stack_start) {
@@ -970,7 +1102,9 @@ inline void StackState::copy_heap_to_stack(const StackState& current) G_NOEXCEPT
     // cerr << "\tFinished with: " << *this << endl;
 }
 
-inline int StackState::copy_stack_to_heap_up_to(const char* const stop) G_NOEXCEPT
+inline int StackState::copy_stack_to_heap_up_to(const char* const stop,
+                                                const char* const overwritten_below,
+                                                size_t& nbytes) G_NOEXCEPT
 {
     /* Save more of g's stack into the heap -- at least up to 'stop'
        g->stack_stop |________|
@@ -986,20 +1120,29 @@ inline int StackState::copy_stack_to_heap_up_to(const char* const stop) G_NOEXCE
     intptr_t sz2 = stop - this->_stack_start;
     assert(this->_stack_start);
     if (sz2 > sz1) {
-        char* c = (char*)PyMem_Realloc(this->stack_copy, sz2);
+        char* c = StackCopier::resize(this->stack_copy, sz1, sz2, this->_stack_start,
+                                      this->stack_copy_mapped);
         if (!c) {
             PyErr_NoMemory();
             return -1;
         }
-        memcpy(c + sz1, this->_stack_start + sz1, sz2 - sz1);
+        if (!LazyStackRestore::save(c + sz1, this->_stack_start + sz1, sz2 - sz1)) {
+            StackCopier::save(c + sz1, this->_stack_start + sz1, sz2 - sz1,
+                              this->stack_copy_mapped, overwritten_below);
+        }
         this->stack_copy = c;
         this->_stack_saved = sz2;
+        if (this->stats) {
+            this->stats->resized(sz1, sz2);
+        }
+        nbytes += sz2 - sz1;
     }
     return 0;
 }
 
 inline int StackState::copy_stack_to_heap(char* const stackref,
-                                          const StackState& current) G_NOEXCEPT
+                                          const StackState& current,
+                                          size_t& nbytes) G_NOEXCEPT
 {
     // cerr << "copy_stack_to_heap: " << endl
     //      << "\tstackref: " << (void*)stackref << endl
@@ -1008,6 +1151,16 @@ inline int StackState::copy_stack_to_heap(char* const stackref,
     //      << endl;
     /* must free all the C stack up to target_stop */
     const char* const target_stop = this->stack_stop;
+    /* Of that, the part that restoring our copy (if we have one)
+       will overwrite. The rest is either used in place (if we haven't
+       started) or still holds the part of our stack we didn't save. */
+    const char* overwritten_below = nullptr;
+    if (this->_stack_start) {
+        overwritten_below = this->_stack_start + this->_stack_saved;
+        if (overwritten_below > target_stop) {
+            overwritten_below = target_stop;
+        }
+    }
 
     StackState* owner = const_cast<StackState*>(&current);
     assert(owner->_stack_saved == 0); // everything is present on the stack
@@ -1022,13 +1175,13 @@ inline int StackState::copy_stack_to_heap(char* const stackref,
     while (owner->stack_stop < target_stop) {
         // cerr << "\tCopying from " << *owner << endl;
         /* ts_current is entierely within the area to free */
-        if (owner->copy_stack_to_heap_up_to(owner->stack_stop)) {
+        if (owner->copy_stack_to_heap_up_to(owner->stack_stop, overwritten_below, nbytes)) {
             return -1; /* XXX */
         }
         owner = owner->stack_prev;
     }
     if (owner != this) {
-        if (owner->copy_stack_to_heap_up_to(target_stop)) {
+        if (owner->copy_stack_to_heap_up_to(target_stop, overwritten_below, nbytes)) {
             return -1; /* XXX */
         }
     }
@@ -1074,6 +1227,22 @@ inline void StackState::set_inactive() G_NOEXCEPT
     }
 }
 
+inline void StackState::unlink_from(StackState& current) G_NOEXCEPT
+{
+    // Greenlets that were started on top of our stack, or restored
+    // while it was there, point at us through stack_prev. A switch
+    // takes a dying greenlet out of that chain as it restores the
+    // next one, but when we're thrown away without switching, the
+    // running greenlet would still save (and later read) through
+    // us. The chains of suspended greenlets don't matter: they're
+    // worked out again when they're restored.
+    for (StackState* s = &current; s; s = s->stack_prev) {
+        if (s->stack_prev == this) {
+            s->stack_prev = this->stack_prev;
+        }
+    }
+}
+
 inline intptr_t StackState::stack_saved() const G_NOEXCEPT
 {
     return this->_stack_saved;
@@ -1085,6 +1254,17 @@ inline char* StackState::stack_start() const G_NOEXCEPT
 }
 
 
+inline void StackState::account_to(MemoryStats* new_stats) G_NOEXCEPT
+{
+    if (this->stats) {
+        this->stats->resized(this->_stack_saved, 0);
+    }
+    this->stats = new_stats;
+    if (new_stats) {
+        new_stats->resized(0, this->_stack_saved);
+    }
+}
+
 inline StackState StackState::make_main() G_NOEXCEPT
 {
     StackState s;
@@ -0,0 +1,170 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+#ifndef GREENLET_LATENCY_HISTOGRAM_HPP
+#define GREENLET_LATENCY_HISTOGRAM_HPP
+/**
+ * A histogram of how long switches take.
+ *
+ * Averages hide the occasional switch that has to copy a huge stack,
+ * so, while enabled, each ThreadState counts the duration of each of
+ * its switches (from starting to save the origin to finishing
+ * restoring the target) in a log-linear histogram, in the manner of
+ * HdrHistogram: each power of two is split into ``sub_buckets``
+ * linear buckets, so any recorded value is known to within
+ * 1/``sub_buckets`` (6.25%), from 1ns up to about a minute, in a
+ * fixed 4KB of counters. Recording is a few shifts and an increment.
+ *
+ * Like the switch log, each histogram is only written and read by
+ * its own thread while holding the GIL.
+ */
+
+#include <cstring>
+#include <Python.h>
+
+#include "greenlet_compiler_compat.hpp"
+
+namespace greenlet {
+
+class LatencyHistogram
+{
+public:
+    static const unsigned sub_bucket_bits = 4;
+    static const uint64_t sub_buckets = 1 << sub_bucket_bits;
+    // Values are clamped to less than 2**max_bits ns (about 68s).
+    static const unsigned max_bits = 36;
+    static const size_t bucket_count = (max_bits - sub_bucket_bits + 1) * sub_buckets;
+
+    // Whether switches are being timed. This is process-wide.
+    static bool enabled;
+
+private:
+    uint64_t counts[bucket_count];
+    uint64_t _total_count;
+    uint64_t _total;
+    uint64_t _min;
+    uint64_t _max;
+
+    G_NO_COPIES_OF_CLS(LatencyHistogram);
+
+    static inline unsigned msb(const uint64_t value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(value);
+#else
+        unsigned result = 0;
+        for (uint64_t v = value; v >>= 1;) {
+            result++;
+        }
+        return result;
+#endif
+    }
+
+public:
+    LatencyHistogram()
+    {
+        this->reset();
+    }
+
+    static inline size_t index_of(uint64_t value)
+    {
+        if (value < sub_buckets) {
+            return static_cast<size_t>(value);
+        }
+        if (value >> max_bits) {
+            value = (uint64_t(1) << max_bits) - 1;
+        }
+        const unsigned shift = msb(value) - sub_bucket_bits;
+        return ((shift + 1) << sub_bucket_bits) + ((value >> shift) - sub_buckets);
+    }
+
+    /**
+     * The largest value counted in bucket *index*.
+     */
+    static inline uint64_t highest_value_at(const size_t index)
+    {
+        if (index < sub_buckets) {
+            return index;
+        }
+        const unsigned shift = static_cast<unsigned>(index >> sub_bucket_bits) - 1;
+        const uint64_t lowest = (sub_buckets + (index & (sub_buckets - 1))) << shift;
+        return lowest + (uint64_t(1) << shift) - 1;
+    }
+
+    inline void record(const uint64_t value) G_NOEXCEPT
+    {
+        this->counts[LatencyHistogram::index_of(value)]++;
+        this->_total_count++;
+        this->_total += value;
+        if (value < this->_min) {
+            this->_min = value;
+        }
+        if (value > this->_max) {
+            this->_max = value;
+        }
+    }
+
+    void reset()
+    {
+        memset(this->counts, 0, sizeof(this->counts));
+        this->_total_count = this->_total = this->_max = 0;
+        this->_min = UINT64_MAX;
+    }
+
+    inline uint64_t total_count() const
+    {
+        return this->_total_count;
+    }
+
+    inline uint64_t count_at(const size_t index) const
+    {
+        return this->counts[index];
+    }
+
+    inline uint64_t min_value() const
+    {
+        return this->_total_count ? this->_min : 0;
+    }
+
+    inline uint64_t max_value() const
+    {
+        return this->_max;
+    }
+
+    inline double mean() const
+    {
+        return this->_total_count
+            ? static_cast<double>(this->_total) / this->_total_count
+            : 0.0;
+    }
+
+    /**
+     * The value that *percentile* (0 to 100) percent of the recorded
+     * values are less than or equal to, to within the precision of
+     * the histogram, and never more than the largest recorded value.
+     */
+    uint64_t value_at_percentile(const double percentile) const
+    {
+        if (!this->_total_count) {
+            return 0;
+        }
+        double wanted = percentile / 100.0 * this->_total_count;
+        uint64_t rank = static_cast<uint64_t>(wanted);
+        if (rank < wanted || rank == 0) {
+            rank++;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; i++) {
+            seen += this->counts[i];
+            if (seen >= rank) {
+                const uint64_t value = LatencyHistogram::highest_value_at(i);
+                return value < this->_max ? value : this->_max;
+            }
+        }
+        return this->_max;
+    }
+};
+
+bool LatencyHistogram::enabled = false;
+
+}; // namespace greenlet
+
+#endif
@@ -0,0 +1,641 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+#ifndef GREENLET_LAZY_RESTORE_HPP
+#define GREENLET_LAZY_RESTORE_HPP
+/**
+ * Restoring deep stacks on demand.
+ *
+ * When a greenlet is switched to, all of its saved stack is copied
+ * back onto the C stack, even though the greenlet often only uses its
+ * top few frames before switching away again. On Linux, restoring a
+ * stack of at least ``threshold()`` bytes can instead copy only its
+ * first couple of pages (the part of the stack the greenlet resumes
+ * in) and leave the rest of the pages missing. The missing pages are
+ * registered with a userfaultfd, and a helper thread fills each one in
+ * from the saved copy when (and if) it is first touched.
+ *
+ * Correctness hinges on one invariant: every page that we make
+ * missing belongs to exactly one ``Region``, the one that knows what
+ * should be in it, until the page is filled. When a later restore
+ * covers a page (lazily or not), the older region gives it up.
+ *
+ * The helper thread takes ``lock`` to find and fill pages, so no
+ * thread may touch a missing page while holding it; we pre-fault some
+ * stack before taking it so that our own frames can't be missing.
+ * The helper thread never needs the GIL; the heap copies, which
+ * may belong to Python's allocator, are only freed by threads holding
+ * it.
+ *
+ * Define ``G_USE_LAZY_STACK_RESTORE`` to 0 to compile this out.
+ */
+
+#include <cstddef>
+#include <cerrno>
+#include <Python.h>
+
+#include "greenlet_compiler_compat.hpp"
+#include "greenlet_stack_copy.hpp"
+
+#ifndef G_USE_LAZY_STACK_RESTORE
+#    if defined(__linux__) && defined(__has_include)
+#        if __has_include(<linux/userfaultfd.h>)
+#            define G_USE_LAZY_STACK_RESTORE 1
+#        endif
+#    endif
+#endif
+#ifndef G_USE_LAZY_STACK_RESTORE
+#    define G_USE_LAZY_STACK_RESTORE 0
+#endif
+
+#if G_USE_LAZY_STACK_RESTORE
+#    include <vector>
+#    include <new>
+#    include <atomic>
+#    include <csignal>
+#    include <pthread.h>
+#    include <unistd.h>
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/ioctl.h>
+#    include <sys/syscall.h>
+#    include <linux/userfaultfd.h>
+#endif
+
+namespace greenlet {
+
+class LazyStackRestore
+{
+public:
+    /**
+     * What happened the last time a stack was restored in a thread.
+     * Each ThreadState has one of these.
+     */
+    struct ThreadRecord
+    {
+        // Copied when the greenlet was switched to.
+        size_t eager_bytes;
+        // Left for the helper thread.
+        size_t deferred_bytes;
+#if G_USE_LAZY_STACK_RESTORE
+        // Filled in by the helper thread since then.
+        std::atomic<size_t> faulted_bytes;
+#endif
+        ThreadRecord() : eager_bytes(0), deferred_bytes(0)
+#if G_USE_LAZY_STACK_RESTORE
+                       , faulted_bytes(0)
+#endif
+        {}
+        // Forgets everything restored in the thread.
+        inline ~ThreadRecord();
+        G_NO_COPIES_OF_CLS(ThreadRecord);
+    };
+
+#if G_USE_LAZY_STACK_RESTORE
+private:
+    struct Region
+    {
+        // The page-aligned addresses of the missing pages.
+        uintptr_t lo;
+        uintptr_t hi;
+        // What belongs at ``lo``.
+        const char* source;
+        // The whole heap copy that ``source`` points into; ours to free.
+        char* buffer;
+        size_t buffer_size;
+        bool buffer_mapped;
+        ThreadRecord* owner;
+        std::vector<bool> pending;
+        size_t npending;
+    };
+    typedef std::vector<Region*> regions_t;
+
+    static size_t _threshold;
+    static int uffd;
+    static uintptr_t page_size;
+    static pthread_mutex_t lock;
+    static regions_t* regions;
+    static std::atomic<size_t> total_deferred_bytes;
+    static std::atomic<size_t> total_faulted_bytes;
+
+    // How many pages past the one the greenlet resumes in to copy
+    // eagerly.
+    static const uintptr_t eager_pages = 1;
+
+    class Lock
+    {
+        G_NO_COPIES_OF_CLS(Lock);
+    public:
+        Lock()
+        {
+            LazyStackRestore::prefault_stack();
+            pthread_mutex_lock(&LazyStackRestore::lock);
+        }
+        ~Lock()
+        {
+            pthread_mutex_unlock(&LazyStackRestore::lock);
+        }
+    };
+
+    static void GREENLET_NOINLINE(prefault_stack)()
+    {
+        // Anything we call while holding the lock has to fit in here.
+        volatile char buf[4 * 4096];
+        for (size_t i = 0; i < sizeof(buf); i += 1024) {
+            buf[i] = 0;
+        }
+    }
+
+    // Call with the lock held. EEXIST means somebody filled the page
+    // before we got to it; the faulting thread still needs waking.
+    static void fill(const uintptr_t page, const char* const source)
+    {
+        struct uffdio_copy copy;
+        copy.dst = page;
+        copy.src = reinterpret_cast<uintptr_t>(source);
+        copy.len = page_size;
+        copy.mode = 0;
+        copy.copy = 0;
+        if (ioctl(uffd, UFFDIO_COPY, &copy) == -1 && errno == EEXIST) {
+            struct uffdio_range range = {page, page_size};
+            ioctl(uffd, UFFDIO_WAKE, &range);
+        }
+    }
+
+    static void zero_fill(const uintptr_t page)
+    {
+        struct uffdio_zeropage zero;
+        zero.range.start = page;
+        zero.range.len = page_size;
+        zero.mode = 0;
+        zero.zeropage = 0;
+        if (ioctl(uffd, UFFDIO_ZEROPAGE, &zero) == -1 && errno == EEXIST) {
+            ioctl(uffd, UFFDIO_WAKE, &zero.range);
+        }
+    }
+
+    // Call with the lock held.
+    static void fill_pending_page(Region* const r, const uintptr_t page)
+    {
+        const size_t index = (page - r->lo) / page_size;
+        LazyStackRestore::fill(page, r->source + (page - r->lo));
+        r->pending[index] = false;
+        r->npending--;
+        if (r->owner) {
+            r->owner->faulted_bytes += page_size;
+        }
+        total_faulted_bytes += page_size;
+    }
+
+    static Region* find_pending(const uintptr_t page)
+    {
+        for (regions_t::iterator it = regions->begin(); it != regions->end(); ++it) {
+            Region* r = *it;
+            if (r->lo <= page && page < r->hi && r->pending[(page - r->lo) / page_size]) {
+                return r;
+            }
+        }
+        return nullptr;
+    }
+
+    static void* serve_faults(void* UNUSED(arg))
+    {
+        for (;;) {
+            struct uffd_msg msg;
+            const ssize_t n = read(uffd, &msg, sizeof(msg));
+            if (n != sizeof(msg)) {
+                if (n == -1 && errno == EBADF) {
+                    return nullptr;
+                }
+                continue;
+            }
+            if (msg.event != UFFD_EVENT_PAGEFAULT) {
+                continue;
+            }
+            const uintptr_t page = msg.arg.pagefault.address & ~(page_size - 1);
+            pthread_mutex_lock(&lock);
+            Region* r = find_pending(page);
+            if (r) {
+                fill_pending_page(r, page);
+            }
+            else {
+                // The thread this belonged to is gone.
+                zero_fill(page);
+            }
+            pthread_mutex_unlock(&lock);
+        }
+    }
+
+    // Call with the lock held and the GIL held.
+    static void remove_regions(bool (*const pred)(const Region*, const void*), const void* arg)
+    {
+        regions_t::iterator out = regions->begin();
+        for (regions_t::iterator it = regions->begin(); it != regions->end(); ++it) {
+            Region* r = *it;
+            if (pred(r, arg)) {
+                StackCopier::release(r->buffer, r->buffer_size, r->buffer_mapped);
+                delete r;
+            }
+            else {
+                *out++ = r;
+            }
+        }
+        regions->erase(out, regions->end());
+    }
+
+    static bool is_finished(const Region* r, const void* UNUSED(arg))
+    {
+        return r->npending == 0;
+    }
+
+    static bool is_owned_by(const Region* r, const void* owner)
+    {
+        return r->owner == owner;
+    }
+
+    // Before forking, fill everything in: the child won't have
+    // the registrations or the helper thread.
+    static void before_fork()
+    {
+        prefault_stack();
+        pthread_mutex_lock(&lock);
+        if (!regions) {
+            return;
+        }
+        for (regions_t::iterator it = regions->begin(); it != regions->end(); ++it) {
+            Region* r = *it;
+            for (uintptr_t page = r->lo; r->npending && page < r->hi; page += page_size) {
+                if (r->pending[(page - r->lo) / page_size]) {
+                    fill_pending_page(r, page);
+                }
+            }
+        }
+    }
+
+    static void after_fork_parent()
+    {
+        pthread_mutex_unlock(&lock);
+    }
+
+    static void after_fork_child()
+    {
+        // Everything was filled in, but the regions still own their
+        // buffers. We don't have the GIL to free them, so let them
+        // go.
+        if (regions) {
+            for (regions_t::iterator it = regions->begin(); it != regions->end(); ++it) {
+                delete *it;
+            }
+            regions->clear();
+        }
+        if (uffd != -1) {
+            close(uffd);
+            uffd = -1;
+        }
+        _threshold = 0;
+        pthread_mutex_unlock(&lock);
+    }
+
+    // Call with the lock held.
+    static int start()
+    {
+        if (uffd != -1) {
+            return 0;
+        }
+        page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        const int fd = static_cast<int>(syscall(SYS_userfaultfd, O_CLOEXEC));
+        if (fd == -1) {
+            return errno;
+        }
+        struct uffdio_api api;
+        api.api = UFFD_API;
+        api.features = 0;
+        api.ioctls = 0;
+        if (ioctl(fd, UFFDIO_API, &api) == -1) {
+            const int err = errno;
+            close(fd);
+            return err;
+        }
+        uffd = fd;
+
+        // The helper thread mustn't run any signal handlers.
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        pthread_t thread;
+        const int err = pthread_create(&thread, nullptr, serve_faults, nullptr);
+        pthread_sigmask(SIG_SETMASK, &old, nullptr);
+        if (err) {
+            close(fd);
+            uffd = -1;
+            return err;
+        }
+        pthread_detach(thread);
+
+        if (!regions) {
+            regions = new regions_t();
+            pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+        }
+        return 0;
+    }
+
+    static inline bool in_use()
+    {
+        // Only changed by threads holding the GIL, like our callers.
+        return regions && !regions->empty();
+    }
+
+    // Call with the lock held. Fill in every missing page that
+    // overlaps [start, end), which is about to be overwritten with
+    // what's at *heap*, so that doing that won't fault. Pages we
+    // only partly overwrite still need their old contents.
+    static void claim(const uintptr_t start, const uintptr_t end, const char* const heap)
+    {
+        for (regions_t::iterator it = regions->begin(); it != regions->end(); ++it) {
+            Region* r = *it;
+            if (!r->npending || r->hi <= start || r->lo >= end) {
+                continue;
+            }
+            for (uintptr_t page = r->lo; page < r->hi; page += page_size) {
+                const size_t index = (page - r->lo) / page_size;
+                if (!r->pending[index] || page + page_size <= start || page >= end) {
+                    continue;
+                }
+                if (page >= start && page + page_size <= end) {
+                    fill(page, heap + (page - start));
+                }
+                else {
+                    fill(page, r->source + (page - r->lo));
+                }
+                r->pending[index] = false;
+                r->npending--;
+            }
+        }
+    }
+
+    // Call with the lock held. Give up any claim older regions
+    // have on the pages [lo, hi), because they're going to a new one.
+    static void supersede(const uintptr_t lo, const uintptr_t hi)
+    {
+        for (regions_t::iterator it = regions->begin(); it != regions->end(); ++it) {
+            Region* old = *it;
+            if (old->hi <= lo || old->lo >= hi) {
+                continue;
+            }
+            const uintptr_t begin = old->lo > lo ? old->lo : lo;
+            const uintptr_t stop = old->hi < hi ? old->hi : hi;
+            for (uintptr_t page = begin; page < stop; page += page_size) {
+                const size_t index = (page - old->lo) / page_size;
+                if (old->pending[index]) {
+                    old->pending[index] = false;
+                    old->npending--;
+                }
+            }
+        }
+    }
+
+    static bool restore_lazily(char* const stack, char* const heap, const size_t n,
+                               const bool mapped, ThreadRecord& record) G_NOEXCEPT
+    {
+        const uintptr_t start = reinterpret_cast<uintptr_t>(stack);
+        const uintptr_t end = start + n;
+        const uintptr_t lo = ((start + page_size - 1) & ~(page_size - 1)) + eager_pages * page_size;
+        const uintptr_t hi = end & ~(page_size - 1);
+        if (hi <= lo) {
+            if (in_use()) {
+                Lock lock;
+                claim(start, end, heap);
+            }
+            return false;
+        }
+
+        Region* r = nullptr;
+        try {
+            r = new Region();
+            r->pending.assign((hi - lo) / page_size, true);
+        }
+        catch (const std::bad_alloc&) {
+            delete r;
+            return false;
+        }
+        r->lo = lo;
+        r->hi = hi;
+        r->source = heap + (lo - start);
+        r->buffer = heap;
+        r->buffer_size = n;
+        r->buffer_mapped = mapped;
+        r->owner = &record;
+        r->npending = r->pending.size();
+
+        bool registered = false;
+        {
+            Lock lock;
+            claim(start, lo, heap);
+            claim(hi, end, heap + (hi - start));
+            if (uffd != -1 && madvise(reinterpret_cast<void*>(lo), hi - lo, MADV_DONTNEED) == 0) {
+                struct uffdio_register reg;
+                reg.range.start = lo;
+                reg.range.len = hi - lo;
+                reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+                reg.ioctls = 0;
+                registered = ioctl(uffd, UFFDIO_REGISTER, &reg) == 0;
+            }
+            // Whatever happens, these pages now belong to this
+            // greenlet, not whatever region had them before.
+            supersede(lo, hi);
+            remove_regions(is_finished, nullptr);
+            if (registered) {
+                try {
+                    regions->push_back(r);
+                }
+                catch (const std::bad_alloc&) {
+                    // Nobody can fill these pages now but us.
+                    for (uintptr_t page = lo; page < hi; page += page_size) {
+                        fill(page, r->source + (page - lo));
+                    }
+                    registered = false;
+                }
+            }
+        }
+        // The edges of the region go back right away. The pages
+        // they're on were claimed above, so this won't fault.
+        StackCopier::restore(stack, heap, lo - start);
+        StackCopier::restore(reinterpret_cast<char*>(hi), heap + (hi - start), end - hi);
+        if (!registered) {
+            // Any pages we did make missing will be zero filled
+            // and then overwritten.
+            StackCopier::restore(reinterpret_cast<char*>(lo), r->source, hi - lo);
+            delete r;
+            return false;
+        }
+#if G_USE_MMAP_STACK_COPY
+        if (mapped) {
+            // It's being read from again.
+            StackCopier::touch(heap);
+        }
+#endif
+        record.eager_bytes = n - (hi - lo);
+        record.deferred_bytes = hi - lo;
+        total_deferred_bytes += hi - lo;
+        return true;
+    }
+
+public:
+    /**
+     * Restore the stack bytes [stack, stack + n) from the heap copy
+     * at *heap*.
+     *
+     * If this returns true, only part of the stack was copied, and the
+     * rest will be filled in on demand; the heap copy now belongs to
+     * us. Otherwise, the caller needs to copy it all.
+     */
+    static inline bool restore(char* const stack, char* const heap, const size_t n,
+                               const bool mapped, ThreadRecord& record) G_NOEXCEPT
+    {
+        record.eager_bytes = n;
+        record.deferred_bytes = 0;
+        record.faulted_bytes = 0;
+        if (!_threshold || n < _threshold) {
+            if (in_use()) {
+                const uintptr_t start = reinterpret_cast<uintptr_t>(stack);
+                Lock lock;
+                claim(start, start + n, heap);
+            }
+            return false;
+        }
+        return LazyStackRestore::restore_lazily(stack, heap, n, mapped, record);
+    }
+
+    /**
+     * Copy the stack bytes [stack, stack + n) to the heap at *heap*.
+     *
+     * Pages of that stack that haven't been restored yet are copied
+     * from where they're waiting, instead of being faulted in. If
+     * there are none, this returns false, and the caller needs to do
+     * the copy.
+     */
+    static inline bool save(char* const heap, const char* const stack, const size_t n) G_NOEXCEPT
+    {
+        if (!in_use()) {
+            return false;
+        }
+        const uintptr_t start = reinterpret_cast<uintptr_t>(stack);
+        const uintptr_t end = start + n;
+        Lock lock;
+        for (uintptr_t here = start; here < end; ) {
+            const uintptr_t page = here & ~(page_size - 1);
+            const uintptr_t next = page + page_size < end ? page + page_size : end;
+            const Region* r = find_pending(page);
+            const char* src = r
+                ? r->source + (here - r->lo)
+                : reinterpret_cast<const char*>(here);
+            memcpy(heap + (here - start), src, next - here);
+            here = next;
+        }
+        return true;
+    }
+
+    /**
+     * Stop tracking the pages restored in a thread that's gone. If
+     * they're ever touched, they'll be zero filled.
+     */
+    static void forget(ThreadRecord& record)
+    {
+        if (!regions) {
+            return;
+        }
+        Lock lock;
+        remove_regions(is_owned_by, &record);
+    }
+
+    /**
+     * Restore stacks of at least *nbytes* lazily; 0 turns that off.
+     * Returns 0 or an errno value.
+     */
+    static int threshold(size_t nbytes)
+    {
+        Lock lock;
+        if (nbytes) {
+            if (int err = start()) {
+                return err;
+            }
+        }
+        _threshold = nbytes;
+        return 0;
+    }
+
+    static size_t threshold()
+    {
+        return _threshold;
+    }
+
+    static size_t total_deferred()
+    {
+        return total_deferred_bytes;
+    }
+
+    static size_t total_faulted()
+    {
+        return total_faulted_bytes;
+    }
+
+    static const bool available = true;
+#else
+public:
+    static inline bool restore(char* const UNUSED(stack), char* const UNUSED(heap), const size_t n,
+                               const bool UNUSED(mapped), ThreadRecord& record) G_NOEXCEPT
+    {
+        record.eager_bytes = n;
+        return false;
+    }
+
+    static inline bool save(char* const UNUSED(heap), const char* const UNUSED(stack),
+                            const size_t UNUSED(n)) G_NOEXCEPT
+    {
+        return false;
+    }
+
+    static void forget(ThreadRecord& UNUSED(record))
+    {
+    }
+
+    static int threshold(size_t UNUSED(nbytes))
+    {
+        return ENOSYS;
+    }
+
+    static size_t threshold()
+    {
+        return 0;
+    }
+
+    static size_t total_deferred()
+    {
+        return 0;
+    }
+
+    static size_t total_faulted()
+    {
+        return 0;
+    }
+
+    static const bool available = false;
+#endif
+};
+
+LazyStackRestore::ThreadRecord::~ThreadRecord()
+{
+    LazyStackRestore::forget(*this);
+}
+
+#if G_USE_LAZY_STACK_RESTORE
+size_t LazyStackRestore::_threshold = 0;
+int LazyStackRestore::uffd = -1;
+uintptr_t LazyStackRestore::page_size = 4096;
+pthread_mutex_t LazyStackRestore::lock = PTHREAD_MUTEX_INITIALIZER;
+LazyStackRestore::regions_t* LazyStackRestore::regions = nullptr;
+std::atomic<size_t> LazyStackRestore::total_deferred_bytes(0);
+std::atomic<size_t> LazyStackRestore::total_faulted_bytes(0);
+#endif
+
+}; // namespace greenlet
+
+#endif
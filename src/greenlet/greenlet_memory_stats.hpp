@@ -0,0 +1,97 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+#ifndef GREENLET_MEMORY_STATS_HPP
+#define GREENLET_MEMORY_STATS_HPP
+/**
+ * Accounting for the memory held by saved stacks.
+ *
+ * Each ThreadState has a MemoryStats, and each StackState that has
+ * started points to the one for its thread. The StackState updates
+ * it whenever the size of its saved copy changes, so the totals are
+ * always current without scanning anything. To find the largest
+ * saved stack without keeping them sorted, we also keep a count of
+ * the saved stacks in each bucket of a log-linear histogram of sizes
+ * (the same buckets as LatencyHistogram), which makes the largest
+ * known to within 6.25%.
+ *
+ * When a thread exits, the stacks still saved by its greenlets are
+ * moved to ``MemoryStats::orphaned``.
+ *
+ * Protected by the GIL.
+ */
+
+#include <cstring>
+
+#include "greenlet_compiler_compat.hpp"
+#include "greenlet_latency_histogram.hpp"
+
+namespace greenlet {
+
+class MemoryStats
+{
+private:
+    size_t _saved_bytes;
+    size_t _saved_stacks;
+    uint32_t by_size[LatencyHistogram::bucket_count];
+
+    G_NO_COPIES_OF_CLS(MemoryStats);
+
+public:
+    // The stacks saved by greenlets whose threads have exited.
+    static MemoryStats orphaned;
+
+    MemoryStats()
+        : _saved_bytes(0),
+          _saved_stacks(0)
+    {
+        memset(this->by_size, 0, sizeof(this->by_size));
+    }
+
+    /**
+     * A saved stack went from *before* to *after* bytes. Either may
+     * be 0.
+     */
+    inline void resized(const size_t before, const size_t after) G_NOEXCEPT
+    {
+        if (before) {
+            this->by_size[LatencyHistogram::index_of(before)]--;
+            this->_saved_stacks--;
+        }
+        if (after) {
+            this->by_size[LatencyHistogram::index_of(after)]++;
+            this->_saved_stacks++;
+        }
+        this->_saved_bytes += after;
+        this->_saved_bytes -= before;
+    }
+
+    inline size_t saved_bytes() const
+    {
+        return this->_saved_bytes;
+    }
+
+    inline size_t saved_stacks() const
+    {
+        return this->_saved_stacks;
+    }
+
+    /**
+     * The size of the largest saved stack, rounded up to the top of
+     * its bucket, but no more than all of them together.
+     */
+    size_t largest_saved() const
+    {
+        for (size_t i = LatencyHistogram::bucket_count; i > 0; i--) {
+            if (this->by_size[i - 1]) {
+                const size_t top = static_cast<size_t>(LatencyHistogram::highest_value_at(i - 1));
+                return top < this->_saved_bytes ? top : this->_saved_bytes;
+            }
+        }
+        return 0;
+    }
+};
+
+MemoryStats MemoryStats::orphaned;
+
+}; // namespace greenlet
+
+#endif
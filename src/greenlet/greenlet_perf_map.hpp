@@ -0,0 +1,208 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+#ifndef GREENLET_PERF_MAP_HPP
+#define GREENLET_PERF_MAP_HPP
+/**
+ * Helping Linux ``perf`` tell greenlets apart.
+ *
+ * Every greenlet in a thread runs on the same C stack, so samples
+ * taken by ``perf record`` don't say which greenlet they belong to.
+ * While the perf map is enabled:
+ *
+ * - Every switch calls ``greenlet_perf_switch(origin, target)``, an
+ *   exported function that does nothing, so that it can be recorded
+ *   alongside the samples, arguments and all, with ``perf probe``.
+ *   Splitting ``perf script`` output at those events attributes each
+ *   sample to the greenlet that was running. (The USDT probes in
+ *   greenlet_probes.hpp do the same, when compiled in.)
+ * - ``greenlet_perf_current``, an exported thread-local variable,
+ *   holds the greenlet running in each thread, for debuggers and
+ *   eBPF programs.
+ * - Each greenlet that starts gets a line in
+ *   ``/tmp/perf-greenlet-<pid>.map``. That's in the format of perf's
+ *   ``/tmp/perf-<pid>.map`` files (``<start> <size> <name>``, in hex),
+ *   with the greenlet's address (its ``id()``, and what the above
+ *   report) as the start, so tools that read those files can name the
+ *   greenlets.
+ *
+ * Greenlets are identified by the address of their ``PyGreenlet``. The
+ * file is only written while holding the GIL. It's created with mode
+ * 0600, and never through a symbolic link; if it already exists, it's
+ * only appended to when it's a regular file of ours with no other
+ * links.
+ *
+ * Define ``G_USE_PERF_MAP`` to 0 to compile this out.
+ */
+
+#include <cstdio>
+#include <cerrno>
+#include <Python.h>
+
+#include "greenlet_compiler_compat.hpp"
+#include "greenlet_thread_support.hpp"
+
+#ifndef G_USE_PERF_MAP
+#    if defined(__linux__) && (defined(__GNUC__) || defined(__clang__))
+#        define G_USE_PERF_MAP 1
+#    else
+#        define G_USE_PERF_MAP 0
+#    endif
+#endif
+
+#if G_USE_PERF_MAP
+#    include <fcntl.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+
+extern "C" {
+// The greenlet running in this thread, while the perf map is enabled.
+__attribute__((visibility("default")))
+G_THREAD_LOCAL_VAR uintptr_t greenlet_perf_current = 0;
+
+// Called after every switch while the perf map is enabled. Attach to
+// it with, for example,
+// ``perf probe -x _greenlet.so greenlet_perf_switch origin=%di target=%si``
+// (on x86-64).
+__attribute__((noinline, used, visibility("default")))
+void greenlet_perf_switch(uintptr_t origin, uintptr_t target)
+{
+    // Keep the call, and its arguments, from being optimized away.
+    __asm__ volatile ("" : : "r" (origin), "r" (target) : "memory");
+}
+}
+#endif
+
+namespace greenlet {
+
+class PerfMap
+{
+private:
+#if G_USE_PERF_MAP
+    static FILE* file;
+    static char _path[64];
+#endif
+
+#if G_USE_PERF_MAP
+    /**
+     * Open *path*, in a directory anyone can write to, for appending,
+     * without following links or writing to anyone else's file.
+     */
+    static FILE* open_map(const char* path)
+    {
+        int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                      S_IRUSR | S_IWUSR);
+        if (fd < 0 && errno == EEXIST) {
+            // Probably ours, from an earlier enable().
+            fd = open(path, O_WRONLY | O_APPEND | O_NOFOLLOW | O_CLOEXEC);
+            struct stat st;
+            if (fd >= 0
+                && (fstat(fd, &st) != 0
+                    || !S_ISREG(st.st_mode)
+                    || st.st_uid != geteuid()
+                    || st.st_nlink != 1)) {
+                close(fd);
+                fd = -1;
+                errno = EEXIST;
+            }
+        }
+        if (fd < 0) {
+            return nullptr;
+        }
+        FILE* result = fdopen(fd, "a");
+        if (!result) {
+            const int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+        }
+        return result;
+    }
+#endif
+
+public:
+    static inline bool enabled()
+    {
+#if G_USE_PERF_MAP
+        return PerfMap::file != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Start writing the map, and return its path. Returns null with
+     * errno set if it can't be opened.
+     */
+    static const char* enable()
+    {
+#if G_USE_PERF_MAP
+        if (!PerfMap::file) {
+            snprintf(PerfMap::_path, sizeof(PerfMap::_path),
+                     "/tmp/perf-greenlet-%ld.map", static_cast<long>(getpid()));
+            PerfMap::file = PerfMap::open_map(PerfMap::_path);
+            if (!PerfMap::file) {
+                return nullptr;
+            }
+        }
+        return PerfMap::_path;
+#else
+        errno = ENOSYS;
+        return nullptr;
+#endif
+    }
+
+    static void disable()
+    {
+#if G_USE_PERF_MAP
+        if (PerfMap::file) {
+            fclose(PerfMap::file);
+            PerfMap::file = nullptr;
+            greenlet_perf_current = 0;
+        }
+#endif
+    }
+
+    /**
+     * Record that *self* is about to call a callable named *name*.
+     */
+    static void started(PyObject* const self, const char* const name)
+    {
+#if G_USE_PERF_MAP
+        if (!PerfMap::file) {
+            return;
+        }
+        fprintf(PerfMap::file, "%lx %lx greenlet:%s\n",
+                static_cast<unsigned long>(reinterpret_cast<uintptr_t>(self)),
+                static_cast<unsigned long>(Py_TYPE(self)->tp_basicsize),
+                name);
+        fflush(PerfMap::file);
+#else
+        (void)self;
+        (void)name;
+#endif
+    }
+
+    /**
+     * Record a switch from *origin* to *target*, which is now running.
+     */
+    static inline void switched(PyObject* const origin, PyObject* const target)
+    {
+#if G_USE_PERF_MAP
+        if (PerfMap::file) {
+            greenlet_perf_current = reinterpret_cast<uintptr_t>(target);
+            greenlet_perf_switch(reinterpret_cast<uintptr_t>(origin),
+                                 reinterpret_cast<uintptr_t>(target));
+        }
+#else
+        (void)origin;
+        (void)target;
+#endif
+    }
+};
+
+#if G_USE_PERF_MAP
+FILE* PerfMap::file = nullptr;
+char PerfMap::_path[64];
+#endif
+
+}; // namespace greenlet
+
+#endif
@@ -0,0 +1,67 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+#ifndef GREENLET_PROBES_HPP
+#define GREENLET_PROBES_HPP
+/**
+ * Static (USDT) probes for tracing with SystemTap, bpftrace, perf and
+ * friends, without loading a Python trace function.
+ *
+ * Each probe is a single ``nop`` instruction plus a note in the
+ * ELF file describing where its arguments are. Until a tracer attaches
+ * (and replaces the ``nop`` with a breakpoint), they cost nothing but
+ * keeping the arguments live. They're compiled in when
+ * ``G_USE_USDT_PROBES`` is defined to 1, which ``setup.py`` does if
+ * the environment variable ``GREENLET_USDT_PROBES`` is set; that needs
+ * ``<sys/sdt.h>`` (e.g., from ``systemtap-sdt-dev``).
+ *
+ * All probes are in the ``greenlet`` provider. Greenlets are passed as
+ * the address of their ``PyGreenlet``, which is what ``id()`` returns.
+ *
+ * ``switch__entry(origin, target)``
+ *     Before the stack is switched.
+ * ``switch__exit(origin, target, nbytes)``
+ *     After the stack is switched, in *target*. *nbytes* is how much
+ *     of the C stack was copied to and from the heap.
+ * ``start(greenlet)``
+ *     A greenlet is about to call its ``run``.
+ * ``finish(greenlet, raised)``
+ *     A greenlet's ``run`` returned, or raised if *raised* is 1.
+ * ``throw(greenlet, type)``
+ *     An exception of *type* (the address of the type object) is about
+ *     to be thrown into *greenlet*.
+ * ``kill(greenlet, how)``
+ *     A started greenlet is being deallocated. *how* is one of the
+ *     ``GREENLET_KILL_`` values below.
+ *
+ * For example::
+ *
+ *     bpftrace -e 'usdt:greenlet/_greenlet*.so:greenlet:switch__exit
+ *                  { @bytes = hist(arg2); }' -p PID
+ */
+
+#ifndef G_USE_USDT_PROBES
+#    define G_USE_USDT_PROBES 0
+#endif
+
+// How a deallocated greenlet was killed.
+// GreenletExit was thrown into it.
+#define GREENLET_KILL_THROWN 0
+// It belongs to another thread, which will throw GreenletExit into it.
+#define GREENLET_KILL_QUEUED 1
+// Its thread is gone; it was discarded without running.
+#define GREENLET_KILL_DISCARDED 2
+
+#if G_USE_USDT_PROBES
+#    include <sys/sdt.h>
+#    define GREENLET_PROBE1(name, a1) \
+    DTRACE_PROBE1(greenlet, name, a1)
+#    define GREENLET_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(greenlet, name, a1, a2)
+#    define GREENLET_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(greenlet, name, a1, a2, a3)
+#else
+#    define GREENLET_PROBE1(name, a1) do {} while (0)
+#    define GREENLET_PROBE2(name, a1, a2) do {} while (0)
+#    define GREENLET_PROBE3(name, a1, a2, a3) do {} while (0)
+#endif
+
+#endif
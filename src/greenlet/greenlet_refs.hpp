@@ -976,6 +976,17 @@ namespace greenlet {
             assert(!this->type && !this->instance && !this->traceback);
         }
 
+        // Like PyErrRestore(), but we keep our references, so the
+        // same error can be restored again.
+        void PyErrRestoreCopy() const
+        {
+            assert(!this->restored);
+            PyErr_Restore(
+                this->type.acquire(),
+                this->instance.acquire(),
+                this->traceback.acquire());
+        }
+
     private:
         void normalize()
         {
@@ -3,6 +3,7 @@
 
 #include "greenlet_compiler_compat.hpp"
 #include "greenlet_refs.hpp"
+#include "greenlet_thread_support.hpp"
 
 /*
  * the following macros are spliced into the OS/compiler
@@ -30,13 +31,24 @@
 // ``slp_save_state_asm`()` to fetch the pointer to pass to the
 // macro.)
 //
-// Our compromise is to use a *glabal*, untracked, weak, pointer
+// Our compromise is to use a thread-local, untracked, weak, pointer
 // to the necessary thread state during the process of switching only.
-// This is safe beacuse we're protected by the GIL, and if we're
-// running this code, the thread isn't exiting. This also nets us a
-// 10-12% speed improvement.
+// If we're running this code, the thread isn't exiting. This also
+// nets us a 10-12% speed improvement.
+//
+// These used to be process globals, protected by the GIL. Being
+// thread-local, switches in different threads don't share anything
+// here (not even a cache line), which is one less thing tying the
+// switch path to the GIL.
+
+static G_THREAD_LOCAL_VAR greenlet::Greenlet* volatile switching_thread_state = nullptr;
+
+// How many bytes of C stack the switch in progress has copied to and
+// from the heap.
+static G_THREAD_LOCAL_VAR size_t switching_bytes_copied = 0;
 
-static greenlet::Greenlet* volatile switching_thread_state = nullptr;
+// When the switch in progress started, if switches are being timed.
+static G_THREAD_LOCAL_VAR uint64_t switching_started_at = 0;
 
 
 #ifdef GREENLET_NOINLINE_SUPPORTED
@@ -0,0 +1,621 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+#ifndef GREENLET_STACK_COPY_HPP
+#define GREENLET_STACK_COPY_HPP
+/**
+ * Copying C stacks to and from the heap.
+ *
+ * When a greenlet is switched away from, the part of its stack that's
+ * in the way of the greenlet being switched to is copied to the heap,
+ * where it sits untouched until the greenlet runs again, possibly much
+ * later. For deep stacks, writing that copy with ordinary stores
+ * evicts from the CPU caches data that the next greenlet is actually
+ * going to use. So on x86-64 Linux, copies to the heap of at least
+ * ``threshold()`` bytes can use non-temporal (streaming) stores that
+ * bypass the caches. The best available version of that is picked at
+ * runtime, based on what the CPU supports.
+ *
+ * Copies back to the stack always use ordinary stores: the greenlet
+ * that owns that stack is about to start using it.
+ *
+ * Define ``G_USE_NONTEMPORAL_STACK_COPY`` to 0 to always use
+ * ``memcpy``.
+ *
+ * On Linux, defining ``G_USE_MMAP_STACK_COPY`` to 1 makes copies of
+ * at least ``mmap_threshold`` bytes page aligned mappings of their
+ * own rather than memory from Python's allocator. Only then can
+ * ``advise_idle()`` tell the kernel that the copies of greenlets that
+ * have been suspended for a long time are good candidates for
+ * reclaiming (``MADV_COLD``) or swapping out (``MADV_PAGEOUT``). A
+ * few released mappings are kept for reuse, so that suspending a
+ * greenlet doesn't usually cost a system call, but when that cache
+ * misses, a switch that saves a deep stack is several times slower
+ * than with Python's allocator; so this is off by default. All of
+ * this bookkeeping is only done while holding the GIL, and never
+ * fails a save: if a mapping can't be had or tracked, the copy uses
+ * Python's allocator instead.
+ *
+ * Experimentally, on Linux, defining ``G_USE_MREMAP_STACK_SAVE`` to 1
+ * allocates large copies with ``mmap`` so that their pages line up
+ * with the pages of the stack, and then saving at least
+ * ``remap_threshold()`` bytes moves the whole pages into the copy
+ * with ``mremap(MREMAP_DONTUNMAP)`` instead of copying them. Only the
+ * ragged edges are copied. That leaves fresh zero pages behind on the
+ * stack, so it's only done for the part of the stack that the
+ * greenlet being switched to is about to restore its own copy over.
+ */
+
+#include <cstring>
+#include <cstddef>
+#include <stdint.h>
+
+#include "greenlet_compiler_compat.hpp"
+
+#ifndef G_USE_NONTEMPORAL_STACK_COPY
+#    if defined(__x86_64__) && defined(__linux__) && (defined(__GNUC__) || defined(__clang__))
+#        define G_USE_NONTEMPORAL_STACK_COPY 1
+#    else
+#        define G_USE_NONTEMPORAL_STACK_COPY 0
+#    endif
+#endif
+
+#if G_USE_NONTEMPORAL_STACK_COPY
+#    include <immintrin.h>
+#endif
+
+#ifndef G_USE_MMAP_STACK_COPY
+// Until it's shown not to slow down ordinary programs.
+#    define G_USE_MMAP_STACK_COPY 0
+#endif
+
+#if G_USE_MMAP_STACK_COPY && !defined(__linux__)
+#    error "G_USE_MMAP_STACK_COPY is only supported on Linux"
+#endif
+
+#ifndef G_USE_MREMAP_STACK_SAVE
+#    define G_USE_MREMAP_STACK_SAVE 0
+#endif
+
+#if G_USE_MREMAP_STACK_SAVE && !G_USE_MMAP_STACK_COPY
+#    error "G_USE_MREMAP_STACK_SAVE needs G_USE_MMAP_STACK_COPY, and is only supported on Linux"
+#endif
+
+#if G_USE_MMAP_STACK_COPY
+#    include <cerrno>
+#    include <ctime>
+#    include <new>
+#    include <unordered_map>
+#    include <unistd.h>
+#    include <sys/mman.h>
+#    ifndef MADV_COLD
+// Linux 5.4; older kernels reject these.
+#        define MADV_COLD 20
+#        define MADV_PAGEOUT 21
+#    endif
+#endif
+
+#if G_USE_MREMAP_STACK_SAVE
+#    ifndef MREMAP_DONTUNMAP
+// Linux 5.7; older kernels reject it, and we fall back to copying.
+#        define MREMAP_DONTUNMAP 4
+#    endif
+#endif
+
+namespace greenlet {
+
+class StackCopier
+{
+private:
+    typedef void (*copy_func_t)(char* dest, const char* src, size_t n);
+
+    // Null if we only have memcpy.
+    static copy_func_t nontemporal_copy;
+    static const char* nontemporal_copy_name;
+    static size_t _threshold;
+#if G_USE_MMAP_STACK_COPY
+    struct Mapping
+    {
+        size_t length;
+        // When the copy was last written to.
+        double saved_at;
+        // Whether advise_idle() has dealt with it since then.
+        bool advised;
+    };
+    // Keyed by the address of the mapping.
+    typedef std::unordered_map<uintptr_t, Mapping> mappings_t;
+
+    struct CachedMapping
+    {
+        void* base;
+        size_t length;
+    };
+    // Enough for a handful of greenlets taking turns to suspend.
+    static const size_t cache_slots = 8;
+    static const size_t cache_limit = 2 * 1024 * 1024;
+
+    static uintptr_t page_size;
+    static mappings_t* mappings;
+    static size_t mapped_bytes;
+    static CachedMapping cache[cache_slots];
+    static size_t ncached;
+    static size_t cached_bytes;
+    static size_t advised_copies;
+    static size_t advised_bytes;
+
+    static inline uintptr_t page_floor(const uintptr_t p)
+    {
+        return p & ~(page_size - 1);
+    }
+
+    static inline uintptr_t page_ceil(const uintptr_t p)
+    {
+        return (p + page_size - 1) & ~(page_size - 1);
+    }
+
+    static double now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    // Get *length* bytes of pages, preferring a cached mapping that
+    // isn't much bigger than that. Returns null if there's no memory.
+    static char* map_pages(size_t& length)
+    {
+        size_t best = ncached;
+        for (size_t i = 0; i < ncached; i++) {
+            if (cache[i].length >= length && cache[i].length <= 2 * length
+                && (best == ncached || cache[i].length < cache[best].length)) {
+                best = i;
+            }
+        }
+        if (best != ncached) {
+            void* const base = cache[best].base;
+            length = cache[best].length;
+            cached_bytes -= length;
+            cache[best] = cache[--ncached];
+            return static_cast<char*>(base);
+        }
+        void* const p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p == MAP_FAILED ? nullptr : static_cast<char*>(p);
+    }
+
+    static void unmap_pages(void* const base, const size_t length)
+    {
+        if (ncached < cache_slots && cached_bytes + length <= cache_limit) {
+            cache[ncached].base = base;
+            cache[ncached].length = length;
+            ncached++;
+            cached_bytes += length;
+            return;
+        }
+        munmap(base, length);
+    }
+
+    // Start tracking the mapping at *base*. This is reached while
+    // saving a stack, which can't fail, so if there's no memory for
+    // that, return false and track nothing.
+    static bool track(const char* const base, const size_t length) G_NOEXCEPT
+    {
+        try {
+            Mapping& m = (*mappings)[reinterpret_cast<uintptr_t>(base)];
+            m.length = length;
+            m.saved_at = now();
+            m.advised = false;
+        }
+        catch (const std::bad_alloc&) {
+            return false;
+        }
+        mapped_bytes += length;
+        return true;
+    }
+
+    static inline Mapping& tracked(const char* const base) G_NOEXCEPT
+    {
+        mappings_t::iterator it = mappings->find(reinterpret_cast<uintptr_t>(base));
+        assert(it != mappings->end());
+        return it->second;
+    }
+
+    // Stop tracking the mapping at *base*, and return its length.
+    static size_t untrack(const char* const base)
+    {
+        mappings_t::iterator it = mappings->find(reinterpret_cast<uintptr_t>(base));
+        assert(it != mappings->end());
+        const size_t length = it->second.length;
+        mappings->erase(it);
+        mapped_bytes -= length;
+        return length;
+    }
+#endif
+
+#if G_USE_MREMAP_STACK_SAVE
+    static size_t _remap_threshold;
+
+    // Move the whole pages of the stack in [stack, stack + n) that
+    // are below *overwritten_below* to the same place in the copy at
+    // *heap*, which must be laid out the same way, and copy the rest.
+    static bool remap(char* const heap, const char* const stack, const size_t n,
+                      const char* const overwritten_below)
+    {
+        const uintptr_t start = reinterpret_cast<uintptr_t>(stack);
+        const uintptr_t limit = reinterpret_cast<uintptr_t>(overwritten_below);
+        // Leave the first whole page where it is: the frame of
+        // slp_switch() that's saving the stack may reach into it.
+        const uintptr_t lo = page_ceil(start) + page_size;
+        const uintptr_t hi = page_floor(limit < start + n ? limit : start + n);
+        if (hi <= lo) {
+            return false;
+        }
+        void* moved = mremap(reinterpret_cast<void*>(lo), hi - lo, hi - lo,
+                             MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP,
+                             heap + (lo - start));
+        if (moved == MAP_FAILED) {
+            return false;
+        }
+        memcpy(heap, stack, lo - start);
+        memcpy(heap + (hi - start), reinterpret_cast<const char*>(hi), start + n - hi);
+        return true;
+    }
+#endif
+
+#if G_USE_NONTEMPORAL_STACK_COPY
+    // Both of these copy the head of the buffer with memcpy until the
+    // destination is suitably aligned for streaming stores, stream
+    // as much as possible, and finish with memcpy. They must only be
+    // used for copies larger than a few cache lines.
+    static void nontemporal_copy_sse2(char* dest, const char* src, size_t n)
+    {
+        const size_t head = (16 - (reinterpret_cast<uintptr_t>(dest) & 15)) & 15;
+        memcpy(dest, src, head);
+        dest += head;
+        src += head;
+        n -= head;
+        for (; n >= 64; n -= 64, dest += 64, src += 64) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+            const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+            const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 48));
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dest), a);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dest + 16), b);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dest + 32), c);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dest + 48), d);
+        }
+        // Streaming stores are weakly ordered.
+        _mm_sfence();
+        memcpy(dest, src, n);
+    }
+
+    __attribute__((target("avx2")))
+    static void nontemporal_copy_avx2(char* dest, const char* src, size_t n)
+    {
+        const size_t head = (32 - (reinterpret_cast<uintptr_t>(dest) & 31)) & 31;
+        memcpy(dest, src, head);
+        dest += head;
+        src += head;
+        n -= head;
+        for (; n >= 128; n -= 128, dest += 128, src += 128) {
+            const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+            const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32));
+            const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 64));
+            const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 96));
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(dest), a);
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(dest + 32), b);
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(dest + 64), c);
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(dest + 96), d);
+        }
+        _mm_sfence();
+        memcpy(dest, src, n);
+    }
+#endif
+
+public:
+    // Below this, even a fast machine can't tell the difference, and
+    // the alignment work outweighs any benefit.
+    static const size_t minimum_threshold = 1024;
+#if G_USE_MMAP_STACK_COPY
+    // Copies at least this big get a mapping of their own. Below
+    // this, the pages would mostly be shared with other copies.
+    static const size_t mmap_threshold = 16 * 1024;
+#endif
+
+    /**
+     * Pick the copy functions to use. Call once, when the module is
+     * initialized.
+     */
+    static void init()
+    {
+#if G_USE_MMAP_STACK_COPY
+        StackCopier::page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        StackCopier::mappings = new mappings_t();
+#endif
+#if G_USE_NONTEMPORAL_STACK_COPY
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            StackCopier::nontemporal_copy = StackCopier::nontemporal_copy_avx2;
+            StackCopier::nontemporal_copy_name = "avx2";
+        }
+        else {
+            // Part of the x86-64 baseline.
+            StackCopier::nontemporal_copy = StackCopier::nontemporal_copy_sse2;
+            StackCopier::nontemporal_copy_name = "sse2";
+        }
+#endif
+    }
+
+    /**
+     * Copy *n* bytes from the C stack at *stack* to the heap at *heap*.
+     * *mapped* says whether *heap* is part of a copy that ``resize()``
+     * made a mapping. The stack below *overwritten_below* is about to
+     * be overwritten, so its pages can be taken away.
+     */
+    static inline void save(char* const heap, const char* const stack, const size_t n,
+                            const bool mapped=false,
+                            const char* const overwritten_below=nullptr) G_NOEXCEPT
+    {
+#if G_USE_MREMAP_STACK_SAVE
+        if (mapped && StackCopier::remap(heap, stack, n, overwritten_below)) {
+            return;
+        }
+#else
+        (void)mapped;
+        (void)overwritten_below;
+#endif
+        if (StackCopier::nontemporal_copy && n >= StackCopier::_threshold) {
+            StackCopier::nontemporal_copy(heap, stack, n);
+        }
+        else {
+            memcpy(heap, stack, n);
+        }
+    }
+
+    /**
+     * Resize the copy at *copy*, currently holding *old_n* bytes of
+     * the stack starting at *stack*, to hold *new_n* bytes, keeping
+     * its contents. *mapped* says whether the copy is a mapping lined
+     * up with the stack, rather than memory from Python, and is
+     * updated to say what the result is. Returns null if there's no
+     * memory (without setting a Python exception).
+     */
+    static char* resize(char* const copy, const size_t old_n, const size_t new_n,
+                        const char* const stack, bool& mapped) G_NOEXCEPT
+    {
+#if G_USE_MMAP_STACK_COPY
+        if (mapped || new_n >= StackCopier::mmap_threshold
+#    if G_USE_MREMAP_STACK_SAVE
+            || new_n >= StackCopier::_remap_threshold
+#    endif
+            ) {
+            // Line the copy up with the pages of the stack.
+            const uintptr_t offset = reinterpret_cast<uintptr_t>(stack) & (page_size - 1);
+            size_t length = page_ceil(offset + new_n);
+            if (mapped) {
+                char* const old_base = copy - offset;
+                Mapping& old = StackCopier::tracked(old_base);
+                if (old.length >= length) {
+                    return copy;
+                }
+                // Growing it where it is keeps its entry.
+                if (mremap(old_base, old.length, length, 0) != MAP_FAILED) {
+                    mapped_bytes += length - old.length;
+                    old.length = length;
+                    return copy;
+                }
+            }
+            char* const base = StackCopier::map_pages(length);
+            if (base) {
+                if (StackCopier::track(base, length)) {
+                    if (copy) {
+                        memcpy(base + offset, copy, old_n);
+                        StackCopier::release(copy, old_n, mapped);
+                    }
+                    mapped = true;
+                    return base + offset;
+                }
+                StackCopier::unmap_pages(base, length);
+            }
+            if (mapped) {
+                // Fall back to Python's allocator.
+                char* const p = static_cast<char*>(PyMem_Malloc(new_n));
+                if (!p) {
+                    return nullptr;
+                }
+                memcpy(p, copy, old_n);
+                StackCopier::release(copy, old_n, mapped);
+                mapped = false;
+                return p;
+            }
+        }
+#else
+        (void)old_n;
+        (void)stack;
+        (void)mapped;
+#endif
+        return static_cast<char*>(PyMem_Realloc(copy, new_n));
+    }
+
+    /**
+     * Free the copy at *copy*, which holds *n* bytes.
+     */
+    static void release(char* const copy, const size_t n, const bool mapped) G_NOEXCEPT
+    {
+#if G_USE_MMAP_STACK_COPY
+        (void)n;
+        if (mapped) {
+            char* const base = reinterpret_cast<char*>(page_floor(reinterpret_cast<uintptr_t>(copy)));
+            StackCopier::unmap_pages(base, StackCopier::untrack(base));
+            return;
+        }
+#else
+        (void)n;
+        (void)mapped;
+#endif
+        PyMem_Free(copy);
+    }
+
+    /**
+     * Copy *n* bytes from the heap at *heap* back to the C stack at
+     * *stack*.
+     */
+    static inline void restore(char* const stack, const char* const heap, const size_t n) G_NOEXCEPT
+    {
+        memcpy(stack, heap, n);
+    }
+
+    /**
+     * The size, in bytes, at which saving a stack starts using
+     * non-temporal stores. Values lower than ``minimum_threshold``
+     * are raised to that.
+     */
+    static inline size_t threshold()
+    {
+        return StackCopier::_threshold;
+    }
+
+    static inline void threshold(size_t nbytes)
+    {
+        StackCopier::_threshold = nbytes < minimum_threshold ? minimum_threshold : nbytes;
+    }
+
+#if G_USE_MMAP_STACK_COPY
+    /**
+     * Note that the copy at *copy*, which ``resize()`` made a
+     * mapping, is in use again.
+     */
+    static void touch(const char* const copy) G_NOEXCEPT
+    {
+        mappings_t::iterator it = mappings->find(page_floor(reinterpret_cast<uintptr_t>(copy)));
+        assert(it != mappings->end());
+        it->second.saved_at = now();
+        it->second.advised = false;
+    }
+
+    /**
+     * Give the kernel *advice* (``MADV_COLD`` or ``MADV_PAGEOUT``)
+     * about each mapped copy that hasn't been used for at least
+     * *seconds*, and hasn't already been advised about, and give
+     * back the mappings kept for reuse. Returns how many copies
+     * were advised about, or -1 with errno set if the kernel
+     * doesn't understand the advice.
+     */
+    static Py_ssize_t advise_idle(const double seconds, const int advice)
+    {
+        while (ncached) {
+            ncached--;
+            munmap(cache[ncached].base, cache[ncached].length);
+        }
+        cached_bytes = 0;
+
+        const double cutoff = now() - seconds;
+        Py_ssize_t count = 0;
+        for (mappings_t::iterator it = mappings->begin(); it != mappings->end(); ++it) {
+            Mapping& m = it->second;
+            if (m.advised || m.saved_at > cutoff) {
+                continue;
+            }
+            if (madvise(reinterpret_cast<void*>(it->first), m.length, advice) < 0) {
+                if (errno == EINVAL) {
+                    return -1;
+                }
+                // Otherwise (e.g., EAGAIN), it's only advice.
+                continue;
+            }
+            m.advised = true;
+            count++;
+            advised_copies++;
+            advised_bytes += m.length;
+        }
+        return count;
+    }
+
+    /**
+     * The number of copies that are mappings now, and their total size.
+     */
+    static inline size_t total_mapped_copies()
+    {
+        return mappings->size();
+    }
+
+    static inline size_t total_mapped_bytes()
+    {
+        return mapped_bytes;
+    }
+
+    /**
+     * The total size of the released mappings kept for reuse.
+     */
+    static inline size_t total_cached_bytes()
+    {
+        return cached_bytes;
+    }
+
+    /**
+     * How many copies ``advise_idle()`` has advised about, ever, and
+     * their total size.
+     */
+    static inline size_t total_advised_copies()
+    {
+        return advised_copies;
+    }
+
+    static inline size_t total_advised_bytes()
+    {
+        return advised_bytes;
+    }
+#endif
+
+#if G_USE_MREMAP_STACK_SAVE
+    /**
+     * The size, in bytes, at which saving a stack starts moving
+     * pages instead of copying them. Copies of stacks that big are
+     * allocated with mmap.
+     */
+    static inline size_t remap_threshold()
+    {
+        return StackCopier::_remap_threshold;
+    }
+
+    static inline void remap_threshold(size_t nbytes)
+    {
+        StackCopier::_remap_threshold = nbytes;
+    }
+#endif
+
+    /**
+     * A short name for the kind of non-temporal copy in use: one
+     * of "avx2", "sse2" or, if there is none, "memcpy".
+     */
+    static inline const char* kernel_name()
+    {
+        return StackCopier::nontemporal_copy_name;
+    }
+};
+
+StackCopier::copy_func_t StackCopier::nontemporal_copy = nullptr;
+const char* StackCopier::nontemporal_copy_name = "memcpy";
+// Off by default. In benchmarks/switch_depth.py, on the machines
+// we've measured, having to read the saved stack back from memory
+// when the greenlet is resumed always cost more than keeping it out
+// of the cache saved, even at 256KB and even when dozens of other
+// greenlets ran in between. Workloads that keep lots of data hot
+// between switches may differ, so this can be lowered from Python.
+size_t StackCopier::_threshold = static_cast<size_t>(-1) >> 1;
+#if G_USE_MMAP_STACK_COPY
+uintptr_t StackCopier::page_size = 4096;
+StackCopier::mappings_t* StackCopier::mappings = nullptr;
+size_t StackCopier::mapped_bytes = 0;
+StackCopier::CachedMapping StackCopier::cache[StackCopier::cache_slots];
+size_t StackCopier::ncached = 0;
+size_t StackCopier::cached_bytes = 0;
+size_t StackCopier::advised_copies = 0;
+size_t StackCopier::advised_bytes = 0;
+#endif
+#if G_USE_MREMAP_STACK_SAVE
+// Off by default. See benchmarks/stack_remap.py.
+size_t StackCopier::_remap_threshold = static_cast<size_t>(-1) >> 1;
+#endif
+
+}; // namespace greenlet
+
+#endif
@@ -0,0 +1,195 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+#ifndef GREENLET_SWITCH_LOG_HPP
+#define GREENLET_SWITCH_LOG_HPP
+/**
+ * A flight recorder of recent switches.
+ *
+ * While ``enabled`` (see ``enable_switch_log()``), each ThreadState
+ * keeps a fixed-size ring of the most recent ``capacity`` switches
+ * (and greenlet starts and finishes) in that thread, so that when a
+ * thread stalls or dies we can see what it was doing. Writing an
+ * entry is a clock read and a few stores. The ring is allocated by
+ * the thread's first entry, and never grows; no Python objects are
+ * touched on the switch path. Greenlets are recorded by address
+ * (``id()``), without references. While it's off, the switch path
+ * doesn't read the clock at all, unless something else (the
+ * watchdog, latency timing or the timeline) wants the time.
+ *
+ * The ring is only written by its own thread, and only read by that
+ * thread, while holding the GIL.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <Python.h>
+
+#include "greenlet_compiler_compat.hpp"
+
+namespace greenlet {
+
+class SwitchLog
+{
+public:
+    enum Event {
+        // A switch into a greenlet; its ``switch()`` (or ``run``)
+        // is about to return.
+        SWITCH = 0,
+        // Like SWITCH, but an exception is about to be raised in it.
+        THROW = 1,
+        // A greenlet is about to call its ``run``.
+        START = 2,
+        // A greenlet's ``run`` is done, and it's about to switch to
+        // its parent.
+        FINISH = 3
+    };
+
+    struct Entry
+    {
+        // Nanoseconds, from std::chrono::steady_clock.
+        uint64_t timestamp;
+        uintptr_t origin;
+        uintptr_t target;
+        // Bytes of C stack the switch copied to and from the heap.
+        uint32_t nbytes;
+        uint32_t event;
+    };
+
+    // A power of two. At 32 bytes an entry, this is 128KB per thread.
+    static const size_t capacity = 4096;
+
+    // Whether switches are being recorded, in every thread.
+    static bool enabled;
+    // Whether something else needs the time of every switch (the
+    // watchdog does).
+    static bool clock_wanted;
+
+private:
+    // Allocated by the first entry.
+    Entry* entries;
+    // How many entries have ever been written.
+    uint64_t count;
+
+    G_NO_COPIES_OF_CLS(SwitchLog);
+
+public:
+    SwitchLog()
+        : entries(nullptr),
+          count(0)
+    {
+    }
+
+    ~SwitchLog()
+    {
+        PyMem_Free(this->entries);
+    }
+
+    static inline uint64_t now() G_NOEXCEPT
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+     * Whether a switch needs to read the clock for the log or the
+     * watchdog.
+     */
+    static inline bool clock_needed() G_NOEXCEPT
+    {
+        return SwitchLog::enabled || SwitchLog::clock_wanted;
+    }
+
+    static const char* event_name(const uint32_t event)
+    {
+        static const char* const names[] = {"switch", "throw", "start", "finish"};
+        return event < sizeof(names) / sizeof(names[0]) ? names[event] : "unknown";
+    }
+
+    inline void record(const Event event, const void* const origin, const void* const target,
+                       const size_t nbytes) G_NOEXCEPT
+    {
+        if (SwitchLog::enabled) {
+            this->record(event, origin, target, nbytes, SwitchLog::now());
+        }
+    }
+
+    /**
+     * Like the above, when the caller already knows the time.
+     */
+    inline void record(const Event event, const void* const origin, const void* const target,
+                       const size_t nbytes, const uint64_t timestamp) G_NOEXCEPT
+    {
+        if (!SwitchLog::enabled) {
+            return;
+        }
+        if (!this->entries) {
+            // Must hold the GIL, which switching does. If this
+            // fails, we just don't record anything.
+            this->entries = static_cast<Entry*>(PyMem_Malloc(capacity * sizeof(Entry)));
+            if (!this->entries) {
+                return;
+            }
+        }
+        Entry& e = this->entries[this->count++ & (capacity - 1)];
+        e.timestamp = timestamp;
+        e.origin = reinterpret_cast<uintptr_t>(origin);
+        e.target = reinterpret_cast<uintptr_t>(target);
+        e.nbytes = nbytes > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(nbytes);
+        e.event = event;
+    }
+
+    /**
+     * The number of entries available, at most ``capacity``.
+     */
+    inline size_t size() const
+    {
+        if (!this->entries) {
+            return 0;
+        }
+        return this->count < capacity ? static_cast<size_t>(this->count) : capacity;
+    }
+
+    /**
+     * The *i*th oldest entry available.
+     */
+    inline const Entry& operator[](const size_t i) const
+    {
+        return this->entries[(this->count - this->size() + i) & (capacity - 1)];
+    }
+
+    inline void clear()
+    {
+        this->count = 0;
+    }
+
+    /**
+     * Write the entries, oldest first, to *f*. This doesn't use
+     * Python, so it can be used when Python is in trouble.
+     */
+    void dump(FILE* const f) const
+    {
+        const size_t n = this->size();
+        if (!n) {
+            return;
+        }
+        fprintf(f, "greenlet: the last %lu switches in this thread, oldest first:\n",
+                static_cast<unsigned long>(n));
+        for (size_t i = 0; i < n; i++) {
+            const Entry& e = (*this)[i];
+            fprintf(f, "  %llu %-6s %p -> %p (%lu bytes)\n",
+                    static_cast<unsigned long long>(e.timestamp),
+                    SwitchLog::event_name(e.event),
+                    reinterpret_cast<void*>(e.origin),
+                    reinterpret_cast<void*>(e.target),
+                    static_cast<unsigned long>(e.nbytes));
+        }
+        fflush(f);
+    }
+};
+
+bool SwitchLog::enabled = false;
+bool SwitchLog::clock_wanted = false;
+
+}; // namespace greenlet
+
+#endif
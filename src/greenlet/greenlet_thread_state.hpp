@@ -5,8 +5,11 @@
 #include <stdexcept>
 
 #include "greenlet_internal.hpp"
+#include "pythread.h"
 #include "greenlet_refs.hpp"
 #include "greenlet_thread_support.hpp"
+#include "greenlet_switch_log.hpp"
+#include "greenlet_latency_histogram.hpp"
 
 using greenlet::refs::BorrowedObject;
 using greenlet::refs::BorrowedGreenlet;
@@ -104,6 +107,49 @@ private:
     /* Strong reference to the trace function, if any. */
     OwnedObject tracefunc;
 
+    /* If new greenlets in this thread are started from a fixed
+       base, strong reference to the greenlet parked at that base
+       that starts them for us. See ``spawn_trampoline_run()``. */
+    OwnedGreenlet spawn_trampoline;
+    /* The greenlet the trampoline should start next, and the
+       greenlet that asked for it to be started. These only have a
+       value for the duration of that handoff. */
+    OwnedGreenlet spawn_target;
+    OwnedGreenlet spawn_requester;
+
+    /* How much of the stack was restored by the last switch in
+       this thread, and how much was left to be restored lazily. */
+    LazyStackRestore::ThreadRecord lazy_restore;
+
+    /* The user greenlets started in this thread that haven't died,
+       most recently started first. The links are kept in the
+       greenlets, so this is maintained without allocating. */
+    UserGreenlet* registered_greenlets;
+    size_t registered_count;
+
+    /* The memory held by the stacks saved in this thread. */
+    MemoryStats _memory_stats;
+    /* The thread's ``threading.get_ident()``. */
+    unsigned long _thread_ident;
+    /* All the thread states that haven't been destroyed yet, most
+       recently created first. */
+    static ThreadState* all_states;
+    ThreadState* prev_state;
+    ThreadState* next_state;
+
+    /* The most recent switches in this thread. */
+    SwitchLog _switch_log;
+
+    /* When this thread last switched greenlets (by
+       ``SwitchLog::now()``), or 0 if it hasn't; and the last of
+       those times that the watchdog reported the greenlet for. */
+    uint64_t _switched_at;
+    uint64_t _watchdog_reported_at;
+
+    /* How long switches in this thread took, while that's being
+       measured. */
+    LatencyHistogram _switch_latency;
+
     typedef std::vector<PyGreenlet*, PythonAllocator<PyGreenlet*> > deleteme_t;
     /* A vector of raw PyGreenlet pointers representing things that need
        deleted when this thread is running. The vector owns the
@@ -114,6 +160,14 @@ private:
     */
     deleteme_t deleteme;
 
+    /* Suspended greenlets of this thread that the garbage collector
+       found only cycles refer to (see green_finalize()). They can't
+       be killed while it's collecting, or from another thread, so they're kept alive here and
+       killed as soon as it's done. Owns the references, like
+       ``deleteme``.
+    */
+    deleteme_t killme;
+
 #ifdef GREENLET_NEEDS_EXCEPTION_STATE_SAVED
     void* exception_state;
 #endif
@@ -144,12 +198,24 @@ public:
 
     ThreadState()
         : main_greenlet(OwnedMainGreenlet::consuming(green_create_main(this))),
-          current_greenlet(main_greenlet)
+          current_greenlet(main_greenlet),
+          registered_greenlets(nullptr),
+          registered_count(0),
+          _thread_ident(static_cast<unsigned long>(PyThread_get_thread_ident())),
+          prev_state(nullptr),
+          next_state(ThreadState::all_states),
+          _switched_at(0),
+          _watchdog_reported_at(0)
     {
         if (!this->main_greenlet) {
             // We failed to create the main greenlet. That's bad.
             throw PyFatalError("Failed to create main greenlet");
         }
+        this->main_greenlet->stack_state.account_to(&this->_memory_stats);
+        if (ThreadState::all_states) {
+            ThreadState::all_states->prev_state = this;
+        }
+        ThreadState::all_states = this;
         // The main greenlet starts with 1 refs: The returned one. We
         // then copied it to the current greenlet.
         assert(this->main_greenlet.REFCNT() == 2);
@@ -168,6 +234,127 @@ public:
 #endif
     }
 
+    inline LazyStackRestore::ThreadRecord& lazy_restore_record()
+    {
+        return this->lazy_restore;
+    }
+
+    inline SwitchLog& switch_log()
+    {
+        return this->_switch_log;
+    }
+
+    inline LatencyHistogram& switch_latency()
+    {
+        return this->_switch_latency;
+    }
+
+    inline void switched_at(const uint64_t now) G_NOEXCEPT
+    {
+        this->_switched_at = now;
+    }
+
+    inline uint64_t switched_at() const G_NOEXCEPT
+    {
+        return this->_switched_at;
+    }
+
+    /**
+     * If this thread's current greenlet has been running since
+     * before *cutoff*, and the watchdog hasn't reported it yet,
+     * return true and remember that it has now.
+     */
+    inline bool watchdog_should_report(const uint64_t cutoff) G_NOEXCEPT
+    {
+        if (!this->_switched_at
+            || this->_switched_at > cutoff
+            || this->_switched_at == this->_watchdog_reported_at) {
+            return false;
+        }
+        this->_watchdog_reported_at = this->_switched_at;
+        return true;
+    }
+
+    /**
+     * Add *g*, which is starting in this thread, to the list of
+     * this thread's greenlets.
+     */
+    inline void register_greenlet(UserGreenlet* g) G_NOEXCEPT
+    {
+        assert(!g->_registered_in);
+        g->_registered_in = this;
+        g->_registry_prev = nullptr;
+        g->_registry_next = this->registered_greenlets;
+        if (this->registered_greenlets) {
+            this->registered_greenlets->_registry_prev = g;
+        }
+        this->registered_greenlets = g;
+        this->registered_count++;
+    }
+
+    /**
+     * Remove *g* from the list of its thread's greenlets, if it's
+     * in one.
+     */
+    static inline void unregister_greenlet(UserGreenlet* g) G_NOEXCEPT
+    {
+        ThreadState* const state = g->_registered_in;
+        if (!state) {
+            return;
+        }
+        if (g->_registry_prev) {
+            g->_registry_prev->_registry_next = g->_registry_next;
+        }
+        else {
+            state->registered_greenlets = g->_registry_next;
+        }
+        if (g->_registry_next) {
+            g->_registry_next->_registry_prev = g->_registry_prev;
+        }
+        g->_registered_in = nullptr;
+        g->_registry_prev = g->_registry_next = nullptr;
+        state->registered_count--;
+    }
+
+    /**
+     * The first of this thread's started, not yet dead, greenlets;
+     * follow ``next_registered()`` for the rest.
+     */
+    inline UserGreenlet* first_registered_greenlet() const G_NOEXCEPT
+    {
+        return this->registered_greenlets;
+    }
+
+    inline size_t registered_greenlet_count() const G_NOEXCEPT
+    {
+        return this->registered_count;
+    }
+
+    inline const MemoryStats& memory_stats() const G_NOEXCEPT
+    {
+        return this->_memory_stats;
+    }
+
+    inline unsigned long thread_ident() const G_NOEXCEPT
+    {
+        return this->_thread_ident;
+    }
+
+    /**
+     * The first of all the thread states that haven't been destroyed;
+     * follow ``next()`` for the rest. Some of these may belong to
+     * threads that have exited, but haven't been cleaned up yet.
+     */
+    static inline ThreadState* first() G_NOEXCEPT
+    {
+        return ThreadState::all_states;
+    }
+
+    inline ThreadState* next() const G_NOEXCEPT
+    {
+        return this->next_state;
+    }
+
     inline bool has_main_greenlet()
     {
         return !!this->main_greenlet;
@@ -187,6 +374,7 @@ public:
             Py_VISIT(current_greenlet.borrow_o());
         }
         Py_VISIT(tracefunc.borrow());
+        Py_VISIT(spawn_trampoline.borrow_o());
         return 0;
     }
 
@@ -233,6 +421,15 @@ public:
         return this->current_greenlet;
     }
 
+    /**
+     * Does no maintenance, so this can be used to look at the state
+     * of another thread.
+     */
+    inline BorrowedGreenlet borrow_current() const
+    {
+        return this->current_greenlet;
+    }
+
     template<typename T, refs::TypeChecker TC>
     inline bool is_current(const refs::PyObjectPointer<T, TC>& obj) const
     {
@@ -287,8 +484,69 @@ private:
                 }
             }
         }
+        this->kill_suspended_garbage(murder);
     }
 
+public:
+    /**
+     * Kill the greenlets in the ``killme`` list, and drop our
+     * references to them. This may run arbitrary Python code and
+     * switch threads or greenlets!
+     */
+    inline void kill_suspended_garbage(const bool murder=false)
+    {
+        if (this->killme.empty()) {
+            return;
+        }
+        deleteme_t copy = this->killme;
+        this->killme.clear();
+        for(deleteme_t::iterator it = copy.begin(), end = copy.end();
+            it != end;
+            ++it ) {
+            PyGreenlet* to_kill = *it;
+            Greenlet* const g = to_kill->pimpl;
+            if (murder) {
+                g->murder_in_place();
+            }
+            else if (g->is_currently_running_in_some_thread()) {
+                // Something found it and switched to it since. Kill
+                // it once it's suspended again; like a generator
+                // that's resurrected after being finalized, it's done.
+                this->killme.push_back(to_kill);
+                continue;
+            }
+            else if (g->active()) {
+                try {
+                    g->deallocing_greenlet_in_thread(this);
+                }
+                catch (const PyErrOccurred&) {
+                    PyErr_WriteUnraisable(reinterpret_cast<PyObject*>(to_kill));
+                }
+                if (g->active()) {
+                    /* It caught GreenletExit and kept going. Keep it
+                       alive (that is, leak it), as green_dealloc()
+                       does, so nothing it can still use gets cleared.
+                    */
+                    // Python 2 takes a char*.
+                    PyObject* f = PySys_GetObject(const_cast<char*>("stderr"));
+                    if (f != NULL) {
+                        PyFile_WriteString("GreenletExit did not kill ", f);
+                        PyFile_WriteObject(reinterpret_cast<PyObject*>(to_kill), f, 0);
+                        PyFile_WriteString("\n", f);
+                    }
+                    continue;
+                }
+            }
+            Py_DECREF(to_kill);
+            if (PyErr_Occurred()) {
+                PyErr_WriteUnraisable(nullptr);
+                PyErr_Clear();
+            }
+        }
+    }
+
+private:
+
 public:
 
     /**
@@ -315,6 +573,57 @@ public:
         }
     }
 
+    inline const OwnedGreenlet& get_spawn_trampoline() const
+    {
+        return this->spawn_trampoline;
+    }
+
+    inline void set_spawn_trampoline(const OwnedGreenlet& trampoline)
+    {
+        this->spawn_trampoline = trampoline;
+    }
+
+    /**
+     * Dropping what is probably the only reference to the trampoline
+     * kills it, which can run arbitrary Python code.
+     */
+    inline void clear_spawn_trampoline()
+    {
+        this->spawn_trampoline.CLEAR();
+    }
+
+    template<typename T, refs::TypeChecker TC>
+    inline bool is_spawn_trampoline(const refs::PyObjectPointer<T, TC>& obj) const
+    {
+        return this->spawn_trampoline
+            && this->spawn_trampoline.borrow_o() == obj.borrow_o();
+    }
+
+    /**
+     * Record that the current greenlet wants *target* started by the
+     * trampoline. The trampoline and the new greenlet each take their
+     * part of the request with the ``take_`` methods.
+     */
+    inline void request_spawn(const BorrowedGreenlet& target)
+    {
+        this->spawn_target = target;
+        this->spawn_requester = this->current_greenlet;
+    }
+
+    inline OwnedGreenlet take_spawn_target()
+    {
+        OwnedGreenlet result(this->spawn_target);
+        this->spawn_target.CLEAR();
+        return result;
+    }
+
+    inline OwnedGreenlet take_spawn_requester()
+    {
+        OwnedGreenlet result(this->spawn_requester);
+        this->spawn_requester.CLEAR();
+        return result;
+    }
+
     /**
      * Given a reference to a greenlet that some other thread
      * attempted to delete (has a refcount of 0) store it for later
@@ -326,6 +635,17 @@ public:
         this->deleteme.push_back(to_del);
     }
 
+    /**
+     * Given a suspended greenlet of this thread that only a garbage
+     * cycle refers to, keep it (and so the cycle) alive until
+     * kill_suspended_garbage().
+     */
+    inline void kill_when_collected(PyGreenlet* to_kill)
+    {
+        Py_INCREF(to_kill);
+        this->killme.push_back(to_kill);
+    }
+
     /**
      * Set to std::clock_t(-1) to disable.
      */
@@ -334,8 +654,96 @@ public:
         return ThreadState::_clocks_used_doing_gc;
     }
 
+    /**
+     * Called when *old_main_greenlet*, the main greenlet of a thread
+     * that has exited, has exactly one reference left and nothing we
+     * know of owns it.
+     *
+     * Highly likely that the reference is somewhere on the stack of
+     * a greenlet of that thread, which can never be unwound, so it's
+     * not reachable by GC. Verify that, and if so, drop it.
+     */
+    static void forget_unreachable_main_greenlet(PyGreenlet* old_main_greenlet)
+    {
+        if (ThreadState::_clocks_used_doing_gc == std::clock_t(-1)) {
+            return;
+        }
+        // XXX: This is O(n) in the total number of objects.
+        // TODO: Add a way to disable this at runtime, and
+        // another way to report on it.
+        std::clock_t begin = std::clock();
+        NewReference gc(PyImport_ImportModule("gc"));
+        if (gc) {
+            OwnedObject get_referrers = gc.PyRequireAttr(ThreadState::get_referrers_name);
+            OwnedList refs(get_referrers.PyCall(old_main_greenlet));
+            if (refs && refs.empty()) {
+                assert(refs.REFCNT() == 1);
+                // We found nothing! So we left a dangling
+                // reference: Probably the last thing some
+                // other greenlet did was call
+                // 'getcurrent().parent.switch()' to switch
+                // back to us. Clean it up. This will be the
+                // case on CPython 3.7 and newer, as they use
+                // an internal calling convertion that avoids
+                // creating method objects and storing them on
+                // the stack.
+                Py_DECREF(old_main_greenlet);
+            }
+            else if (refs
+                     && refs.size() == 1
+                     && PyCFunction_Check(refs.at(0))
+                     && Py_REFCNT(refs.at(0)) == 2) {
+                assert(refs.REFCNT() == 1);
+                // Ok, we found a C method that refers to the
+                // main greenlet, and its only referenced
+                // twice, once in the list we just created,
+                // once from...somewhere else. If we can't
+                // find where else, then this is a leak.
+                // This happens in older versions of CPython
+                // that create a bound method object somewhere
+                // on the stack that we'll never get back to.
+                if (PyCFunction_GetFunction(refs.at(0).borrow()) == (PyCFunction)green_switch) {
+                    BorrowedObject function_w = refs.at(0);
+                    refs.clear(); // destroy the reference
+                                  // from the list.
+                    // back to one reference. Can *it* be
+                    // found?
+                    assert(function_w.REFCNT() == 1);
+                    refs = get_referrers.PyCall(function_w);
+                    if (refs && refs.empty()) {
+                        // Nope, it can't be found so it won't
+                        // ever be GC'd. Drop it.
+                        Py_CLEAR(function_w);
+                    }
+                }
+            }
+            std::clock_t end = std::clock();
+            ThreadState::_clocks_used_doing_gc += (end - begin);
+        }
+    }
+
     ~ThreadState()
     {
+        // Greenlets that outlive us mustn't try to unlink themselves
+        // from our list, or account for their saved stacks in our
+        // stats.
+        while (this->registered_greenlets) {
+            this->registered_greenlets->stack_state.account_to(&MemoryStats::orphaned);
+            ThreadState::unregister_greenlet(this->registered_greenlets);
+        }
+        if (this->main_greenlet) {
+            this->main_greenlet->stack_state.account_to(&MemoryStats::orphaned);
+        }
+        if (this->prev_state) {
+            this->prev_state->next_state = this->next_state;
+        }
+        else {
+            ThreadState::all_states = this->next_state;
+        }
+        if (this->next_state) {
+            this->next_state->prev_state = this->prev_state;
+        }
+
         if (!PyInterpreterState_Head()) {
             // We shouldn't get here (our callers protect us)
             // but if we do, all we can do is bail early.
@@ -348,6 +756,9 @@ public:
         //assert(!this->switching_state.origin);
 
         this->tracefunc.CLEAR();
+        this->spawn_target.CLEAR();
+        this->spawn_requester.CLEAR();
+        this->spawn_trampoline.CLEAR();
 
         // Forcibly GC as much as we can.
         this->clear_deleteme_list(true);
@@ -370,62 +781,8 @@ public:
             PyGreenlet* old_main_greenlet = this->main_greenlet.borrow();
             Py_ssize_t cnt = this->main_greenlet.REFCNT();
             this->main_greenlet.CLEAR();
-            if (ThreadState::_clocks_used_doing_gc != std::clock_t(-1)
-                && cnt == 2 && Py_REFCNT(old_main_greenlet) == 1) {
-                // Highly likely that the reference is somewhere on
-                // the stack, not reachable by GC. Verify.
-                // XXX: This is O(n) in the total number of objects.
-                // TODO: Add a way to disable this at runtime, and
-                // another way to report on it.
-                std::clock_t begin = std::clock();
-                NewReference gc(PyImport_ImportModule("gc"));
-                if (gc) {
-                    OwnedObject get_referrers = gc.PyRequireAttr(ThreadState::get_referrers_name);
-                    OwnedList refs(get_referrers.PyCall(old_main_greenlet));
-                    if (refs && refs.empty()) {
-                        assert(refs.REFCNT() == 1);
-                        // We found nothing! So we left a dangling
-                        // reference: Probably the last thing some
-                        // other greenlet did was call
-                        // 'getcurrent().parent.switch()' to switch
-                        // back to us. Clean it up. This will be the
-                        // case on CPython 3.7 and newer, as they use
-                        // an internal calling convertion that avoids
-                        // creating method objects and storing them on
-                        // the stack.
-                        Py_DECREF(old_main_greenlet);
-                    }
-                    else if (refs
-                             && refs.size() == 1
-                             && PyCFunction_Check(refs.at(0))
-                             && Py_REFCNT(refs.at(0)) == 2) {
-                        assert(refs.REFCNT() == 1);
-                        // Ok, we found a C method that refers to the
-                        // main greenlet, and its only referenced
-                        // twice, once in the list we just created,
-                        // once from...somewhere else. If we can't
-                        // find where else, then this is a leak.
-                        // This happens in older versions of CPython
-                        // that create a bound method object somewhere
-                        // on the stack that we'll never get back to.
-                        if (PyCFunction_GetFunction(refs.at(0).borrow()) == (PyCFunction)green_switch) {
-                            BorrowedObject function_w = refs.at(0);
-                            refs.clear(); // destroy the reference
-                                          // from the list.
-                            // back to one reference. Can *it* be
-                            // found?
-                            assert(function_w.REFCNT() == 1);
-                            refs = get_referrers.PyCall(function_w);
-                            if (refs && refs.empty()) {
-                                // Nope, it can't be found so it won't
-                                // ever be GC'd. Drop it.
-                                Py_CLEAR(function_w);
-                            }
-                        }
-                    }
-                    std::clock_t end = std::clock();
-                    ThreadState::_clocks_used_doing_gc += (end - begin);
-                }
+            if (cnt == 2 && Py_REFCNT(old_main_greenlet) == 1) {
+                ThreadState::forget_unreachable_main_greenlet(old_main_greenlet);
             }
         }
 
@@ -467,6 +824,7 @@ public:
 ImmortalString ThreadState::get_referrers_name(nullptr);
 PythonAllocator<ThreadState> ThreadState::allocator;
 std::clock_t ThreadState::_clocks_used_doing_gc(0);
+ThreadState* ThreadState::all_states = nullptr;
 
 template<typename Destructor>
 class ThreadStateCreator
@@ -516,6 +874,18 @@ public:
         return *this->_state;
     }
 
+    /**
+     * The state, if this thread has one; never creates it. For use
+     * where creating it isn't allowed, like during garbage collection.
+     */
+    inline ThreadState* borrow_if_created() const
+    {
+        if (this->_state == (ThreadState*)1) {
+            return nullptr;
+        }
+        return this->_state;
+    }
+
     operator ThreadState&()
     {
         return this->state();
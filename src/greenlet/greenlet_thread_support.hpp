@@ -52,6 +52,7 @@ namespace greenlet {
 #    define G_THREAD_LOCAL_SUPPORTS_DESTRUCTOR 1
 #    include <thread>
 #    include <mutex>
+#    include <atomic>
 #    define G_THREAD_LOCAL_VAR thread_local
 namespace greenlet {
     typedef std::mutex Mutex;
@@ -0,0 +1,343 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+#ifndef GREENLET_TIMELINE_HPP
+#define GREENLET_TIMELINE_HPP
+/**
+ * Recording a timeline of which greenlet ran when, in each thread.
+ *
+ * While a timeline is being recorded, every switch appends a small
+ * fixed-size record (when, in which thread, to which greenlet) to a
+ * buffer allocated when recording starts, and every greenlet that
+ * starts adds a record naming it after the ``__qualname__`` of its
+ * ``run``. Nothing is allocated, formatted or written on the switch
+ * path: once a batch's worth of records is waiting, a pending call
+ * (``Py_AddPendingCall``) is scheduled to turn them into the spans
+ * each greenlet ran for and write them out, the next time the
+ * interpreter checks for pending calls. If that falls far behind (the
+ * main thread is blocked in C, say) and the buffer fills up, further
+ * records are dropped until it's written, and the number dropped is
+ * noted at the end of the file.
+ *
+ * The file is in the Chrome Trace Event format (JSON), which Perfetto
+ * (https://ui.perfetto.dev) and ``chrome://tracing`` can load. Each
+ * thread is a track, and each time a greenlet ran is a complete
+ * (``"ph": "X"``) event, with the greenlet's :func:`id` in its args.
+ *
+ * Everything here is protected by the GIL.
+ */
+
+#include <cstdio>
+#include <cerrno>
+#include <new>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <Python.h>
+
+#include "greenlet_compiler_compat.hpp"
+
+namespace greenlet {
+
+class Timeline
+{
+public:
+    // How many records to collect before scheduling a write.
+    static const size_t batch_size = 8192;
+    // How many can wait to be written; beyond that they're dropped.
+    static const size_t max_pending = batch_size * 8;
+
+private:
+    enum Kind {
+        // *greenlet* started running in *thread*.
+        RUN = 0,
+        // Likewise, and it's the thread's main greenlet.
+        RUN_MAIN = 1,
+        // *greenlet* is named ``names[name]``.
+        NAME = 2
+    };
+
+    struct Record
+    {
+        uint64_t timestamp;
+        uintptr_t thread;
+        uintptr_t greenlet;
+        uint32_t name;
+        uint32_t kind;
+    };
+
+    // What's running in each thread, as of the records written so far.
+    struct Track
+    {
+        unsigned tid;
+        uintptr_t greenlet;
+        uint64_t since;
+    };
+
+    typedef std::unordered_map<uintptr_t, Track> tracks_t;
+    typedef std::unordered_map<uintptr_t, std::string> names_t;
+
+    static FILE* file;
+    static uint64_t started_at;
+    static bool write_scheduled;
+    static bool wrote_event;
+    // The records that haven't been written (``max_pending`` of
+    // them, ``nrecords`` in use), and the names they refer to.
+    static Record* records;
+    static size_t nrecords;
+    static size_t ndropped;
+    static std::vector<std::string>* pending_names;
+    static tracks_t* tracks;
+    static names_t* names;
+
+    static void write_string(const std::string& s)
+    {
+        putc('"', Timeline::file);
+        for (std::string::const_iterator it = s.begin(); it != s.end(); ++it) {
+            const unsigned char c = *it;
+            if (c == '"' || c == '\\') {
+                putc('\\', Timeline::file);
+                putc(c, Timeline::file);
+            }
+            else if (c < 0x20) {
+                fprintf(Timeline::file, "\\u%04x", c);
+            }
+            else {
+                putc(c, Timeline::file);
+            }
+        }
+        putc('"', Timeline::file);
+    }
+
+    static void write_separator()
+    {
+        fputs(Timeline::wrote_event ? ",\n" : "\n", Timeline::file);
+        Timeline::wrote_event = true;
+    }
+
+    static void write_span(const Track& track, const uint64_t until)
+    {
+        if (!track.greenlet) {
+            return;
+        }
+        Timeline::write_separator();
+        fputs("{\"name\":", Timeline::file);
+        names_t::const_iterator name = Timeline::names->find(track.greenlet);
+        if (name != Timeline::names->end()) {
+            Timeline::write_string(name->second);
+        }
+        else {
+            fprintf(Timeline::file, "\"greenlet %p\"", reinterpret_cast<void*>(track.greenlet));
+        }
+        // Times are in microseconds.
+        const uint64_t ts = track.since - Timeline::started_at;
+        const uint64_t dur = until - track.since;
+        fprintf(Timeline::file,
+                ",\"cat\":\"greenlet\",\"ph\":\"X\",\"ts\":%llu.%03u,\"dur\":%llu.%03u,"
+                "\"pid\":1,\"tid\":%u,\"args\":{\"id\":%llu}}",
+                static_cast<unsigned long long>(ts / 1000), static_cast<unsigned>(ts % 1000),
+                static_cast<unsigned long long>(dur / 1000), static_cast<unsigned>(dur % 1000),
+                track.tid,
+                static_cast<unsigned long long>(track.greenlet));
+    }
+
+    static inline void append(const uint64_t timestamp, const void* const thread,
+                              const void* const greenlet, const size_t name, const Kind kind) G_NOEXCEPT
+    {
+        if (Timeline::nrecords == Timeline::max_pending) {
+            Timeline::ndropped++;
+            return;
+        }
+        Record& record = Timeline::records[Timeline::nrecords++];
+        record.timestamp = timestamp;
+        record.thread = reinterpret_cast<uintptr_t>(thread);
+        record.greenlet = reinterpret_cast<uintptr_t>(greenlet);
+        record.name = static_cast<uint32_t>(name);
+        record.kind = kind;
+        if (Timeline::nrecords >= Timeline::batch_size && !Timeline::write_scheduled) {
+            Timeline::write_scheduled = Py_AddPendingCall(Timeline::write_scheduled_batch,
+                                                          nullptr) == 0;
+        }
+    }
+
+    static int write_scheduled_batch(void* UNUSED(arg))
+    {
+        Timeline::write_scheduled = false;
+        if (Timeline::file && !Timeline::write_batch()) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        return 0;
+    }
+
+    /**
+     * Turn the records collected so far into spans and write them.
+     * Returns false if there's no memory to keep track of them.
+     */
+    static bool write_batch()
+    {
+        try {
+            Timeline::write_records();
+        }
+        catch (const std::bad_alloc&) {
+            Timeline::nrecords = 0;
+            Timeline::pending_names->clear();
+            return false;
+        }
+        return true;
+    }
+
+    static void write_records()
+    {
+        for (size_t i = 0; i < Timeline::nrecords; i++) {
+            const Record& record = Timeline::records[i];
+            if (record.kind == NAME) {
+                (*Timeline::names)[record.greenlet] = (*Timeline::pending_names)[record.name];
+                continue;
+            }
+            tracks_t::iterator found = Timeline::tracks->find(record.thread);
+            if (found == Timeline::tracks->end()) {
+                const Track track = {static_cast<unsigned>(Timeline::tracks->size() + 1), 0, 0};
+                found = Timeline::tracks->insert(std::make_pair(record.thread, track)).first;
+                Timeline::write_separator();
+                fprintf(Timeline::file,
+                        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                        "\"args\":{\"name\":\"thread %u\"}}",
+                        track.tid, track.tid);
+            }
+            Track& track = found->second;
+            Timeline::write_span(track, record.timestamp);
+            track.greenlet = record.greenlet;
+            track.since = record.timestamp;
+            if (record.kind == RUN_MAIN
+                && Timeline::names->find(record.greenlet) == Timeline::names->end()) {
+                (*Timeline::names)[record.greenlet] = "main";
+            }
+        }
+        Timeline::nrecords = 0;
+        Timeline::pending_names->clear();
+        fflush(Timeline::file);
+    }
+
+public:
+    static inline bool enabled()
+    {
+        return Timeline::file != nullptr;
+    }
+
+    /**
+     * Start writing a timeline to *path*, beginning with *current*
+     * running in *thread* at *now*. Returns false with errno set if
+     * *path* can't be opened.
+     */
+    static bool start(const char* const path, const uint64_t now,
+                      const void* const thread, const void* const current, const bool main)
+    {
+        FILE* f = fopen(path, "w");
+        if (!f) {
+            return false;
+        }
+        Timeline::records = new (std::nothrow) Record[Timeline::max_pending];
+        if (!Timeline::records) {
+            fclose(f);
+            errno = ENOMEM;
+            return false;
+        }
+        // Write in large chunks.
+        setvbuf(f, nullptr, _IOFBF, 1 << 16);
+        Timeline::file = f;
+        Timeline::started_at = now;
+        Timeline::wrote_event = false;
+        Timeline::nrecords = 0;
+        Timeline::ndropped = 0;
+        Timeline::pending_names = new std::vector<std::string>();
+        Timeline::tracks = new tracks_t();
+        Timeline::names = new names_t();
+        fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", f);
+        Timeline::write_separator();
+        fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"greenlet\"}}", f);
+        Timeline::running(now, thread, current, main);
+        return true;
+    }
+
+    /**
+     * Finish and close the file, ending every thread's last span at
+     * *now*. Returns false with errno set if writing failed at any
+     * point.
+     */
+    static bool stop(const uint64_t now)
+    {
+        if (!Timeline::file) {
+            return true;
+        }
+        const bool wrote_all = Timeline::write_batch();
+        for (tracks_t::const_iterator it = Timeline::tracks->begin();
+             it != Timeline::tracks->end();
+             ++it) {
+            Timeline::write_span(it->second, now);
+        }
+        fprintf(Timeline::file, "\n],\"otherData\":{\"dropped_records\":%llu}}\n",
+                static_cast<unsigned long long>(Timeline::ndropped));
+        const bool failed = ferror(Timeline::file);
+        const bool close_failed = fclose(Timeline::file) != 0;
+        Timeline::file = nullptr;
+        delete[] Timeline::records;
+        delete Timeline::pending_names;
+        delete Timeline::tracks;
+        delete Timeline::names;
+        Timeline::records = nullptr;
+        Timeline::pending_names = nullptr;
+        Timeline::tracks = nullptr;
+        Timeline::names = nullptr;
+        if (!wrote_all) {
+            errno = ENOMEM;
+            return false;
+        }
+        if (failed && !close_failed) {
+            errno = EIO;
+        }
+        return !(failed || close_failed);
+    }
+
+    /**
+     * Record that *greenlet* is now running in *thread*.
+     */
+    static inline void running(const uint64_t now, const void* const thread,
+                               const void* const greenlet, const bool main) G_NOEXCEPT
+    {
+        Timeline::append(now, thread, greenlet, 0, main ? RUN_MAIN : RUN);
+    }
+
+    /**
+     * Record that *greenlet* is about to start running a callable
+     * named *name*.
+     */
+    static void started(const uint64_t now, const void* const greenlet, const std::string& name) G_NOEXCEPT
+    {
+        if (Timeline::nrecords == Timeline::max_pending) {
+            Timeline::ndropped++;
+            return;
+        }
+        try {
+            Timeline::pending_names->push_back(name);
+        }
+        catch (const std::bad_alloc&) {
+            // It'll be called "greenlet 0x...".
+            return;
+        }
+        Timeline::append(now, nullptr, greenlet, Timeline::pending_names->size() - 1, NAME);
+    }
+};
+
+FILE* Timeline::file = nullptr;
+uint64_t Timeline::started_at = 0;
+bool Timeline::write_scheduled = false;
+bool Timeline::wrote_event = false;
+Timeline::Record* Timeline::records = nullptr;
+size_t Timeline::nrecords = 0;
+size_t Timeline::ndropped = 0;
+std::vector<std::string>* Timeline::pending_names = nullptr;
+Timeline::tracks_t* Timeline::tracks = nullptr;
+Timeline::names_t* Timeline::names = nullptr;
+
+}; // namespace greenlet
+
+#endif
@@ -0,0 +1,187 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+#ifndef GREENLET_WATCHDOG_HPP
+#define GREENLET_WATCHDOG_HPP
+/**
+ * A background thread that looks for greenlets that have run too
+ * long without switching.
+ *
+ * In a cooperative program, one greenlet that never yields stops all
+ * the others in its thread. While this is running, it sets
+ * ``SwitchLog::clock_wanted``, so each ThreadState remembers when it
+ * last switched, and finding such a greenlet only needs another
+ * thread to compare that with the time every so often. That's this one: a
+ * native thread that wakes up a few times per threshold, takes the
+ * GIL, and calls ``check`` with the current time and the threshold.
+ * What to do about stuck greenlets is up to ``check``.
+ *
+ * The thread needs to be able to take the GIL, so it can see
+ * greenlets that are running Python code or blocking with the GIL
+ * released, but not ones that hold the GIL in a long C call.
+ *
+ * This uses ``PyThread_acquire_lock_timed``, which Python 2 doesn't
+ * have.
+ */
+
+#include <Python.h>
+#include "pythread.h"
+
+#include "greenlet_compiler_compat.hpp"
+#include "greenlet_switch_log.hpp"
+
+#ifndef G_USE_WATCHDOG
+#    if PY_MAJOR_VERSION >= 3
+#        define G_USE_WATCHDOG 1
+#    else
+#        define G_USE_WATCHDOG 0
+#    endif
+#endif
+
+#if G_USE_WATCHDOG
+namespace greenlet {
+
+class Watchdog
+{
+public:
+    typedef void (*check_t)(uint64_t now, uint64_t threshold);
+
+private:
+    // Held while the thread should keep running; releasing it wakes
+    // the thread up and tells it to exit.
+    static PyThread_type_lock stop_lock;
+    // Held while the thread is running; it releases it as it exits.
+    static PyThread_type_lock exited_lock;
+    static bool _running;
+    static unsigned long ident;
+    static check_t check;
+    // Nanoseconds. Only changed while holding the GIL.
+    static uint64_t threshold;
+
+    static PY_TIMEOUT_T interval_for(const uint64_t threshold)
+    {
+        // Check four times per threshold, so a greenlet is reported
+        // at most 25% later than it should be, but not more often
+        // than every millisecond.
+        const uint64_t interval = threshold / 4 / 1000;
+        return interval < 1000 ? 1000 : static_cast<PY_TIMEOUT_T>(interval);
+    }
+
+    static void run(void* UNUSED(arg))
+    {
+        PyGILState_STATE gstate = PyGILState_Ensure();
+        PY_TIMEOUT_T interval = Watchdog::interval_for(Watchdog::threshold);
+        PyGILState_Release(gstate);
+
+        for (;;) {
+            if (PyThread_acquire_lock_timed(Watchdog::stop_lock, interval, 0) == PY_LOCK_ACQUIRED) {
+                PyThread_release_lock(Watchdog::stop_lock);
+                break;
+            }
+            gstate = PyGILState_Ensure();
+            if (Watchdog::_running) {
+                Watchdog::check(SwitchLog::now(), Watchdog::threshold);
+            }
+            // ``check`` may have stopped us.
+            const bool stopped = !Watchdog::_running;
+            if (stopped) {
+                Watchdog::ident = 0;
+            }
+            interval = Watchdog::interval_for(Watchdog::threshold);
+            PyGILState_Release(gstate);
+            if (stopped) {
+                break;
+            }
+        }
+        PyThread_release_lock(Watchdog::exited_lock);
+    }
+
+public:
+    static inline bool running()
+    {
+        return Watchdog::_running;
+    }
+
+    /**
+     * Whether this is the watchdog's thread.
+     */
+    static inline bool in_thread()
+    {
+        // Before 3.7, the ident is a (signed) long.
+        return Watchdog::ident
+            && Watchdog::ident == static_cast<unsigned long>(PyThread_get_thread_ident());
+    }
+
+    /**
+     * Start the thread, or if it's already running, change what it
+     * looks for. Must hold the GIL, and not be the watchdog's
+     * thread. Returns false if the thread couldn't be started.
+     */
+    static bool start(const uint64_t threshold, const check_t check)
+    {
+        Watchdog::threshold = threshold;
+        Watchdog::check = check;
+        if (Watchdog::_running) {
+            return true;
+        }
+        if (!Watchdog::stop_lock) {
+            Watchdog::stop_lock = PyThread_allocate_lock();
+            Watchdog::exited_lock = PyThread_allocate_lock();
+            if (!Watchdog::stop_lock || !Watchdog::exited_lock) {
+                return false;
+            }
+        }
+        PyThread_acquire_lock(Watchdog::stop_lock, WAIT_LOCK);
+        // If ``check`` stopped the last thread, it may still be
+        // finishing up, and it needs the GIL to do that.
+        Py_BEGIN_ALLOW_THREADS;
+        PyThread_acquire_lock(Watchdog::exited_lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS;
+        // Before 3.7, this returned a signed -1 on failure.
+        const unsigned long ident = static_cast<unsigned long>(
+            PyThread_start_new_thread(Watchdog::run, nullptr));
+        if (ident == static_cast<unsigned long>(-1)) {
+            PyThread_release_lock(Watchdog::exited_lock);
+            PyThread_release_lock(Watchdog::stop_lock);
+            return false;
+        }
+        Watchdog::ident = ident;
+        Watchdog::_running = true;
+        SwitchLog::clock_wanted = true;
+        return true;
+    }
+
+    /**
+     * Stop the thread and wait for it to exit. Must hold the GIL,
+     * which is released while waiting. From the watchdog's own
+     * thread (that is, from ``check``), this doesn't wait; the thread
+     * exits once ``check`` returns.
+     */
+    static void stop()
+    {
+        if (!Watchdog::_running) {
+            return;
+        }
+        Watchdog::_running = false;
+        SwitchLog::clock_wanted = false;
+        PyThread_release_lock(Watchdog::stop_lock);
+        if (Watchdog::in_thread()) {
+            return;
+        }
+        Py_BEGIN_ALLOW_THREADS;
+        PyThread_acquire_lock(Watchdog::exited_lock, WAIT_LOCK);
+        PyThread_release_lock(Watchdog::exited_lock);
+        Py_END_ALLOW_THREADS;
+        Watchdog::ident = 0;
+    }
+};
+
+PyThread_type_lock Watchdog::stop_lock = nullptr;
+PyThread_type_lock Watchdog::exited_lock = nullptr;
+bool Watchdog::_running = false;
+unsigned long Watchdog::ident = 0;
+Watchdog::check_t Watchdog::check = nullptr;
+uint64_t Watchdog::threshold = 0;
+
+}; // namespace greenlet
+#endif // G_USE_WATCHDOG
+
+#endif
@@ -0,0 +1,483 @@
+/* Microbenchmarks that drive greenlets through the C API, without
+ * running any Python code in the loops being timed, so that what's
+ * measured is greenlet itself. See ``benchmarks/c_api.py``.
+ *
+ * Each benchmark function takes a number of loops (and maybe a
+ * parameter), and returns the elapsed time in seconds, in the form
+ * that ``pyperf.Runner.bench_time_func`` wants.
+ */
+
+#include <chrono>
+
+#include "../greenlet.h"
+#include "../greenlet_compiler_compat.hpp"
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double
+seconds_since(const bench_clock::time_point& begin)
+{
+    return std::chrono::duration<double>(bench_clock::now() - begin).count();
+}
+
+/* The Python callables our greenlets run; each is a C function. */
+static PyObject* pong_run;
+static PyObject* deep_pong_run;
+static PyObject* link_run;
+static PyObject* empty_run;
+static PyObject* catcher_run;
+
+/* Functions are called via pointers to prevent inlining */
+static PyObject* (*p_deep_pong)(int depth, long count);
+
+/**
+ * Switch to our parent *count* times.
+ */
+static PyObject*
+pong_loop(long count)
+{
+    PyGreenlet* self = PyGreenlet_GetCurrent();
+    PyGreenlet* parent = PyGreenlet_GET_PARENT(self);
+    Py_DECREF(self);
+    for (long i = 0; i < count; i++) {
+        PyObject* result = PyGreenlet_Switch(parent, NULL, NULL);
+        if (result == NULL) {
+            return NULL;
+        }
+        Py_DECREF(result);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+pong(PyObject* UNUSED(self), PyObject* args)
+{
+    long count;
+    if (!PyArg_ParseTuple(args, "l", &count)) {
+        return NULL;
+    }
+    return pong_loop(count);
+}
+
+static PyObject*
+deep_pong_recurse(int depth, long count)
+{
+    // Give each frame something on the stack that the compiler
+    // can't throw away.
+    volatile char frame[128];
+    frame[0] = static_cast<char>(depth);
+    if (depth > 0) {
+        PyObject* result = p_deep_pong(depth - 1, count);
+        frame[sizeof(frame) - 1] = frame[0];
+        return result;
+    }
+    return pong_loop(count);
+}
+
+static PyObject*
+deep_pong(PyObject* UNUSED(self), PyObject* args)
+{
+    int depth;
+    long count;
+    if (!PyArg_ParseTuple(args, "il", &depth, &count)) {
+        return NULL;
+    }
+    return p_deep_pong(depth, count);
+}
+
+/**
+ * Wait for a value from our parent, and pass it, plus one, to the
+ * *next* greenlet.
+ */
+static PyObject*
+link(PyObject* UNUSED(self), PyObject* args)
+{
+    PyGreenlet* next;
+    if (!PyArg_ParseTuple(args, "O!", &PyGreenlet_Type, &next)) {
+        return NULL;
+    }
+    PyGreenlet* self = PyGreenlet_GetCurrent();
+    PyObject* value = PyGreenlet_Switch(PyGreenlet_GET_PARENT(self), NULL, NULL);
+    Py_DECREF(self);
+    if (value == NULL) {
+        return NULL;
+    }
+    const long incremented = PyLong_AsLong(value) + 1;
+    Py_DECREF(value);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    PyObject* switch_args = Py_BuildValue("(l)", incremented);
+    if (switch_args == NULL) {
+        return NULL;
+    }
+    PyObject* result = PyGreenlet_Switch(next, switch_args, NULL);
+    Py_DECREF(switch_args);
+    return result;
+}
+
+static PyObject*
+empty(PyObject* UNUSED(self), PyObject* UNUSED(args))
+{
+    Py_RETURN_NONE;
+}
+
+/**
+ * Switch to our parent *count* times, expecting it to throw
+ * ValueError into us each time.
+ */
+static PyObject*
+catcher(PyObject* UNUSED(self), PyObject* args)
+{
+    long count;
+    if (!PyArg_ParseTuple(args, "l", &count)) {
+        return NULL;
+    }
+    PyGreenlet* self = PyGreenlet_GetCurrent();
+    PyGreenlet* parent = PyGreenlet_GET_PARENT(self);
+    Py_DECREF(self);
+    for (long i = 0; i < count; i++) {
+        PyObject* result = PyGreenlet_Switch(parent, NULL, NULL);
+        if (result != NULL) {
+            Py_DECREF(result);
+            PyErr_SetString(PyExc_AssertionError, "Expected an exception to be thrown");
+            return NULL;
+        }
+        if (!PyErr_ExceptionMatches(PyExc_ValueError)) {
+            return NULL;
+        }
+        PyErr_Clear();
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef run_methods[] = {
+    {"pong", (PyCFunction)&pong, METH_VARARGS, NULL},
+    {"deep_pong", (PyCFunction)&deep_pong, METH_VARARGS, NULL},
+    {"link", (PyCFunction)&link, METH_VARARGS, NULL},
+    {"empty", (PyCFunction)&empty, METH_VARARGS, NULL},
+    {"catcher", (PyCFunction)&catcher, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}};
+
+/**
+ * Start a new greenlet running *run* with *args*, where it will
+ * switch straight back to us, and return it.
+ */
+static PyGreenlet*
+start(PyObject* run, PyObject* args)
+{
+    PyGreenlet* glet = PyGreenlet_New(run, NULL);
+    if (glet == NULL) {
+        return NULL;
+    }
+    PyObject* result = PyGreenlet_Switch(glet, args, NULL);
+    if (result == NULL) {
+        Py_DECREF(glet);
+        return NULL;
+    }
+    Py_DECREF(result);
+    return glet;
+}
+
+/**
+ * Switch into *glet*, which switches straight back, *loops* times,
+ * and then once more to let it finish. Return the time the loops
+ * took.
+ */
+static PyObject*
+time_switches_into(PyGreenlet* glet, long loops)
+{
+    const bench_clock::time_point begin = bench_clock::now();
+    for (long i = 0; i < loops; i++) {
+        PyObject* result = PyGreenlet_Switch(glet, NULL, NULL);
+        if (result == NULL) {
+            return NULL;
+        }
+        Py_DECREF(result);
+    }
+    const double elapsed = seconds_since(begin);
+    PyObject* result = PyGreenlet_Switch(glet, NULL, NULL);
+    if (result == NULL) {
+        return NULL;
+    }
+    Py_DECREF(result);
+    return PyFloat_FromDouble(elapsed);
+}
+
+static PyObject*
+bench_ping_pong(PyObject* UNUSED(self), PyObject* args)
+{
+    long loops;
+    if (!PyArg_ParseTuple(args, "l", &loops)) {
+        return NULL;
+    }
+    // Starting it takes one of its switches.
+    PyObject* run_args = Py_BuildValue("(l)", loops + 1);
+    if (run_args == NULL) {
+        return NULL;
+    }
+    PyGreenlet* glet = start(pong_run, run_args);
+    Py_DECREF(run_args);
+    if (glet == NULL) {
+        return NULL;
+    }
+    PyObject* result = time_switches_into(glet, loops);
+    Py_DECREF(glet);
+    return result;
+}
+
+static PyObject*
+bench_deep_switch(PyObject* UNUSED(self), PyObject* args)
+{
+    long loops;
+    int depth;
+    if (!PyArg_ParseTuple(args, "li", &loops, &depth)) {
+        return NULL;
+    }
+    PyObject* run_args = Py_BuildValue("(il)", depth, loops + 1);
+    if (run_args == NULL) {
+        return NULL;
+    }
+    PyGreenlet* glet = start(deep_pong_run, run_args);
+    Py_DECREF(run_args);
+    if (glet == NULL) {
+        return NULL;
+    }
+    PyObject* result = time_switches_into(glet, loops);
+    Py_DECREF(glet);
+    return result;
+}
+
+static PyObject*
+bench_chain(PyObject* UNUSED(self), PyObject* args)
+{
+    long loops;
+    long length;
+    if (!PyArg_ParseTuple(args, "ll", &loops, &length)) {
+        return NULL;
+    }
+    const bench_clock::time_point begin = bench_clock::now();
+    for (long i = 0; i < loops; i++) {
+        PyGreenlet* start_node = PyGreenlet_GetCurrent();
+        for (long j = 0; j < length; j++) {
+            PyObject* run_args = PyTuple_Pack(1, reinterpret_cast<PyObject*>(start_node));
+            PyGreenlet* glet = run_args ? start(link_run, run_args) : NULL;
+            Py_XDECREF(run_args);
+            Py_DECREF(start_node);
+            if (glet == NULL) {
+                return NULL;
+            }
+            start_node = glet;
+        }
+        PyObject* zero = Py_BuildValue("(i)", 0);
+        PyObject* result = zero ? PyGreenlet_Switch(start_node, zero, NULL) : NULL;
+        Py_XDECREF(zero);
+        Py_DECREF(start_node);
+        if (result == NULL) {
+            return NULL;
+        }
+        const long value = PyLong_AsLong(result);
+        Py_DECREF(result);
+        if (value != length) {
+            if (!PyErr_Occurred()) {
+                PyErr_Format(PyExc_AssertionError, "Expected %ld, got %ld", length, value);
+            }
+            return NULL;
+        }
+    }
+    return PyFloat_FromDouble(seconds_since(begin));
+}
+
+static PyObject*
+bench_create_destroy(PyObject* UNUSED(self), PyObject* args)
+{
+    long loops;
+    if (!PyArg_ParseTuple(args, "l", &loops)) {
+        return NULL;
+    }
+    const bench_clock::time_point begin = bench_clock::now();
+    for (long i = 0; i < loops; i++) {
+        PyGreenlet* glet = PyGreenlet_New(empty_run, NULL);
+        if (glet == NULL) {
+            return NULL;
+        }
+        Py_DECREF(glet);
+    }
+    return PyFloat_FromDouble(seconds_since(begin));
+}
+
+static PyObject*
+bench_spawn(PyObject* UNUSED(self), PyObject* args)
+{
+    long loops;
+    if (!PyArg_ParseTuple(args, "l", &loops)) {
+        return NULL;
+    }
+    const bench_clock::time_point begin = bench_clock::now();
+    for (long i = 0; i < loops; i++) {
+        PyGreenlet* glet = PyGreenlet_New(empty_run, NULL);
+        if (glet == NULL) {
+            return NULL;
+        }
+        PyObject* result = PyGreenlet_Switch(glet, NULL, NULL);
+        Py_DECREF(glet);
+        if (result == NULL) {
+            return NULL;
+        }
+        Py_DECREF(result);
+    }
+    return PyFloat_FromDouble(seconds_since(begin));
+}
+
+static PyObject*
+native_empty(void* UNUSED(arg), PyObject* UNUSED(first_value))
+{
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+bench_spawn_native(PyObject* UNUSED(self), PyObject* args)
+{
+    long loops;
+    if (!PyArg_ParseTuple(args, "l", &loops)) {
+        return NULL;
+    }
+    const bench_clock::time_point begin = bench_clock::now();
+    for (long i = 0; i < loops; i++) {
+        PyGreenlet* glet = PyGreenlet_NewNative(native_empty, NULL, NULL);
+        if (glet == NULL) {
+            return NULL;
+        }
+        PyObject* result = PyGreenlet_SwitchNoArgs(glet);
+        Py_DECREF(glet);
+        if (result == NULL) {
+            return NULL;
+        }
+        Py_DECREF(result);
+    }
+    return PyFloat_FromDouble(seconds_since(begin));
+}
+
+static PyObject*
+bench_throw(PyObject* UNUSED(self), PyObject* args)
+{
+    long loops;
+    if (!PyArg_ParseTuple(args, "l", &loops)) {
+        return NULL;
+    }
+    PyObject* run_args = Py_BuildValue("(l)", loops);
+    if (run_args == NULL) {
+        return NULL;
+    }
+    PyGreenlet* glet = start(catcher_run, run_args);
+    Py_DECREF(run_args);
+    if (glet == NULL) {
+        return NULL;
+    }
+    const bench_clock::time_point begin = bench_clock::now();
+    for (long i = 0; i < loops; i++) {
+        PyObject* result = PyGreenlet_Throw(glet, PyExc_ValueError, NULL, NULL);
+        if (result == NULL) {
+            Py_DECREF(glet);
+            return NULL;
+        }
+        Py_DECREF(result);
+    }
+    const double elapsed = seconds_since(begin);
+    Py_DECREF(glet);
+    return PyFloat_FromDouble(elapsed);
+}
+
+static PyMethodDef bench_methods[] = {
+    {"ping_pong",
+     (PyCFunction)&bench_ping_pong,
+     METH_VARARGS,
+     "ping_pong(loops) -> seconds\n\n"
+     "Switch into a greenlet that switches straight back, *loops* times."},
+    {"deep_switch",
+     (PyCFunction)&bench_deep_switch,
+     METH_VARARGS,
+     "deep_switch(loops, depth) -> seconds\n\n"
+     "Like ping_pong, but the greenlet first recurses *depth* C frames (of\n"
+     "at least 128 bytes), so every switch saves and restores its stack."},
+    {"chain",
+     (PyCFunction)&bench_chain,
+     METH_VARARGS,
+     "chain(loops, length) -> seconds\n\n"
+     "Start a chain of *length* greenlets and pass a value down it, counting\n"
+     "as it goes, *loops* times."},
+    {"create_destroy",
+     (PyCFunction)&bench_create_destroy,
+     METH_VARARGS,
+     "create_destroy(loops) -> seconds\n\n"
+     "Create and destroy a greenlet that never starts, *loops* times."},
+    {"spawn",
+     (PyCFunction)&bench_spawn,
+     METH_VARARGS,
+     "spawn(loops) -> seconds\n\n"
+     "Create a greenlet, run it until it finishes, and destroy it, *loops* times."},
+    {"spawn_native",
+     (PyCFunction)&bench_spawn_native,
+     METH_VARARGS,
+     "spawn_native(loops) -> seconds\n\n"
+     "Like spawn(), but the greenlet runs a C function, from PyGreenlet_NewNative()."},
+    {"throw",
+     (PyCFunction)&bench_throw,
+     METH_VARARGS,
+     "throw(loops) -> seconds\n\n"
+     "Throw an exception into a greenlet that catches it and switches back,\n"
+     "*loops* times."},
+    {NULL, NULL, 0, NULL}};
+
+#if PY_MAJOR_VERSION >= 3
+#    define INITERROR return NULL
+
+static struct PyModuleDef moduledef = {PyModuleDef_HEAD_INIT,
+                                       "greenlet.tests._bench_extension_cpp",
+                                       NULL,
+                                       0,
+                                       bench_methods,
+                                       NULL,
+                                       NULL,
+                                       NULL,
+                                       NULL};
+
+PyMODINIT_FUNC
+PyInit__bench_extension_cpp(void)
+#else
+#    define INITERROR return
+PyMODINIT_FUNC
+init_bench_extension_cpp(void)
+#endif
+{
+    PyObject* module = NULL;
+
+#if PY_MAJOR_VERSION >= 3
+    module = PyModule_Create(&moduledef);
+#else
+    module = Py_InitModule("greenlet.tests._bench_extension_cpp", bench_methods);
+#endif
+
+    if (module == NULL) {
+        INITERROR;
+    }
+
+    PyGreenlet_Import();
+    if (_PyGreenlet_API == NULL) {
+        INITERROR;
+    }
+
+    PyObject** const runs[] = {&pong_run, &deep_pong_run, &link_run, &empty_run, &catcher_run};
+    for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+        *runs[i] = PyCFunction_New(&run_methods[i], NULL);
+        if (*runs[i] == NULL) {
+            INITERROR;
+        }
+    }
+
+    p_deep_pong = deep_pong_recurse;
+
+#if PY_MAJOR_VERSION >= 3
+    return module;
+#endif
+}
@@ -162,6 +162,111 @@ test_throw_exact(PyObject* self, PyObject* args)
     Py_RETURN_NONE;
 }
 
+static PyObject*
+test_enumerate(PyObject* self, PyObject* args)
+{
+    PyGreenlet* thread = NULL;
+
+    if (!PyArg_ParseTuple(args, "|O!:test_enumerate", &PyGreenlet_Type, &thread)) {
+        return NULL;
+    }
+    return PyGreenlet_Enumerate(thread);
+}
+
+static PyObject*
+test_switch_value(PyObject* self, PyObject* args)
+{
+    PyGreenlet* g = NULL;
+    PyObject* value = NULL;
+
+    if (!PyArg_ParseTuple(args, "O!O:test_switch_value", &PyGreenlet_Type, &g, &value)) {
+        return NULL;
+    }
+    return PyGreenlet_SwitchValue(g, value);
+}
+
+static PyObject*
+test_switch_no_args(PyObject* self, PyObject* greenlet)
+{
+    if (!PyGreenlet_Check(greenlet)) {
+        PyErr_BadArgument();
+        return NULL;
+    }
+    return PyGreenlet_SwitchNoArgs((PyGreenlet*)greenlet);
+}
+
+static PyObject*
+native_call(void* arg, PyObject* first_value)
+{
+    return PyObject_CallFunctionObjArgs((PyObject*)arg, first_value, NULL);
+}
+
+static PyObject*
+native_bounce(void* arg, PyObject* first_value)
+{
+    /* Send the first value back to the parent, and return what comes
+       back the next time. */
+    PyGreenlet* current = PyGreenlet_GetCurrent();
+    PyGreenlet* parent = PyGreenlet_GET_PARENT(current);
+    PyObject* result = NULL;
+    Py_DECREF(current);
+    if (parent == NULL) {
+        return NULL;
+    }
+    result = PyGreenlet_SwitchValue(parent, first_value);
+    Py_DECREF(parent);
+    return result;
+}
+
+static PyObject*
+test_new_native(PyObject* self, PyObject* args)
+{
+    PyObject* callable = NULL;
+    PyGreenlet* parent = NULL;
+    PyGreenlet* g = NULL;
+
+    if (!PyArg_ParseTuple(args, "O|O!:test_new_native", &callable, &PyGreenlet_Type, &parent)) {
+        return NULL;
+    }
+    if (callable == Py_None) {
+        return (PyObject*)PyGreenlet_NewNative(native_bounce, NULL, parent);
+    }
+    g = PyGreenlet_NewNative(native_call, callable, parent);
+    /* The greenlet doesn't own its argument, so keep it alive. */
+    if (g != NULL && PyObject_SetAttrString((PyObject*)g, "native_arg", callable) < 0) {
+        Py_CLEAR(g);
+    }
+    return (PyObject*)g;
+}
+
+static PyObject*
+test_api_version(PyObject* self)
+{
+    return Py_BuildValue("(ll)", _PyGreenlet_API_version, (long)PyGreenlet_API_VERSION);
+}
+
+static PyObject*
+test_import_keeps_error(PyObject* self)
+{
+    /* Importing again must leave an exception that was already set
+       alone. */
+    void** const api = _PyGreenlet_API;
+    const long version = _PyGreenlet_API_version;
+    PyErr_SetString(PyExc_KeyError, "kept");
+    PyGreenlet_Import();
+    if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_AssertionError, "PyGreenlet_Import() lost the exception");
+    }
+    else if (_PyGreenlet_API != api || _PyGreenlet_API_version != version) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_AssertionError, "PyGreenlet_Import() found something else");
+    }
+    _PyGreenlet_API = api;
+    _PyGreenlet_API_version = version;
+    return NULL;
+}
+
 static PyMethodDef test_methods[] = {
     {"test_switch",
      (PyCFunction)test_switch,
@@ -200,6 +305,32 @@ static PyMethodDef test_methods[] = {
      (PyCFunction)test_throw_exact,
      METH_VARARGS,
      "Throw exactly the arguments given at the provided greenlet"},
+    {"test_enumerate",
+     (PyCFunction)test_enumerate,
+     METH_VARARGS,
+     "Test PyGreenlet_Enumerate()"},
+    {"test_switch_value",
+     (PyCFunction)test_switch_value,
+     METH_VARARGS,
+     "Test PyGreenlet_SwitchValue()"},
+    {"test_switch_no_args",
+     (PyCFunction)test_switch_no_args,
+     METH_O,
+     "Test PyGreenlet_SwitchNoArgs()"},
+    {"test_import_keeps_error",
+     (PyCFunction)test_import_keeps_error,
+     METH_NOARGS,
+     "Call PyGreenlet_Import() with an exception set."},
+    {"test_new_native",
+     (PyCFunction)test_new_native,
+     METH_VARARGS,
+     "Test PyGreenlet_NewNative(). With a callable, the greenlet calls it\n"
+     "with the first value; with None, it switches that value back to its\n"
+     "parent, and returns what it's sent next."},
+    {"test_api_version",
+     (PyCFunction)test_api_version,
+     METH_NOARGS,
+     "Return the imported and compiled C API versions."},
     {NULL, NULL, 0, NULL}
 };
 
@@ -0,0 +1,212 @@
+/* Tests for greenlet_coroutine.hpp: greenlets waiting for C++20
+ * coroutines.
+ *
+ * The coroutines here wait for an event that Python completes by
+ * calling fire(), the way an event loop's completion callback would.
+ * Compilers without coroutines build an empty module.
+ */
+
+#include "../greenlet.h"
+#include "../greenlet_compiler_compat.hpp"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#    define HAVE_COROUTINES 1
+#else
+#    define HAVE_COROUTINES 0
+#endif
+
+#if HAVE_COROUTINES
+#include <stdexcept>
+
+#include "../greenlet_coroutine.hpp"
+
+using greenlet::coroutine::Task;
+using greenlet::coroutine::wait;
+
+// The coroutine waiting for fire(), and what fire() sent it.
+static std::coroutine_handle<> pending;
+static PyObject* fired_value = nullptr;
+
+class Fired
+{
+public:
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        pending = handle;
+    }
+
+    // A new reference.
+    PyObject* await_resume() noexcept
+    {
+        return std::exchange(fired_value, nullptr);
+    }
+};
+
+static Task
+value_task(PyObject* value, bool suspend)
+{
+    if (suspend) {
+        co_return co_await Fired();
+    }
+    Py_INCREF(value);
+    co_return value;
+}
+
+static Task
+nested_task()
+{
+    PyObject* inner = co_await value_task(nullptr, true);
+    if (!inner) {
+        co_return nullptr;
+    }
+    PyObject* result = PyTuple_Pack(1, inner);
+    Py_DECREF(inner);
+    co_return result;
+}
+
+static Task
+error_task()
+{
+    PyObject* value = co_await Fired();
+    PyErr_SetObject(PyExc_ValueError, value);
+    Py_DECREF(value);
+    co_return nullptr;
+}
+
+static Task
+cpp_error_task()
+{
+    PyObject* value = co_await Fired();
+    Py_DECREF(value);
+    throw std::runtime_error("thrown from a coroutine");
+}
+
+static PyGreenlet*
+hub_arg(PyObject* hub)
+{
+    if (hub == Py_None) {
+        return nullptr;
+    }
+    return reinterpret_cast<PyGreenlet*>(hub);
+}
+
+static PyObject*
+test_wait_value(PyObject* UNUSED(self), PyObject* args)
+{
+    PyObject* value = Py_None;
+    int suspend = 1;
+    PyObject* hub = Py_None;
+    if (!PyArg_ParseTuple(args, "|OpO", &value, &suspend, &hub)) {
+        return NULL;
+    }
+    return wait(value_task(value, suspend), hub_arg(hub));
+}
+
+static PyObject*
+test_wait_nested(PyObject* UNUSED(self), PyObject* UNUSED(args))
+{
+    return wait(nested_task());
+}
+
+static PyObject*
+test_wait_error(PyObject* UNUSED(self), PyObject* UNUSED(args))
+{
+    return wait(error_task());
+}
+
+static PyObject*
+test_wait_cpp_error(PyObject* UNUSED(self), PyObject* UNUSED(args))
+{
+    return wait(cpp_error_task());
+}
+
+static PyObject*
+test_fire(PyObject* UNUSED(self), PyObject* value)
+{
+    if (!pending) {
+        PyErr_SetString(PyExc_AssertionError, "no coroutine is waiting");
+        return NULL;
+    }
+    Py_INCREF(value);
+    Py_XSETREF(fired_value, value);
+    std::exchange(pending, nullptr).resume();
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+test_pending(PyObject* UNUSED(self), PyObject* UNUSED(args))
+{
+    return PyBool_FromLong(static_cast<bool>(pending));
+}
+#endif
+
+static PyMethodDef test_methods[] = {
+#if HAVE_COROUTINES
+    {"test_wait_value",
+     (PyCFunction)test_wait_value,
+     METH_VARARGS,
+     "test_wait_value(value=None, suspend=True, hub=None)\n"
+     "Wait for a coroutine that returns what fire() sends it or, "
+     "if suspend is false, returns value right away."},
+    {"test_wait_nested",
+     (PyCFunction)test_wait_nested,
+     METH_NOARGS,
+     "Wait for a coroutine that awaits another coroutine, and returns a "
+     "1-tuple of what fire() sent."},
+    {"test_wait_error",
+     (PyCFunction)test_wait_error,
+     METH_NOARGS,
+     "Wait for a coroutine that raises ValueError of what fire() sent."},
+    {"test_wait_cpp_error",
+     (PyCFunction)test_wait_cpp_error,
+     METH_NOARGS,
+     "Wait for a coroutine that throws a C++ exception once fired."},
+    {"fire",
+     (PyCFunction)test_fire,
+     METH_O,
+     "Resume the waiting coroutine with a value."},
+    {"pending",
+     (PyCFunction)test_pending,
+     METH_NOARGS,
+     "Is a coroutine waiting for fire()?"},
+#endif
+    {NULL, NULL, 0, NULL}};
+
+static struct PyModuleDef moduledef = {PyModuleDef_HEAD_INIT,
+                                       "greenlet.tests._test_extension_cpp20",
+                                       NULL,
+                                       0,
+                                       test_methods,
+                                       NULL,
+                                       NULL,
+                                       NULL,
+                                       NULL};
+
+PyMODINIT_FUNC
+PyInit__test_extension_cpp20(void)
+{
+    PyObject* module = PyModule_Create(&moduledef);
+    if (module == NULL) {
+        return NULL;
+    }
+
+    PyGreenlet_Import();
+    if (_PyGreenlet_API == NULL) {
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    if (PyModule_AddObject(module, "HAVE_COROUTINES", PyBool_FromLong(HAVE_COROUTINES)) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -0,0 +1,116 @@
+from __future__ import print_function
+from __future__ import absolute_import
+
+import os
+import threading
+import unittest
+
+import greenlet
+from . import TestCase
+from .leakcheck import fails_leakcheck
+
+
+def _park(ran):
+    try:
+        greenlet.getcurrent().parent.switch()
+    finally:
+        ran.append(greenlet.getcurrent())
+
+
+class TestAfterForkChild(TestCase):
+
+    def _in_new_thread(self, func):
+        # It discards every suspended greenlet of its thread, so keep
+        # it away from anything else this thread has going.
+        result = []
+        thread = threading.Thread(target=lambda: result.append(func()))
+        thread.start()
+        thread.join(10)
+        return result[0]
+
+    # References held only by a discarded greenlet's saved C stack,
+    # like the arguments it was started with, are never released.
+    @fails_leakcheck
+    def test_discards_suspended(self):
+        def run():
+            ran = []
+            glets = [greenlet.greenlet(_park) for _ in range(3)]
+            for glet in glets:
+                glet.switch(ran)
+            unstarted = greenlet.greenlet(_park)
+            return greenlet.after_fork_child(), glets, unstarted, ran
+        discarded, glets, unstarted, ran = self._in_new_thread(run)
+        self.assertEqual(discarded, 3)
+        self.assertEqual(ran, [])
+        for glet in glets:
+            self.assertFalse(glet)
+            self.assertIsNone(glet.gr_frame)
+        # Never started, so not counted.
+        self.assertFalse(unstarted)
+
+    @fails_leakcheck
+    def test_keeps_current_and_parents(self):
+        def run():
+            ran = []
+            outer = greenlet.greenlet(_park)
+            outer.switch(ran)
+            def inner_run():
+                # Parked, because the parent is suspended in there.
+                return greenlet.after_fork_child()
+            middle = greenlet.greenlet(lambda: greenlet.greenlet(inner_run).switch())
+            discarded = middle.switch()
+            return discarded, outer, middle, ran
+        discarded, outer, middle, ran = self._in_new_thread(run)
+        self.assertEqual(discarded, 1)
+        self.assertFalse(outer)
+        # It returned to its parent, which finished normally.
+        self.assertTrue(middle.dead)
+        self.assertEqual(ran, [])
+
+    @fails_leakcheck
+    def test_discards_the_greenlet_we_started_from(self):
+        def run():
+            main = greenlet.getcurrent()
+            def on_top():
+                # Running on top of what's left of below's stack.
+                main.switch(greenlet.after_fork_child())
+                return 'finished'
+            top = greenlet.greenlet(on_top)
+            below = greenlet.greenlet(lambda: top.switch())
+            discarded = below.switch()
+            # Switching saves top's stack, and restores it, without
+            # going through below's.
+            return discarded, below, top.switch()
+        discarded, below, result = self._in_new_thread(run)
+        self.assertEqual(discarded, 1)
+        self.assertFalse(below)
+        self.assertEqual(result, 'finished')
+
+    @unittest.skipUnless(hasattr(os, 'fork'), "Needs fork")
+    def test_in_forked_child(self):
+        ran = []
+        glets = [greenlet.greenlet(_park) for _ in range(3)]
+        for glet in glets:
+            glet.switch(ran)
+        read_fd, write_fd = os.pipe()
+        pid = os.fork()
+        if not pid:
+            try:
+                discarded = greenlet.after_fork_child()
+                os.write(write_fd, ('%d %d %d' % (
+                    discarded, len(ran), sum(not glet for glet in glets))).encode('ascii'))
+            finally:
+                os._exit(0)
+        os.close(write_fd)
+        with os.fdopen(read_fd) as f:
+            output = f.read()
+        os.waitpid(pid, 0)
+        # At least ours; there could be others left suspended in this thread.
+        discarded, finally_ran, inactive = [int(x) for x in output.split()]
+        self.assertGreaterEqual(discarded, 3)
+        self.assertEqual(finally_ran, 0)
+        self.assertEqual(inactive, 3)
+        # The parent's are untouched.
+        self.assertTrue(all(glets))
+        greenlet.kill_all(glets)
+        self.assertEqual(len(ran), 3)
@@ -1,10 +1,11 @@
 from __future__ import print_function
 from __future__ import absolute_import
 
-
+import unittest
 
 import greenlet
 from . import _test_extension_cpp
+from . import _bench_extension_cpp
 from . import TestCase
 
 class CPPTests(TestCase):
@@ -16,3 +17,127 @@ class CPPTests(TestCase):
             greenlets.append(g)
         for i, g in enumerate(greenlets):
             self.assertEqual(g.switch(), i)
+
+
+class BenchExtensionTests(TestCase):
+    # The benchmarks in benchmarks/c_api.py; make sure they still
+    # work, and don't leak.
+
+    def test_benchmarks_run(self):
+        self.assertGreaterEqual(_bench_extension_cpp.ping_pong(10), 0)
+        self.assertGreaterEqual(_bench_extension_cpp.deep_switch(10, 32), 0)
+        self.assertGreaterEqual(_bench_extension_cpp.chain(2, 10), 0)
+        self.assertGreaterEqual(_bench_extension_cpp.create_destroy(10), 0)
+        self.assertGreaterEqual(_bench_extension_cpp.spawn(10), 0)
+        self.assertGreaterEqual(_bench_extension_cpp.spawn_native(10), 0)
+        self.assertGreaterEqual(_bench_extension_cpp.throw(10), 0)
+
+
+try:
+    from . import _test_extension_cpp20
+except ImportError: # pragma: no cover
+    # The compiler couldn't build it.
+    _test_extension_cpp20 = None
+
+@unittest.skipUnless(_test_extension_cpp20 is not None
+                     and _test_extension_cpp20.HAVE_COROUTINES,
+                     "Needs a compiler with C++20 coroutines")
+class CoroutineTests(TestCase):
+    # greenlet_coroutine.hpp
+
+    def setUp(self):
+        self.ext = _test_extension_cpp20
+
+    def tearDown(self):
+        # Nothing may be left waiting.
+        self.assertFalse(self.ext.pending())
+
+    def _start(self, func, *args):
+        glet = greenlet.greenlet(func)
+        # Waiting switches back here.
+        self.assertEqual(glet.switch(*args), ())
+        self.assertTrue(self.ext.pending())
+        return glet
+
+    def test_finishes_without_suspending(self):
+        switches = []
+        greenlet.settrace(lambda *args: switches.append(args))
+        try:
+            result = self.ext.test_wait_value(42, False)
+        finally:
+            greenlet.settrace(None)
+        self.assertEqual(result, 42)
+        self.assertEqual(switches, [])
+
+    def test_wait(self):
+        results = []
+        def run():
+            results.append(self.ext.test_wait_value())
+        glet = self._start(run)
+        main = greenlet.getcurrent()
+        switches = []
+        greenlet.settrace(lambda event, args: switches.append((event, args)))
+        try:
+            self.ext.fire(42)
+        finally:
+            greenlet.settrace(None)
+        self.assertEqual(results, [42])
+        self.assertTrue(glet.dead)
+        # One switch in when the coroutine finishes, one back out
+        # when the greenlet does.
+        self.assertEqual(switches, [('switch', (main, glet)),
+                                    ('switch', (glet, main))])
+
+    def test_explicit_hub(self):
+        def loop():
+            self.ext.fire(5)
+        hub = greenlet.greenlet(loop)
+        glet = greenlet.greenlet(self.ext.test_wait_value)
+        # The hub resumes the coroutine, which switches to glet, which
+        # returns to its own parent.
+        self.assertEqual(glet.switch(None, True, hub), 5)
+        self.assertTrue(glet.dead)
+        self.assertFalse(hub.dead)
+        # The hub is still in fire(). When it's killed, that raises.
+        self.assertIsInstance(hub.throw(), greenlet.GreenletExit)
+        self.assertTrue(hub.dead)
+
+    def test_nested(self):
+        results = []
+        def run():
+            results.append(self.ext.test_wait_nested())
+        glet = self._start(run)
+        self.ext.fire('inner')
+        self.assertTrue(glet.dead)
+        self.assertEqual(results, [('inner',)])
+
+    def test_error(self):
+        glet = self._start(self.ext.test_wait_error)
+        with self.assertRaises(ValueError) as exc:
+            self.ext.fire('bad')
+        self.assertEqual(exc.exception.args, ('bad',))
+        self.assertTrue(glet.dead)
+
+    def test_cpp_error(self):
+        glet = self._start(self.ext.test_wait_cpp_error)
+        with self.assertRaisesRegex(RuntimeError, 'thrown from a coroutine'):
+            self.ext.fire(None)
+        self.assertTrue(glet.dead)
+
+    def test_killed_while_waiting(self):
+        glet = self._start(self.ext.test_wait_value)
+        self.assertIsInstance(glet.throw(), greenlet.GreenletExit)
+        self.assertTrue(glet.dead)
+        # The coroutine is still waiting, and frees itself.
+        self.ext.fire(object())
+
+    def test_switched_to_while_waiting(self):
+        glet = self._start(self.ext.test_wait_value)
+        with self.assertRaisesRegex(greenlet.error, 'waiting for a coroutine'):
+            glet.switch()
+        self.ext.fire(object())
+
+    def test_main_greenlet_without_hub(self):
+        with self.assertRaisesRegex(greenlet.error, 'without a hub'):
+            self.ext.test_wait_value()
+        self.ext.fire(object())
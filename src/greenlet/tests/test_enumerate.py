@@ -0,0 +1,96 @@
+from __future__ import print_function
+from __future__ import absolute_import
+
+import threading
+
+import greenlet
+from . import TestCase
+from . import _test_extension
+
+
+def _parked():
+    greenlet.getcurrent().parent.switch()
+
+
+class TestEnumerate(TestCase):
+
+    def _ids(self, *args):
+        return set(id(g) for g in greenlet.enumerate(*args))
+
+    def test_started_and_unfinished(self):
+        before = self._ids()
+        unstarted = greenlet.greenlet(_parked)
+        running = [greenlet.greenlet(_parked) for _ in range(3)]
+        for g in running:
+            g.switch()
+        finished = greenlet.greenlet(lambda: None)
+        finished.switch()
+        self.assertTrue(finished.dead)
+
+        found = self._ids() - before
+        self.assertEqual(found, set(id(g) for g in running))
+        self.assertNotIn(id(unstarted), found)
+        self.assertNotIn(id(greenlet.getcurrent()), found)
+
+        running[1].switch()
+        self.assertEqual(self._ids() - before,
+                         set([id(running[0]), id(running[2])]))
+        running[0].throw()
+        # Killing the last one when it's deallocated removes it, too.
+        del running[:]
+        del g
+        self.assertEqual(self._ids(), before)
+
+    def test_current_is_included(self):
+        glet = greenlet.greenlet(lambda: greenlet.enumerate())
+        self.assertIn(glet, glet.switch())
+
+    def test_deallocated_greenlets_are_removed(self):
+        before = self._ids()
+        glet = greenlet.greenlet(_parked)
+        glet.switch()
+        self.assertEqual(len(self._ids() - before), 1)
+        del glet
+        self.assertEqual(self._ids(), before)
+
+    def test_other_thread(self):
+        ready = threading.Event()
+        done = threading.Event()
+        result = {}
+
+        def thread_main():
+            glets = [greenlet.greenlet(_parked) for _ in range(2)]
+            for g in glets:
+                g.switch()
+            result['main'] = greenlet.getcurrent()
+            result['ids'] = set(id(g) for g in glets)
+            ready.set()
+            done.wait(10)
+            for g in glets:
+                g.throw()
+
+        t = threading.Thread(target=thread_main)
+        t.start()
+        try:
+            ready.wait(10)
+            main = result['main']
+            self.assertEqual(self._ids(main), result['ids'])
+            self.assertTrue(self._ids(main).isdisjoint(self._ids()))
+        finally:
+            done.set()
+            t.join(10)
+        # The thread is gone, so there's nothing to report.
+        self.assertEqual(greenlet.enumerate(main), [])
+
+    def test_bad_argument(self):
+        with self.assertRaises(TypeError):
+            greenlet.enumerate(1)
+
+    def test_c_api(self):
+        glet = greenlet.greenlet(_parked)
+        glet.switch()
+        try:
+            self.assertIn(glet, _test_extension.test_enumerate())
+            self.assertIn(glet, _test_extension.test_enumerate(greenlet.getcurrent()))
+        finally:
+            glet.throw()
@@ -0,0 +1,237 @@
+from __future__ import print_function
+from __future__ import absolute_import
+
+import sys
+import threading
+import time
+import unittest
+
+import greenlet
+from . import TestCase
+
+
+@unittest.skipUnless(hasattr(greenlet, 'Executor'), "Needs C++11 threads")
+class TestExecutor(TestCase):
+
+    def _start_workers(self, executor, count):
+        started = []
+        def run():
+            started.append(executor.run())
+        threads = [threading.Thread(target=run) for _ in range(count)]
+        for thread in threads:
+            thread.start()
+        return threads, started
+
+    def _finish(self, executor, threads):
+        executor.shutdown()
+        for thread in threads:
+            thread.join(10)
+            self.assertFalse(thread.is_alive())
+
+    def test_runs_submitted_greenlets(self):
+        executor = greenlet.Executor()
+        ran = []
+        glets = [greenlet.greenlet(lambda i=i: ran.append(i)) for i in range(5)]
+        for glet in glets:
+            executor.submit(glet)
+        self.assertEqual(executor.pending, 5)
+        # The calling thread can be a worker too.
+        executor.shutdown()
+        self.assertEqual(executor.run(), 5)
+        self.assertEqual(sorted(ran), list(range(5)))
+        self.assertEqual(executor.pending, 0)
+        for glet in glets:
+            self.assertTrue(glet.dead)
+
+    def test_parent_is_the_worker(self):
+        executor = greenlet.Executor()
+        parents = []
+        hubs = []
+        def run():
+            hubs.append(greenlet.getcurrent())
+            executor.run()
+        executor.submit(greenlet.greenlet(lambda: parents.append(greenlet.getcurrent().parent)))
+        executor.shutdown()
+        thread = threading.Thread(target=run)
+        thread.start()
+        thread.join(10)
+        self.assertEqual(parents, hubs)
+
+    def test_suspended_greenlets_stay_in_their_thread(self):
+        executor = greenlet.Executor()
+        ran = []
+        def task():
+            ran.append(1)
+            greenlet.getcurrent().parent.switch()
+            ran.append(2)
+        glet = greenlet.greenlet(task)
+        executor.submit(glet)
+        executor.shutdown()
+        self.assertEqual(executor.run(), 1)
+        self.assertEqual(ran, [1])
+        self.assertIs(glet.parent, greenlet.getcurrent())
+        errors = []
+        def switch():
+            try:
+                glet.switch()
+            except greenlet.error as ex:
+                errors.append(ex)
+        thread = threading.Thread(target=switch)
+        thread.start()
+        thread.join(10)
+        self.assertEqual(len(errors), 1)
+        glet.switch()
+        self.assertEqual(ran, [1, 2])
+        self.assertTrue(glet.dead)
+
+    def test_steals_from_a_busy_thread(self):
+        executor = greenlet.Executor()
+        done = threading.Event()
+        ran = []
+        def child():
+            ran.append(threading.current_thread())
+            if len(ran) == 10:
+                done.set()
+        def seed():
+            for _ in range(10):
+                executor.submit(greenlet.greenlet(child))
+            # Blocks this worker, with the GIL released; the other one
+            # has to take the children.
+            done.wait(10)
+        executor.submit(greenlet.greenlet(seed))
+        threads, started = self._start_workers(executor, 2)
+        self.assertTrue(done.wait(10))
+        self._finish(executor, threads)
+        self.assertEqual(sorted(started), [1, 10])
+        self.assertGreaterEqual(executor.steals, 1)
+        self.assertEqual(len(set(ran)), 1)
+
+    def test_submit_from_task(self):
+        executor = greenlet.Executor()
+        ran = []
+        def child(i):
+            ran.append(i)
+        def parent():
+            for i in range(3):
+                executor.submit(greenlet.greenlet(lambda i=i: child(i)))
+            ran.append('parent')
+        executor.submit(greenlet.greenlet(parent))
+        executor.shutdown()
+        # Even after shutdown, the workers can still submit.
+        self.assertEqual(executor.run(), 4)
+        # The newest first.
+        self.assertEqual(ran, ['parent', 2, 1, 0])
+
+    def test_rejects_started_greenlets(self):
+        executor = greenlet.Executor()
+        glet = greenlet.greenlet(lambda: None)
+        glet.switch()
+        with self.assertRaises(ValueError):
+            executor.submit(glet)
+        with self.assertRaises(TypeError):
+            executor.submit(lambda: None)
+        self.assertEqual(executor.pending, 0)
+
+    def test_rejects_submit_after_shutdown(self):
+        executor = greenlet.Executor()
+        executor.shutdown()
+        with self.assertRaises(RuntimeError):
+            executor.submit(greenlet.greenlet(lambda: None))
+        self.assertEqual(executor.run(), 0)
+
+    def test_run_is_not_reentrant(self):
+        executor = greenlet.Executor()
+        errors = []
+        def task():
+            try:
+                executor.run()
+            except RuntimeError as ex:
+                errors.append(ex)
+        executor.submit(greenlet.greenlet(task))
+        executor.shutdown()
+        executor.run()
+        self.assertEqual(len(errors), 1)
+
+    def test_exceptions_are_reported(self):
+        executor = greenlet.Executor()
+        unraisable = []
+        ran = []
+        def fail():
+            raise ValueError("boom")
+        executor.submit(greenlet.greenlet(lambda: ran.append(1)))
+        executor.submit(greenlet.greenlet(fail))
+        executor.shutdown()
+        old_hook = getattr(sys, 'unraisablehook', None)
+        if old_hook is not None:
+            sys.unraisablehook = unraisable.append
+        try:
+            self.assertEqual(executor.run(), 2)
+        finally:
+            if old_hook is not None:
+                sys.unraisablehook = old_hook
+        self.assertEqual(ran, [1])
+        if old_hook is not None:
+            self.assertEqual(len(unraisable), 1)
+            self.assertIsInstance(unraisable[0].exc_value, ValueError)
+        del unraisable[:]
+
+    def test_reparent_failure_is_reported(self):
+        executor = greenlet.Executor()
+        unraisable = []
+        ran = []
+        main = greenlet.getcurrent()
+        cyclic = greenlet.greenlet(lambda: ran.append('cyclic'))
+        def worker():
+            try:
+                return executor.run()
+            finally:
+                greenlet.getcurrent().parent = main
+        hub = greenlet.greenlet(worker)
+        # Making the hub its parent would be a cycle.
+        hub.parent = cyclic
+        executor.submit(cyclic)
+        executor.submit(greenlet.greenlet(lambda: ran.append(1)))
+        executor.shutdown()
+        old_hook = getattr(sys, 'unraisablehook', None)
+        if old_hook is not None:
+            sys.unraisablehook = unraisable.append
+        try:
+            self.assertEqual(hub.switch(), 1)
+        finally:
+            if old_hook is not None:
+                sys.unraisablehook = old_hook
+        self.assertEqual(ran, [1])
+        self.assertFalse(cyclic)
+        if old_hook is not None:
+            self.assertEqual(len(unraisable), 1)
+            self.assertIsInstance(unraisable[0].exc_value, ValueError)
+        del unraisable[:]
+
+    def test_base_exceptions_propagate(self):
+        executor = greenlet.Executor()
+        def stop():
+            raise KeyboardInterrupt
+        ran = []
+        executor.submit(greenlet.greenlet(stop))
+        executor.submit(greenlet.greenlet(lambda: ran.append(1)))
+        executor.shutdown()
+        with self.assertRaises(KeyboardInterrupt):
+            executor.run()
+        # What wasn't started is still there for the next worker.
+        self.assertEqual(executor.pending, 1)
+        self.assertEqual(executor.run(), 1)
+        self.assertEqual(ran, [1])
+
+    def test_idle_worker_waits_for_work(self):
+        executor = greenlet.Executor()
+        ran = threading.Event()
+        threads, started = self._start_workers(executor, 1)
+        time.sleep(0.05)
+        executor.submit(greenlet.greenlet(ran.set))
+        self.assertTrue(ran.wait(10))
+        self._finish(executor, threads)
+        self.assertEqual(started, [1])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,143 @@
+from __future__ import print_function
+from __future__ import absolute_import
+
+import os
+import subprocess
+import sys
+import unittest
+
+import greenlet
+from . import TestCase
+
+# Parks greenlets, held by __main__, in code with its own globals
+# (which the suspended frames keep alive), so that they're deallocated
+# when the interpreter clears __main__ on the way out.
+EXIT_SCRIPT = r"""
+import greenlet
+
+PARK = '''
+import os
+import greenlet
+
+def park():
+    try:
+        greenlet.getcurrent().parent.switch()
+    finally:
+        os.write(1, b'finally ')
+'''
+
+park_globals = {}
+exec(PARK, park_globals)
+greenlet.set_exit_policy(%r)
+parked = []
+for _ in range(3):
+    glet = greenlet.greenlet(park_globals['park'])
+    glet.switch()
+    parked.append(glet)
+print('parked', end=' ')
+"""
+
+# While the interpreter is exiting, lets go of a greenlet, which is
+# abandoned, while it's in the chain of stacks under a suspended
+# greenlet and the running one, and then switches to the suspended one.
+# It's started by another greenlet finishing, so nothing on the way
+# holds on to it. The suspended frames keep __main__'s globals alive
+# past exit, so what starts it lives in a module of its own.
+NESTED_EXIT_SCRIPT = r"""
+import gc
+import os
+import sys
+import types
+import greenlet
+
+def setup():
+    main = greenlet.getcurrent()
+    holder = []
+    def release_below():
+        holder.pop().parent = main
+        %s
+        greenlet.getcurrent().parent.switch('released')
+    def top_run():
+        os.write(1, greenlet.greenlet(release_below).switch().encode('ascii'))
+        main.switch()
+    def below_run(_):
+        greenlet.greenlet(top_run, main).switch()
+    class Start(object):
+        def __del__(self):
+            holder.append(greenlet.greenlet(below_run))
+            holder.append(greenlet.greenlet(lambda: None, holder[0]))
+            holder[1].switch()
+            os.write(1, b' back')
+    return Start()
+
+greenlet.set_exit_policy('abandon')
+sys.modules['start_at_exit'] = types.ModuleType('start_at_exit')
+sys.modules['start_at_exit'].start = setup()
+print('parked', end=' ')
+"""
+
+
+class TestExitPolicy(TestCase):
+
+    def tearDown(self):
+        greenlet.set_exit_policy('kill')
+        super(TestExitPolicy, self).tearDown()
+
+    def test_returns_previous(self):
+        self.assertEqual(greenlet.set_exit_policy('abandon'), 'kill')
+        self.assertEqual(greenlet.set_exit_policy('abandon'), 'abandon')
+        self.assertEqual(greenlet.set_exit_policy('kill'), 'abandon')
+
+    def test_bad_policy(self):
+        with self.assertRaises(ValueError):
+            greenlet.set_exit_policy('ignore')
+        with self.assertRaises(TypeError):
+            greenlet.set_exit_policy(None)
+        self.assertEqual(greenlet.set_exit_policy('kill'), 'kill')
+
+    def test_not_finalizing(self):
+        # Before the interpreter is exiting, it changes nothing.
+        greenlet.set_exit_policy('abandon')
+        caught = []
+        def run():
+            try:
+                greenlet.getcurrent().parent.switch()
+            except greenlet.GreenletExit as e:
+                caught.append(e)
+        glet = greenlet.greenlet(run)
+        glet.switch()
+        del glet
+        self.assertEqual(len(caught), 1)
+
+    def _run_to_exit(self, policy, script=None):
+        env = dict(os.environ)
+        env['PYTHONPATH'] = os.pathsep.join(
+            [os.path.dirname(os.path.dirname(os.path.abspath(greenlet.__file__)))]
+            + [p for p in env.get('PYTHONPATH', '').split(os.pathsep) if p])
+        if script is None:
+            script = EXIT_SCRIPT % (policy,)
+        script = "from __future__ import print_function\n" + script
+        output = subprocess.check_output(
+            [sys.executable, '-c', script], env=env, stderr=subprocess.STDOUT)
+        return output.decode('ascii').split()
+
+    def test_kill_at_exit(self):
+        self.assertEqual(self._run_to_exit('kill'), ['parked'] + ['finally'] * 3)
+
+    def test_abandon_at_exit(self):
+        self.assertEqual(self._run_to_exit('abandon'), ['parked'])
+
+    def test_abandon_under_running_greenlet(self):
+        script = NESTED_EXIT_SCRIPT % ("del holder[:]",)
+        self.assertEqual(self._run_to_exit('abandon', script),
+                         ['parked', 'released', 'back'])
+
+    @unittest.skipUnless(greenlet._greenlet.GREENLET_USE_SUSPENDED_GC,
+                         "Needs tp_finalize")
+    def test_collect_under_running_greenlet(self):
+        # The same, but it's only in a cycle, which the collector
+        # finds; green_finalize() abandons it.
+        script = NESTED_EXIT_SCRIPT % (
+            "holder[0].cycle = holder[0]; del holder[:]; gc.collect()",)
+        self.assertEqual(self._run_to_exit('abandon', script),
+                         ['parked', 'released', 'back'])
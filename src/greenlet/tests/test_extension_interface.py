@@ -109,6 +109,126 @@ class CAPITests(TestCase):
         self.assertEqual(str(exc.exception),
                          "exceptions must be classes, or instances, not str")
 
+    def test_api_version(self):
+        imported, compiled = _test_extension.test_api_version()
+        self.assertEqual(imported, compiled)
+        self.assertEqual(imported, greenlet._C_API_VERSION)
+
+    def test_import_keeps_pending_error(self):
+        with self.assertRaises(KeyError):
+            _test_extension.test_import_keeps_error()
+
+    def _echo(self):
+        # Each switch to it returns what it was given, and hands back
+        # what the next switch gave it.
+        def run(*args):
+            value = args
+            while True:
+                value = greenlet.getcurrent().parent.switch(value)
+        g = greenlet.greenlet(run)
+        return g
+
+    def test_switch_value_running(self):
+        g = self._echo()
+        self.assertEqual(g.switch(), ())
+        marker = object()
+        for value in 1, None, marker, [1, 2], {'a': 1}:
+            self.assertIs(_test_extension.test_switch_value(g, value), value)
+        # A tuple isn't unpacked on the other side.
+        self.assertEqual(_test_extension.test_switch_value(g, (1, 2)), (1, 2))
+        self.assertEqual(_test_extension.test_switch_value(g, ()), ())
+        self.assertEqual(_test_extension.test_switch_value(g, (3,)), (3,))
+
+    def test_switch_value_not_started(self):
+        g = self._echo()
+        self.assertEqual(_test_extension.test_switch_value(g, 42), (42,))
+        g = self._echo()
+        self.assertEqual(_test_extension.test_switch_value(g, (1, 2)), ((1, 2),))
+
+    def test_switch_value_dead(self):
+        g = greenlet.greenlet(lambda: None)
+        g.switch()
+        self.assertTrue(g.dead)
+        self.assertEqual(_test_extension.test_switch_value(g, 42), 42)
+        self.assertEqual(_test_extension.test_switch_value(g, (1, 2)), (1, 2))
+
+    def test_switch_value_raises(self):
+        def run():
+            raise ValueError(greenlet.getcurrent().parent.switch())
+        g = greenlet.greenlet(run)
+        g.switch()
+        with self.assertRaises(ValueError) as exc:
+            _test_extension.test_switch_value(g, 'boom')
+        self.assertEqual(exc.exception.args, ('boom',))
+
+    def test_switch_no_args(self):
+        g = self._echo()
+        self.assertEqual(_test_extension.test_switch_no_args(g), ())
+        self.assertEqual(_test_extension.test_switch_no_args(g), ())
+        self.assertRaises(TypeError, _test_extension.test_switch_no_args, 42)
+
+    def test_new_native(self):
+        seen = []
+        def record(value):
+            seen.append((greenlet.getcurrent(), value))
+            return 'result'
+        g = _test_extension.test_new_native(record)
+        self.assertIs(g.parent, greenlet.getcurrent())
+        self.assertFalse(g)
+        with self.assertRaises(AttributeError):
+            getattr(g, 'run')
+        self.assertEqual(g.switch(42), 'result')
+        self.assertEqual(seen, [(g, 42)])
+        self.assertTrue(g.dead)
+
+    def test_new_native_first_value(self):
+        # The first value is what switch() would return.
+        for args, kwargs, expected in (
+                ((), {}, ()),
+                ((1,), {}, 1),
+                ((1, 2), {}, (1, 2)),
+                ((), {'a': 1}, {'a': 1}),
+        ):
+            g = _test_extension.test_new_native(None)
+            self.assertEqual(g.switch(*args, **kwargs), expected)
+            self.assertTrue(g)
+            self.assertEqual(g.switch('again'), 'again')
+            self.assertTrue(g.dead)
+
+    def test_new_native_raises(self):
+        def fail(value):
+            raise ValueError(value)
+        g = _test_extension.test_new_native(fail)
+        with self.assertRaises(ValueError) as exc:
+            g.switch('boom')
+        self.assertEqual(exc.exception.args, ('boom',))
+
+    def test_new_native_parent(self):
+        def run():
+            return 'parent got ' + greenlet.getcurrent().parent.switch()
+        parent = greenlet.greenlet(run)
+        parent.switch()
+        g = _test_extension.test_new_native(lambda value: value, parent)
+        self.assertEqual(g.switch('this'), 'parent got this')
+
+    def test_new_native_killed(self):
+        g = _test_extension.test_new_native(None)
+        self.assertEqual(g.switch(1), 1)
+        # As for Python code, GreenletExit is caught and becomes the
+        # result.
+        self.assertIsInstance(g.throw(), greenlet.GreenletExit)
+        self.assertTrue(g.dead)
+        # Killed before it starts, it never runs.
+        g = _test_extension.test_new_native(self.fail)
+        g.throw()
+        self.assertTrue(g.dead)
+
+    def test_new_native_set_run(self):
+        # Setting run replaces the native function.
+        g = _test_extension.test_new_native(self.fail)
+        g.run = lambda: 'python'
+        self.assertEqual(g.switch(), 'python')
+
 
 if __name__ == '__main__':
     import unittest
@@ -1,5 +1,6 @@
 import gc
-
+import sys
+import unittest
 import weakref
 
 import greenlet
@@ -11,6 +12,15 @@ from .leakcheck import fails_leakcheck
 # which is no longer optional.
 assert greenlet.GREENLET_USE_GC
 
+# Frames taken from inside suspended greenlets, where the collector
+# can't see them.
+_frames = []
+
+def _leaks_without_suspended_gc(func):
+    if greenlet._greenlet.GREENLET_USE_SUSPENDED_GC:
+        return func
+    return fails_leakcheck(func)
+
 class GCTests(TestCase):
     def test_dead_circular_ref(self):
         o = weakref.ref(greenlet.greenlet(greenlet.getcurrent).switch())
@@ -44,7 +54,7 @@ class GCTests(TestCase):
         self.assertIsNone(o())
         self.assertFalse(gc.garbage, gc.garbage)
 
-    @fails_leakcheck
+    @_leaks_without_suspended_gc
     def test_finalizer_crash(self):
         # This test is designed to crash when active greenlets
         # are made garbage collectable, until the underlying
@@ -84,3 +94,141 @@ class GCTests(TestCase):
         del g
         greenlet.getcurrent()
         gc.collect()
+
+
+@unittest.skipUnless(greenlet._greenlet.GREENLET_USE_SUSPENDED_GC,
+                     "Needs tp_finalize")
+class SuspendedGCTests(TestCase):
+    # Suspended greenlets that only a cycle refers to are killed, by
+    # their own thread, once the collection is over, and then
+    # collected.
+
+    def _start_parked(self, killed, make_cycle):
+        def run():
+            me = greenlet.getcurrent()
+            cycle = make_cycle(me)
+            try:
+                me.parent.switch()
+            except greenlet.GreenletExit:
+                killed.append(cycle)
+                raise
+        glet = greenlet.greenlet(run)
+        glet.switch()
+        return weakref.ref(glet)
+
+    def test_cycle_through_own_frame(self):
+        killed = []
+        ref = self._start_parked(killed, lambda me: None)
+        # ``me`` is a local of run(); that's the cycle.
+        gc.collect()
+        self.assertEqual(killed, [None])
+        self.assertIsNone(ref())
+
+    def test_cycle_through_objects_in_frame(self):
+        class Holder(object):
+            pass
+        killed = []
+        def make_cycle(me):
+            holder = Holder()
+            holder.glet = me
+            holder.self = holder
+            return holder
+        ref = self._start_parked(killed, make_cycle)
+        gc.collect()
+        # The locals were intact when it was killed.
+        self.assertEqual(len(killed), 1)
+        self.assertIs(killed[0].self, killed[0])
+        del killed[:]
+        gc.collect()
+        self.assertIsNone(ref())
+
+    def test_cycle_through_dict_made_while_running(self):
+        # Nothing else in the holder's __dict__ is tracked, so the
+        # dict would stop being tracked if the running greenlet
+        # claimed not to be collectable.
+        class Holder(object):
+            pass
+        killed = []
+        def make_cycle(me):
+            holder = Holder()
+            holder.glet = me
+            return holder
+        ref = self._start_parked(killed, make_cycle)
+        gc.collect()
+        self.assertEqual(len(killed), 1)
+        del killed[:]
+        self.assertIsNone(ref())
+
+    def test_reachable_suspended_greenlet_is_kept(self):
+        killed = []
+        ref = self._start_parked(killed, lambda me: None)
+        keep = ref()
+        gc.collect()
+        self.assertEqual(killed, [])
+        self.assertFalse(keep.dead)
+        keep.throw()
+        self.assertEqual(killed, [None])
+
+    def test_cycle_through_caller_frame(self):
+        killed = []
+        def park():
+            greenlet.getcurrent().parent.switch()
+        def run():
+            # Not passed to park(): the value stack isn't visited.
+            me = greenlet.getcurrent()
+            try:
+                park()
+            except greenlet.GreenletExit:
+                killed.append(True)
+                raise
+        glet = greenlet.greenlet(run)
+        glet.switch()
+        ref = weakref.ref(glet)
+        del glet
+        gc.collect()
+        self.assertEqual(killed, [True])
+        self.assertIsNone(ref())
+
+    def test_frame_held_elsewhere_is_kept(self):
+        killed = []
+        def run():
+            _frames.append(sys._getframe())
+            me = greenlet.getcurrent()
+            try:
+                me.parent.switch()
+            except greenlet.GreenletExit:
+                killed.append(True)
+                raise
+        glet = greenlet.greenlet(run)
+        glet.switch()
+        del glet
+        gc.collect()
+        # The frame, and so ``me``, is still reachable from _frames.
+        self.assertEqual(killed, [])
+        keep = _frames[0].f_locals['me']
+        self.assertFalse(keep.dead)
+        del _frames[:]
+        keep.throw()
+        self.assertEqual(killed, [True])
+
+    def test_other_thread(self):
+        import threading
+        killed = []
+        parked = threading.Event()
+        collected = threading.Event()
+        def thread_main():
+            ref = self._start_parked(killed, lambda me: None)
+            parked.set()
+            collected.wait(10)
+            # Only its own thread can kill it.
+            self.assertEqual(killed, [])
+            gc.collect()
+            self.assertEqual(killed, [None])
+            self.assertIsNone(ref())
+        thread = threading.Thread(target=thread_main)
+        thread.start()
+        parked.wait(10)
+        gc.collect()
+        collected.set()
+        thread.join(10)
+        self.assertEqual(killed, [None])
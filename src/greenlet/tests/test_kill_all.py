@@ -0,0 +1,100 @@
+from __future__ import print_function
+from __future__ import absolute_import
+
+import greenlet
+from . import TestCase
+
+
+def _parked(caught):
+    try:
+        greenlet.getcurrent().parent.switch()
+    except BaseException as e:
+        caught.append(e)
+        raise
+
+
+class TestKillAll(TestCase):
+
+    def _start(self, caught, count=3):
+        glets = [greenlet.greenlet(_parked) for _ in range(count)]
+        for glet in glets:
+            glet.switch(caught)
+        return glets
+
+    def test_kills_active(self):
+        caught = []
+        glets = self._start(caught)
+        self.assertIsNone(greenlet.kill_all(glets))
+        self.assertTrue(all(glet.dead for glet in glets))
+        self.assertEqual(len(caught), 3)
+        self.assertIsInstance(caught[0], greenlet.GreenletExit)
+        # Instantiated once.
+        self.assertIs(caught[0], caught[1])
+        self.assertIs(caught[1], caught[2])
+
+    def test_skips_unstarted_and_dead(self):
+        caught = []
+        unstarted = greenlet.greenlet(_parked)
+        finished = greenlet.greenlet(lambda: None)
+        finished.switch()
+        glets = self._start(caught, 1)
+        greenlet.kill_all([unstarted, finished] + glets)
+        self.assertEqual(len(caught), 1)
+        self.assertFalse(unstarted)
+        self.assertFalse(unstarted.dead)
+        # It can still run.
+        unstarted.switch(caught)
+        self.assertTrue(unstarted)
+        unstarted.throw()
+
+    def test_any_iterable(self):
+        caught = []
+        glets = self._start(caught)
+        greenlet.kill_all(glet for glet in glets)
+        self.assertTrue(all(glet.dead for glet in glets))
+
+    def test_exception_class_and_instance(self):
+        caught = []
+        glets = self._start(caught, 2)
+        with self.assertRaises(ValueError):
+            greenlet.kill_all(glets, ValueError)
+        # The first one didn't catch it, so it came back to us.
+        self.assertTrue(glets[0].dead)
+        self.assertFalse(glets[1].dead)
+
+        exc = KeyError('key')
+        with self.assertRaises(KeyError) as cm:
+            greenlet.kill_all(glets, exception=exc)
+        self.assertIs(cm.exception, exc)
+        self.assertIs(caught[-1], exc)
+        self.assertTrue(glets[1].dead)
+
+    def test_not_greenlets(self):
+        caught = []
+        glets = self._start(caught)
+        with self.assertRaises(TypeError):
+            greenlet.kill_all(glets + [object()])
+        with self.assertRaises(TypeError):
+            greenlet.kill_all(42)
+        with self.assertRaises(TypeError):
+            greenlet.kill_all(glets, exception=object())
+        # Nothing was killed.
+        self.assertEqual(caught, [])
+        greenlet.kill_all(glets)
+        self.assertEqual(len(caught), 3)
+
+    def test_list_changed_while_killing(self):
+        def run(glets):
+            try:
+                greenlet.getcurrent().parent.switch()
+            finally:
+                del glets[:]
+        glets = []
+        for _ in range(3):
+            glet = greenlet.greenlet(run)
+            glets.append(glet)
+            glet.switch(glets)
+        copy = list(glets)
+        greenlet.kill_all(glets)
+        self.assertEqual(glets, [])
+        self.assertTrue(all(glet.dead for glet in copy))
@@ -1,3 +1,7 @@
+import threading
+import time
+import unittest
+
 import greenlet
 from . import TestCase
 
@@ -17,3 +21,418 @@ class Test(TestCase):
         self.assertGreater(g._stack_saved, 0)
         g.switch()
         self.assertEqual(g._stack_saved, 0)
+
+
+class TestFixedSpawnBase(TestCase):
+
+    def setUp(self):
+        super(TestFixedSpawnBase, self).setUp()
+        greenlet._greenlet.enable_fixed_spawn_base(True)
+
+    def tearDown(self):
+        greenlet._greenlet.enable_fixed_spawn_base(False)
+        super(TestFixedSpawnBase, self).tearDown()
+
+    def _recurse(self, depth, func):
+        if depth:
+            return self._recurse(depth - 1, func)
+        return func()
+
+    def test_started_at_fixed_base(self):
+        main = greenlet.getcurrent()
+
+        def func():
+            return main._stack_saved
+
+        shallow = greenlet.greenlet(func).switch()
+        deep = self._recurse(100, greenlet.greenlet(func).switch)
+        # To start from the base, the deep caller first had to save the
+        # frames that were in the way.
+        self.assertGreater(deep, shallow)
+
+    def test_same_base_from_any_depth(self):
+        main = greenlet.getcurrent()
+
+        def first_run():
+            main.switch()
+            second.switch()
+
+        def second_run():
+            main.switch()
+            main.switch(first._stack_saved)
+
+        first = greenlet.greenlet(first_run)
+        second = greenlet.greenlet(second_run)
+        first.switch()
+        # Switching back to main saved all of it.
+        whole = first._stack_saved
+        self._recurse(100, second.switch)
+        # Now first switches straight to second. Only if second's
+        # stack begins where first's does is all of first in the way;
+        # otherwise second's is far below it, and none of it is.
+        in_the_way = first.switch()
+        self.assertGreater(whole, 0)
+        self.assertGreaterEqual(in_the_way, whole)
+        first.switch()
+        second.switch()
+        self.assertTrue(first.dead)
+        self.assertTrue(second.dead)
+
+    def test_switching(self):
+        main = greenlet.getcurrent()
+
+        def func(arg):
+            self.assertIs(greenlet.getcurrent().parent, main)
+            arg = main.switch(arg + 1)
+            return arg * 2
+
+        glets = []
+        def spawn():
+            g = greenlet.greenlet(func)
+            glets.append(g)
+            return g.switch(1)
+
+        for depth in (0, 10, 100):
+            self.assertEqual(self._recurse(depth, spawn), 2)
+        self.assertEqual([g.switch(3) for g in glets], [6, 6, 6])
+        self.assertTrue(all(g.dead for g in glets))
+
+    def test_failed_start_raises_in_caller(self):
+        class Broken(greenlet.greenlet):
+            @property
+            def run(self):
+                raise ValueError("no run")
+
+        g = Broken()
+        with self.assertRaises(ValueError):
+            self._recurse(10, g.switch)
+        self.assertFalse(g)
+        # Still usable.
+        self.assertEqual(greenlet.greenlet(lambda: 42).switch(), 42)
+
+    def test_trampoline_not_traced(self):
+        events = []
+        greenlet.settrace(lambda *args: events.append(args))
+        try:
+            g = greenlet.greenlet(lambda: None)
+            self._recurse(10, g.switch)
+        finally:
+            greenlet.settrace(None)
+        main = greenlet.getcurrent()
+        self.assertEqual(len(events), 2)
+        self.assertEqual(events[0][0], 'switch')
+        self.assertIs(events[0][1][0], main)
+        self.assertIs(events[0][1][1], g)
+        self.assertIs(events[1][1][0], g)
+        self.assertIs(events[1][1][1], main)
+
+    def test_enable_twice_and_disable(self):
+        greenlet._greenlet.enable_fixed_spawn_base(True)
+        self.assertEqual(greenlet.greenlet(lambda: 1).switch(), 1)
+        greenlet._greenlet.enable_fixed_spawn_base(False)
+        self.assertEqual(greenlet.greenlet(lambda: 2).switch(), 2)
+
+
+class TestStackCopyThreshold(TestCase):
+
+    def setUp(self):
+        self.old_threshold = greenlet._greenlet.get_stack_copy_threshold()
+
+    def tearDown(self):
+        greenlet._greenlet.set_stack_copy_threshold(self.old_threshold)
+
+    def test_kernel_name(self):
+        self.assertIn(greenlet._greenlet.STACK_COPY_KERNEL, ('avx2', 'sse2', 'memcpy'))
+
+    def test_threshold_is_raised_to_minimum(self):
+        greenlet._greenlet.set_stack_copy_threshold(0)
+        minimum = greenlet._greenlet.get_stack_copy_threshold()
+        self.assertGreater(minimum, 0)
+        greenlet._greenlet.set_stack_copy_threshold(minimum * 4)
+        self.assertEqual(greenlet._greenlet.get_stack_copy_threshold(), minimum * 4)
+
+    def test_bad_threshold(self):
+        with self.assertRaises(ValueError):
+            greenlet._greenlet.set_stack_copy_threshold(-1)
+        with self.assertRaises(TypeError):
+            greenlet._greenlet.set_stack_copy_threshold('1024')
+
+    def _check_deep_stacks_survive(self):
+        def recurse(depth, values):
+            if depth:
+                # Keep something on each level of the stack to check.
+                mine = (depth, [depth])
+                result = recurse(depth - 1, values)
+                self.assertEqual(mine, (depth, [depth]))
+                return result
+            return greenlet.getcurrent().parent.switch(values)
+
+        def run(i):
+            return recurse(200, i)
+
+        glets = [greenlet.greenlet(run) for _ in range(3)]
+        for i, glet in enumerate(glets):
+            self.assertEqual(glet.switch(i), i)
+            self.assertGreater(glet._stack_saved, 0)
+        for i, glet in enumerate(glets):
+            self.assertEqual(glet.switch(i * 10), i * 10)
+            self.assertTrue(glet.dead)
+
+    def test_deep_stacks_survive_nontemporal_copy(self):
+        greenlet._greenlet.set_stack_copy_threshold(0)
+        self._check_deep_stacks_survive()
+
+    def test_deep_stacks_survive_memcpy(self):
+        greenlet._greenlet.set_stack_copy_threshold(1 << 62)
+        self._check_deep_stacks_survive()
+
+    @unittest.skipUnless(greenlet._greenlet.GREENLET_USE_MREMAP_STACK_SAVE,
+                         "Needs G_USE_MREMAP_STACK_SAVE")
+    def test_deep_stacks_survive_remap(self):
+        old_threshold = greenlet._greenlet.get_stack_remap_threshold()
+        greenlet._greenlet.set_stack_remap_threshold(0)
+        try:
+            self._check_deep_stacks_survive()
+        finally:
+            greenlet._greenlet.set_stack_remap_threshold(old_threshold)
+
+
+class TestLazyStackRestore(TestCase):
+
+    def setUp(self):
+        try:
+            greenlet._greenlet.set_lazy_stack_restore_threshold(8192)
+        except OSError as ex:
+            self.skipTest("Lazy restore not available: %s" % (ex,))
+
+    def tearDown(self):
+        greenlet._greenlet.set_lazy_stack_restore_threshold(0)
+
+    def test_threshold(self):
+        self.assertEqual(greenlet._greenlet.get_lazy_stack_restore_threshold(), 8192)
+        greenlet._greenlet.set_lazy_stack_restore_threshold(0)
+        self.assertEqual(greenlet._greenlet.get_lazy_stack_restore_threshold(), 0)
+        with self.assertRaises(ValueError):
+            greenlet._greenlet.set_lazy_stack_restore_threshold(-1)
+
+    def test_deep_stacks_survive(self):
+        def recurse(depth, value):
+            if depth:
+                mine = (depth, [depth])
+                result = recurse(depth - 1, value)
+                self.assertEqual(mine, (depth, [depth]))
+                return result
+            for _ in range(3):
+                value = greenlet.getcurrent().parent.switch(value)
+            return value
+
+        def run(i):
+            return recurse(200, i)
+
+        glets = [greenlet.greenlet(run) for _ in range(3)]
+        for i, glet in enumerate(glets):
+            self.assertEqual(glet.switch(i), i)
+
+        before = greenlet._greenlet.get_stack_restore_stats()
+        for value in (10, 20):
+            for i, glet in enumerate(glets):
+                self.assertEqual(glet.switch(i + value), i + value)
+        for i, glet in enumerate(glets):
+            self.assertEqual(glet.switch(i), i)
+            self.assertTrue(glet.dead)
+        after = greenlet._greenlet.get_stack_restore_stats()
+        self.assertGreater(after['total_deferred_bytes'], before['total_deferred_bytes'])
+        # Unwinding the greenlets touched the pages we deferred.
+        self.assertGreater(after['total_faulted_bytes'], before['total_faulted_bytes'])
+
+    def test_stats(self):
+        stats = greenlet._greenlet.get_stack_restore_stats()
+        self.assertEqual(
+            sorted(stats),
+            ['deferred_bytes', 'eager_bytes', 'faulted_bytes',
+             'total_deferred_bytes', 'total_faulted_bytes'])
+
+        def recurse(depth):
+            if depth:
+                return recurse(depth - 1)
+            greenlet.getcurrent().parent.switch()
+            return greenlet._greenlet.get_stack_restore_stats()
+
+        glet = greenlet.greenlet(lambda: recurse(200))
+        glet.switch()
+        stats = glet.switch()
+        self.assertTrue(glet.dead)
+        self.assertGreater(stats['deferred_bytes'], 0)
+        self.assertGreater(stats['eager_bytes'], 0)
+
+
+@unittest.skipUnless(greenlet._greenlet.GREENLET_USE_MMAP_STACK_COPY,
+                     "Needs G_USE_MMAP_STACK_COPY")
+class TestAdviseIdle(TestCase):
+
+    def _suspended(self):
+        def recurse(depth):
+            if depth:
+                mine = (depth, [depth])
+                result = recurse(depth - 1)
+                self.assertEqual(mine, (depth, [depth]))
+                return result
+            return greenlet.getcurrent().parent.switch()
+
+        glet = greenlet.greenlet(lambda: recurse(400))
+        glet.switch()
+        self.assertGreaterEqual(glet._stack_saved, 16 * 1024)
+        return glet
+
+    def _advise_idle(self, *args, **kwargs):
+        try:
+            return greenlet.advise_idle(*args, **kwargs)
+        except OSError as ex:
+            self.skipTest("madvise advice not available: %s" % (ex,))
+
+    def test_stats(self):
+        stats = greenlet._greenlet.get_idle_stack_stats()
+        self.assertEqual(
+            sorted(stats),
+            ['advised_bytes', 'advised_copies', 'cached_bytes',
+             'mapped_bytes', 'mapped_copies'])
+
+    def test_deep_stack_is_mapped(self):
+        before = greenlet._greenlet.get_idle_stack_stats()
+        glet = self._suspended()
+        during = greenlet._greenlet.get_idle_stack_stats()
+        self.assertEqual(during['mapped_copies'], before['mapped_copies'] + 1)
+        self.assertGreaterEqual(during['mapped_bytes'] - before['mapped_bytes'],
+                                glet._stack_saved)
+        glet.switch()
+        self.assertTrue(glet.dead)
+        after = greenlet._greenlet.get_idle_stack_stats()
+        self.assertEqual(after['mapped_copies'], before['mapped_copies'])
+        self.assertEqual(after['mapped_bytes'], before['mapped_bytes'])
+
+    def test_advise_idle(self):
+        glet = self._suspended()
+        # Not idle long enough.
+        self.assertEqual(self._advise_idle(3600), 0)
+        before = greenlet._greenlet.get_idle_stack_stats()
+        self.assertGreaterEqual(self._advise_idle(0), 1)
+        after = greenlet._greenlet.get_idle_stack_stats()
+        self.assertGreaterEqual(after['advised_copies'], before['advised_copies'] + 1)
+        self.assertGreaterEqual(after['advised_bytes'] - before['advised_bytes'],
+                                glet._stack_saved)
+        self.assertEqual(after['cached_bytes'], 0)
+        # Each suspension is only advised about once.
+        self.assertEqual(self._advise_idle(0), 0)
+        # The advice doesn't lose anything.
+        glet.switch()
+        self.assertTrue(glet.dead)
+
+    def test_advise_idle_pageout(self):
+        glet = self._suspended()
+        self.assertGreaterEqual(self._advise_idle(0, pageout=True), 1)
+        glet.switch()
+        self.assertTrue(glet.dead)
+
+    def test_bad_arguments(self):
+        with self.assertRaises(TypeError):
+            greenlet.advise_idle('1')
+        with self.assertRaises(TypeError):
+            greenlet.advise_idle()
+
+
+def _deep(depth):
+    if depth:
+        return _deep(depth - 1)
+    greenlet.getcurrent().parent.switch()
+    return None
+
+
+try:
+    from threading import get_ident as _get_ident
+except ImportError:
+    from thread import get_ident as _get_ident # Python 2
+
+
+class TestMemoryStats(TestCase):
+
+    def _stats(self):
+        return greenlet._greenlet.get_memory_stats()
+
+    def _mine(self):
+        return self._stats()['threads'][_get_ident()]
+
+    def test_counts_follow_greenlets(self):
+        before = self._mine()
+        glets = [greenlet.greenlet(_deep) for _ in range(4)]
+        for i, glet in enumerate(glets):
+            glet.switch(i * 100)
+        during = self._mine()
+        self.assertEqual(during['started'] - before['started'], 4)
+        self.assertEqual(during['suspended'] - before['suspended'], 4)
+
+        saved = [glet._stack_saved for glet in glets]
+        # Greenlets left over from other tests count too.
+        everything = [greenlet.getcurrent()] + greenlet.enumerate()
+        self.assertEqual(during['saved_bytes'],
+                         sum(glet._stack_saved for glet in everything))
+        del everything
+        largest = during['largest_saved_bytes']
+        self.assertGreaterEqual(largest, max(saved))
+        self.assertLessEqual(largest, max(saved) * 1.0625)
+
+        running = greenlet.greenlet(lambda: self._mine())
+        self.assertEqual(running.switch()['suspended'], during['suspended'])
+
+        for glet in glets:
+            glet.switch()
+        self.assertEqual(self._mine(), before)
+
+    def test_process_totals(self):
+        stats = self._stats()
+        self.assertIn('pool_bytes', stats)
+        for key in ('started', 'suspended', 'saved_stacks', 'saved_bytes'):
+            self.assertGreaterEqual(stats[key],
+                                    sum(t[key] for t in stats['threads'].values()))
+
+    def test_other_threads(self):
+        # Keeping a greenlet after its thread exits keeps that thread's
+        # main greenlet alive too.
+        ready = threading.Event()
+        done = threading.Event()
+        leftovers = []
+
+        def thread_main():
+            glet = greenlet.greenlet(_deep)
+            glet.switch(50)
+            leftovers.append(glet)
+            ready.set()
+            done.wait(10)
+
+        t = threading.Thread(target=thread_main)
+        t.start()
+        try:
+            ready.wait(10)
+            stats = self._stats()
+            theirs = stats['threads'][t.ident]
+            self.assertEqual(theirs['started'], 1)
+            self.assertEqual(theirs['suspended'], 1)
+            self.assertGreater(theirs['saved_bytes'], 0)
+        finally:
+            done.set()
+            t.join(10)
+        # Let the thread's state be cleaned up.
+        for _ in range(100):
+            if (not greenlet._greenlet.get_pending_cleanup_count()
+                    and t.ident not in self._stats()['threads']):
+                break
+            time.sleep(0.01)
+        stats = self._stats()
+        self.assertNotIn(t.ident, stats['threads'])
+        # The greenlet we kept still has its stack saved, and it's
+        # still accounted for.
+        self.assertGreaterEqual(stats['saved_bytes'], leftovers[0]._stack_saved)
+        self.assertGreater(leftovers[0]._stack_saved, 0)
+        # Dropping it frees its thread's main greenlet, too, which
+        # nothing else refers to any more.
+        del leftovers[:]
+        self.wait_for_pending_cleanups()
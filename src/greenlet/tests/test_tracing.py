@@ -1,5 +1,8 @@
 from __future__ import print_function
+import os
 import sys
+import time
+import unittest
 import greenlet
 
 from . import TestCase
@@ -267,3 +270,319 @@ class TestPythonTracing(TestCase):
             ('call', '__exit__'),
             ('c_call', '__exit__'),
         ])
+
+
+class TestPerfMap(TestCase):
+
+    def setUp(self):
+        super(TestPerfMap, self).setUp()
+        try:
+            self.path = greenlet._greenlet.enable_perf_map(True)
+        except OSError as ex:
+            self.skipTest("perf map not available: %s" % (ex,))
+
+    def tearDown(self):
+        # Safe to run again, after the leak checker's last run.
+        self.assertIsNone(greenlet._greenlet.enable_perf_map(False))
+        if os.path.lexists(self.path):
+            os.remove(self.path)
+        super(TestPerfMap, self).tearDown()
+
+    def test_private_file(self):
+        self.assertEqual(os.stat(self.path).st_mode & 0o777, 0o600)
+        # Somebody else's file, or a link, at that path is refused.
+        greenlet._greenlet.enable_perf_map(False)
+        os.remove(self.path)
+        os.symlink(os.devnull, self.path)
+        with self.assertRaises(OSError):
+            greenlet._greenlet.enable_perf_map(True)
+        os.remove(self.path)
+        # But ours can be reopened.
+        self.assertEqual(greenlet._greenlet.enable_perf_map(True), self.path)
+        greenlet._greenlet.enable_perf_map(False)
+        self.assertEqual(greenlet._greenlet.enable_perf_map(True), self.path)
+
+    def test_started_greenlets_are_named(self):
+        def some_run_function():
+            return greenlet.getcurrent().parent.switch(42)
+
+        glet = greenlet.greenlet(some_run_function)
+        self.assertEqual(glet.switch(), 42)
+        # Enabling again is harmless.
+        self.assertEqual(greenlet._greenlet.enable_perf_map(True), self.path)
+        glet.switch()
+        self.assertTrue(glet.dead)
+
+        with open(self.path) as f:
+            lines = f.read().splitlines()
+        start, size, name = lines[-1].split()
+        self.assertEqual(int(start, 16), id(glet))
+        self.assertGreater(int(size, 16), 0)
+        self.assertEqual(
+            name,
+            'greenlet:TestPerfMap.test_started_greenlets_are_named.<locals>.some_run_function'
+            if sys.version_info[0] >= 3 else 'greenlet:some_run_function')
+
+
+class TestSwitchLog(TestCase):
+
+    def setUp(self):
+        super(TestSwitchLog, self).setUp()
+        greenlet.enable_switch_log(True)
+
+    def tearDown(self):
+        greenlet.enable_switch_log(False)
+        super(TestSwitchLog, self).tearDown()
+
+    def test_nothing_is_logged_while_off(self):
+        greenlet.enable_switch_log(False)
+        before = greenlet.get_switch_log()
+        glet = greenlet.greenlet(greenlet.getcurrent().switch)
+        glet.switch()
+        self.assertEqual(greenlet.get_switch_log(), before)
+        glet.switch()
+
+    def test_switches_are_logged(self):
+        main = greenlet.getcurrent()
+
+        def run():
+            main.switch()
+            raise SomeError
+
+        glet = greenlet.greenlet(run)
+        before = greenlet._greenlet.get_switch_log()
+        glet.switch()
+        with self.assertRaises(SomeError):
+            glet.switch()
+        log = greenlet._greenlet.get_switch_log()
+        # The log may already be full, and shifting.
+        entries = log[-6:]
+        self.assertEqual(
+            [(event, origin, target) for _, event, origin, target, _ in entries],
+            [('switch', id(main), id(glet)),
+             ('start', id(main), id(glet)),
+             ('switch', id(glet), id(main)),
+             ('switch', id(main), id(glet)),
+             ('finish', id(glet), id(main)),
+             ('throw', id(glet), id(main))])
+        timestamps = [entry[0] for entry in entries]
+        self.assertEqual(timestamps, sorted(timestamps))
+        # Switching into the started greenlet copied some stack.
+        self.assertGreater(entries[2][4], 0)
+        self.assertNotEqual(log, before)
+
+    def test_log_is_bounded(self):
+        glet = greenlet.greenlet(lambda: [greenlet.getcurrent().parent.switch()
+                                          for _ in range(10000)])
+        for _ in range(5000):
+            glet.switch()
+        full = len(greenlet._greenlet.get_switch_log())
+        for _ in range(100):
+            glet.switch()
+        self.assertEqual(len(greenlet._greenlet.get_switch_log()), full)
+        self.assertLessEqual(full, 10000)
+        glet.throw()
+
+
+class TestSwitchLatency(TestCase):
+
+    def setUp(self):
+        super(TestSwitchLatency, self).setUp()
+        greenlet._greenlet.get_switch_latency(reset=True)
+
+    def tearDown(self):
+        if getattr(self, 'skipTearDown', False):
+            return
+        greenlet._greenlet.enable_switch_latency(False)
+        super(TestSwitchLatency, self).tearDown()
+
+    def _switch(self, count):
+        glet = greenlet.greenlet(lambda: [greenlet.getcurrent().parent.switch()
+                                          for _ in range(count)])
+        for _ in range(count + 1):
+            glet.switch()
+        self.assertTrue(glet.dead)
+
+    def test_disabled_by_default(self):
+        self._switch(10)
+        self.assertEqual(greenlet._greenlet.get_switch_latency()['count'], 0)
+
+    def test_switches_are_counted(self):
+        greenlet._greenlet.enable_switch_latency(True)
+        self._switch(100)
+        stats = greenlet._greenlet.get_switch_latency(reset=True)
+        # Into and out of the greenlet, 101 times each.
+        self.assertEqual(stats['count'], 202)
+        self.assertEqual(sum(count for _, count in stats['buckets']), 202)
+        self.assertLessEqual(stats['min'], stats['p50'])
+        self.assertLessEqual(stats['p50'], stats['p99'])
+        self.assertLessEqual(stats['p99'], stats['p999'])
+        self.assertLessEqual(stats['p999'], stats['max'])
+        self.assertLessEqual(stats['min'], stats['mean'])
+        self.assertLessEqual(stats['mean'], stats['max'])
+        self.assertGreater(stats['max'], 0)
+        values = [value for value, _ in stats['buckets']]
+        self.assertEqual(values, sorted(values))
+
+        self.assertEqual(greenlet._greenlet.get_switch_latency(),
+                         {'count': 0, 'min': 0, 'max': 0, 'mean': 0.0,
+                          'p50': 0, 'p99': 0, 'p999': 0, 'buckets': []})
+
+
+class TestTimeline(TestCase):
+
+    def setUp(self):
+        super(TestTimeline, self).setUp()
+        import tempfile
+        fd, self.path = tempfile.mkstemp(suffix='.json')
+        os.close(fd)
+
+    def tearDown(self):
+        if getattr(self, 'skipTearDown', False):
+            return
+        greenlet.stop_timeline()
+        os.remove(self.path)
+        super(TestTimeline, self).tearDown()
+
+    def _events(self):
+        import json
+        with open(self.path) as f:
+            return json.load(f)['traceEvents']
+
+    def test_spans_are_named_after_run(self):
+        def worker():
+            greenlet.getcurrent().parent.switch()
+
+        greenlet.start_timeline(self.path)
+        glet = greenlet.greenlet(worker)
+        glet.switch()
+        glet.switch()
+        greenlet.stop_timeline()
+
+        spans = [e for e in self._events() if e['ph'] == 'X']
+        main = ('main', id(greenlet.getcurrent()))
+        # Python 2 functions don't have a __qualname__.
+        worker = (getattr(worker, '__qualname__', 'function'), id(glet))
+        self.assertEqual([(e['name'], e['args']['id']) for e in spans],
+                         [main, worker, main, worker, main])
+        self.assertEqual(len(set(e['tid'] for e in spans)), 1)
+        for before, after in zip(spans, spans[1:]):
+            self.assertAlmostEqual(before['ts'] + before['dur'], after['ts'], places=2)
+
+    def test_many_switches(self):
+        glet = greenlet.greenlet(lambda: [greenlet.getcurrent().parent.switch()
+                                          for _ in range(50000)])
+        greenlet.start_timeline(self.path)
+        for _ in range(50001):
+            glet.switch()
+        greenlet.stop_timeline()
+        spans = [e for e in self._events() if e['ph'] == 'X']
+        # One span for main before each switch in, one for the
+        # greenlet before each switch out, and main's last.
+        self.assertEqual(len(spans), 100003)
+        self.assertEqual(self._load()['otherData']['dropped_records'], 0)
+
+    def _load(self):
+        import json
+        with open(self.path) as f:
+            return json.load(f)
+
+    def test_full_buffer_drops_records(self):
+        from collections import deque
+        from functools import partial
+        from itertools import repeat
+        # Pending calls only run between Python bytecodes, so switching
+        # back and forth entirely in C never gets to write anything out.
+        main = greenlet.getcurrent()
+        glet = greenlet.greenlet(partial(deque, maxlen=0))
+        glet.switch(map(main.switch, repeat(None)))
+        greenlet.start_timeline(self.path)
+        deque(map(glet.switch, repeat(None, 50000)), 0)
+        greenlet.stop_timeline()
+        glet.throw()
+        trace = self._load()
+        self.assertGreater(trace['otherData']['dropped_records'], 0)
+        spans = [e for e in trace['traceEvents'] if e['ph'] == 'X']
+        self.assertLess(len(spans), 100000)
+
+    def test_start_twice(self):
+        greenlet.start_timeline(self.path)
+        with self.assertRaises(RuntimeError):
+            greenlet.start_timeline(self.path)
+        greenlet.stop_timeline()
+        # Stopping again does nothing.
+        greenlet.stop_timeline()
+
+    def test_bad_path(self):
+        with self.assertRaises(OSError):
+            greenlet.start_timeline(os.path.join(self.path, 'not-a-directory', 'x'))
+
+
+@unittest.skipUnless(greenlet._greenlet.GREENLET_USE_WATCHDOG,
+                     "The watchdog needs Python 3")
+class TestWatchdog(TestCase):
+
+    def tearDown(self):
+        if getattr(self, 'skipTearDown', False):
+            return
+        greenlet._greenlet.disable_watchdog()
+        super(TestWatchdog, self).tearDown()
+
+    @staticmethod
+    def _stuck(seconds):
+        deadline = time.time() + seconds
+        while time.time() < deadline:
+            time.sleep(0.001)
+        return 'done'
+
+    def test_reports_stuck_greenlet(self):
+        reports = []
+        glet = greenlet.greenlet(self._stuck)
+        def callback(stuck, frame, seconds):
+            if stuck is glet:
+                reports.append((frame.f_code.co_name, seconds))
+        greenlet._greenlet.enable_watchdog(0.05, callback)
+        self.assertEqual(glet.switch(0.5), 'done')
+        greenlet._greenlet.disable_watchdog()
+        # Only once for each time it runs too long.
+        self.assertEqual(len(reports), 1)
+        name, seconds = reports[0]
+        self.assertEqual(name, '_stuck')
+        self.assertGreaterEqual(seconds, 0.05)
+
+    def test_callback_can_interrupt(self):
+        def run():
+            try:
+                self._stuck(10)
+            except KeyboardInterrupt:
+                return 'interrupted'
+            return 'not interrupted'
+        glet = greenlet.greenlet(run)
+        def callback(stuck, _frame, _seconds):
+            return KeyboardInterrupt if stuck is glet else None
+        greenlet._greenlet.enable_watchdog(0.05, callback)
+        self.assertEqual(glet.switch(), 'interrupted')
+
+    def test_default_report(self):
+        import io
+        stderr = sys.stderr
+        sys.stderr = io.StringIO()
+        try:
+            greenlet._greenlet.enable_watchdog(0.05)
+            greenlet.greenlet(self._stuck).switch(0.5)
+            greenlet._greenlet.disable_watchdog()
+            report = sys.stderr.getvalue()
+        finally:
+            sys.stderr = stderr
+        self.assertIn('without switching', report)
+        self.assertIn('in _stuck', report)
+
+    def test_bad_arguments(self):
+        with self.assertRaises(ValueError):
+            greenlet._greenlet.enable_watchdog(0)
+        with self.assertRaises(TypeError):
+            greenlet._greenlet.enable_watchdog(1, 42)
+
+    def test_disable_when_disabled(self):
+        greenlet._greenlet.disable_watchdog()
+        greenlet._greenlet.disable_watchdog()